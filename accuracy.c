@@ -0,0 +1,358 @@
+//***************************************************************************
+//
+//  File        : accuracy.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Compares trigger timestamps against ground truth under simavr
+//                with a modelled crystal, time pulse and GPS serial stream
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "protocol.h"
+#include "receiver.h"
+
+// UTC time of true second 0
+#define START_TIME 1356998400
+
+struct config
+{
+    unsigned seconds;
+    uint16_t pulsecounter_exposure;
+    uint16_t highres_exposure;
+
+    // Crystal frequency error: fixed offset plus a random walk per second
+    double offset_ppm;
+    double wander_ppm;
+
+    // Time pulse: gaussian jitter, probability of dropped and duplicated pulses
+    double pps_jitter_ns;
+    double pps_drop;
+    double pps_duplicate;
+
+    // Serial packet: delay after the pulse, uniform jitter, and probability of loss
+    double serial_latency_ms;
+    double serial_jitter_ms;
+    double serial_drop;
+
+    uint64_t seed;
+};
+
+struct trigger
+{
+    avr_cycle_count_t cycle;
+    bool reported;
+};
+
+struct run
+{
+    const struct config *config;
+
+    // Local cycle count at the start of each true second
+    avr_cycle_count_t *second_cycles;
+
+    struct trigger *triggers;
+    uint32_t trigger_count;
+
+    double *errors;
+    uint32_t error_count;
+
+    uint32_t duplicate_reports;
+    uint32_t orphan_reports;
+    uint32_t warnings;
+};
+
+static uint64_t rng_state;
+
+static double random_uniform()
+{
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (double)((rng_state * 2685821657736338717ULL) >> 11) / (double)(1ULL << 53);
+}
+
+static double random_gaussian()
+{
+    double u = random_uniform();
+    if (u < 1e-300)
+        u = 1e-300;
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * random_uniform());
+}
+
+// True time (seconds since START_TIME) of a local cycle count
+static double true_time(struct run *r, avr_cycle_count_t cycle)
+{
+    unsigned lo = 0, hi = r->config->seconds + 1;
+    while (hi - lo > 1)
+    {
+        unsigned mid = (lo + hi) / 2;
+        if (r->second_cycles[mid] <= cycle)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    double length = r->second_cycles[lo + 1] - r->second_cycles[lo];
+    return lo + (cycle - r->second_cycles[lo]) / length;
+}
+
+static void trigger_received(struct sim *sim, avr_cycle_count_t cycle, void *param)
+{
+    (void)sim;
+    struct run *r = param;
+    r->triggers = realloc(r->triggers, (r->trigger_count + 1) * sizeof(struct trigger));
+    r->triggers[r->trigger_count++] = (struct trigger){.cycle = cycle, .reported = false};
+}
+
+/*
+ * Match each TRIGGER packet to the most recent trigger pulse that preceded it
+ */
+static void packet_received(struct sim *sim, const struct protocol_packet *p, void *param)
+{
+    (void)sim;
+    struct run *r = param;
+
+    // Count pulse and drift warnings; the first data byte is the string length
+    if (p->type == PACKET_MESSAGE)
+    {
+        if (p->length > 8 && !memcmp(&p->data[1], "WARNING", 7))
+            r->warnings++;
+        return;
+    }
+
+    struct protocol_timestamp t;
+    if (p->type != PACKET_TRIGGER || !protocol_parse_timestamp(p->data, p->length, &t))
+        return;
+
+    if (!r->trigger_count)
+    {
+        r->orphan_reports++;
+        return;
+    }
+
+    struct trigger *trigger = &r->triggers[r->trigger_count - 1];
+    if (trigger->reported)
+        r->duplicate_reports++;
+    trigger->reported = true;
+
+    double reported = (protocol_timestamp_utc_ns(&t) - START_TIME * 1000000000LL) * 1e-9;
+    r->errors = realloc(r->errors, (r->error_count + 1) * sizeof(double));
+    r->errors[r->error_count++] = reported - true_time(r, trigger->cycle);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+static double percentile(const double *sorted, uint32_t count, double p)
+{
+    uint32_t i = (uint32_t)(p * (count - 1) + 0.5);
+    return sorted[i];
+}
+
+static void report(const char *mode, uint16_t exposure, struct run *r)
+{
+    uint32_t unreported = 0;
+    for (uint32_t i = 0; i < r->trigger_count; i++)
+        if (!r->triggers[i].reported)
+            unreported++;
+
+    printf("{\"mode\":\"%s\",\"exposure\":%u,\"triggers\":%u,\"reports\":%u,\"unreported\":%u,"
+           "\"duplicate_reports\":%u,\"orphan_reports\":%u,\"warnings\":%u", mode, exposure,
+           r->trigger_count, r->error_count, unreported, r->duplicate_reports, r->orphan_reports,
+           r->warnings);
+
+    if (r->error_count)
+    {
+        double sum = 0, sum2 = 0;
+        for (uint32_t i = 0; i < r->error_count; i++)
+        {
+            sum += r->errors[i];
+            sum2 += r->errors[i] * r->errors[i];
+        }
+
+        double mean = sum / r->error_count;
+        double stddev = sqrt(fmax(sum2 / r->error_count - mean * mean, 0));
+        qsort(r->errors, r->error_count, sizeof(double), compare_double);
+
+        // Error statistics in microseconds
+        printf(",\"error_us\":{\"mean\":%.3f,\"stddev\":%.3f,\"min\":%.3f,\"p01\":%.3f,\"p50\":%.3f,"
+               "\"p99\":%.3f,\"max\":%.3f}", mean * 1e6, stddev * 1e6, r->errors[0] * 1e6,
+               percentile(r->errors, r->error_count, 0.01) * 1e6,
+               percentile(r->errors, r->error_count, 0.5) * 1e6,
+               percentile(r->errors, r->error_count, 0.99) * 1e6,
+               r->errors[r->error_count - 1] * 1e6);
+
+        // Histogram of absolute error by decade
+        static const double limits[] = {1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 0.5};
+        static const char *labels[] = {"1us", "10us", "100us", "1ms", "10ms", "100ms", "500ms"};
+        uint32_t counts[8] = {0};
+        for (uint32_t i = 0; i < r->error_count; i++)
+        {
+            uint8_t j = 0;
+            while (j < 7 && fabs(r->errors[i]) > limits[j])
+                j++;
+            counts[j]++;
+        }
+
+        printf(",\"abs_error_histogram\":{");
+        for (uint8_t j = 0; j < 7; j++)
+            printf("\"<=%s\":%u,", labels[j], counts[j]);
+        printf("\">500ms\":%u}", counts[7]);
+    }
+
+    printf("}\n");
+}
+
+static bool run_mode(const char *firmware, const struct config *c, enum protocol_timing_mode mode)
+{
+    struct run r = {.config = c};
+    rng_state = c->seed ? c->seed : 1;
+
+    // Integrate the crystal frequency to find the local cycle count at each true second
+    r.second_cycles = malloc((c->seconds + 2) * sizeof(avr_cycle_count_t));
+    double cycles = 0, wander = 0;
+    for (unsigned i = 0; i < c->seconds + 2; i++)
+    {
+        r.second_cycles[i] = (avr_cycle_count_t)cycles;
+        wander += c->wander_ppm * random_gaussian();
+        cycles += SIM_FREQUENCY * (1 + (c->offset_ppm + wander) * 1e-6);
+    }
+
+    struct sim sim;
+    if (!sim_initialize(&sim, firmware))
+    {
+        free(r.second_cycles);
+        return false;
+    }
+
+    sim.packet_cb = packet_received;
+    sim.trigger_cb = trigger_received;
+    sim.cb_param = &r;
+
+    uint16_t exposure = mode == PROTOCOL_MODE_HIGHRES ? c->highres_exposure : c->pulsecounter_exposure;
+    double exposure_seconds = mode == PROTOCOL_MODE_HIGHRES ? exposure / 1000.0 : exposure;
+
+    uint8_t buf[PROTOCOL_MAX_PACKET_LENGTH];
+    size_t length = protocol_encode_start_exposure(buf, true, mode, exposure, 1, false,
+                                                   PROTOCOL_EXTERNAL_START_NONE);
+    sim_usb_send(&sim, SIM_FREQUENCY / 2, buf, length);
+    sim_monitor(&sim, SIM_FREQUENCY * 3 / 4, false);
+    sim.readout_cycles = (avr_cycle_count_t)(exposure_seconds * SIM_FREQUENCY * 0.3);
+
+    for (unsigned i = 1; i <= c->seconds; i++)
+    {
+        avr_cycle_count_t width = SIM_FREQUENCY / 100000;
+        double jitter = c->pps_jitter_ns * 1e-9 * SIM_FREQUENCY * random_gaussian();
+        avr_cycle_count_t pulse = r.second_cycles[i] + (int64_t)jitter;
+
+        if (random_uniform() >= c->pps_drop)
+            sim_pps(&sim, pulse, width);
+
+        if (random_uniform() < c->pps_duplicate)
+            sim_pps(&sim, pulse + SIM_FREQUENCY / 10, width);
+
+        if (random_uniform() >= c->serial_drop)
+        {
+            double delay = c->serial_latency_ms + c->serial_jitter_ms * random_uniform();
+            uint8_t packet[RECEIVER_MAX_PACKET_LENGTH];
+            length = receiver_encode_trimble(packet, START_TIME + i, 16, TRIMBLE_UTC_TIME | TRIMBLE_UTC_PPS);
+            sim_gps_send(&sim, pulse + (avr_cycle_count_t)(delay * 1e-3 * SIM_FREQUENCY), packet, length);
+        }
+    }
+
+    bool ok = sim_run(&sim, r.second_cycles[c->seconds + 1], NULL, NULL);
+    if (ok)
+        report(mode == PROTOCOL_MODE_HIGHRES ? "highres" : "pulsecounter", exposure, &r);
+    else
+        fprintf(stderr, "Simulation stopped unexpectedly at cycle %llu\n",
+                (unsigned long long)sim.avr->cycle);
+
+    sim_free(&sim);
+    free(r.second_cycles);
+    free(r.triggers);
+    free(r.errors);
+    return ok;
+}
+
+static void print_usage()
+{
+    printf("Usage: accuracy [options] <main.elf>\n");
+    printf("  -m <mode>     pulsecounter, highres or both (default both)\n");
+    printf("  -s <seconds>  simulated duration (default 120)\n");
+    printf("  -p <s>        pulse counter exposure in seconds (default 1)\n");
+    printf("  -h <ms>       high resolution exposure in milliseconds (default 250)\n");
+    printf("  -o <ppm>      crystal frequency offset (default 20)\n");
+    printf("  -w <ppm>      crystal random walk per second (default 0.01)\n");
+    printf("  -j <ns>       time pulse rms jitter (default 50)\n");
+    printf("  -d <p>        probability of a dropped pulse (default 0)\n");
+    printf("  -u <p>        probability of a duplicated pulse (default 0)\n");
+    printf("  -l <ms>       serial packet latency after the pulse (default 50)\n");
+    printf("  -J <ms>       serial packet latency jitter (default 20)\n");
+    printf("  -D <p>        probability of a dropped serial packet (default 0)\n");
+    printf("  -r <seed>     random seed (default 1)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct config c = {
+        .seconds = 120,
+        .pulsecounter_exposure = 1,
+        .highres_exposure = 250,
+        .offset_ppm = 20,
+        .wander_ppm = 0.01,
+        .pps_jitter_ns = 50,
+        .serial_latency_ms = 50,
+        .serial_jitter_ms = 20,
+        .seed = 1,
+    };
+    const char *mode = "both";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:s:p:h:o:w:j:d:u:l:J:D:r:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'm': mode = optarg; break;
+            case 's': c.seconds = atoi(optarg); break;
+            case 'p': c.pulsecounter_exposure = atoi(optarg); break;
+            case 'h': c.highres_exposure = atoi(optarg); break;
+            case 'o': c.offset_ppm = atof(optarg); break;
+            case 'w': c.wander_ppm = atof(optarg); break;
+            case 'j': c.pps_jitter_ns = atof(optarg); break;
+            case 'd': c.pps_drop = atof(optarg); break;
+            case 'u': c.pps_duplicate = atof(optarg); break;
+            case 'l': c.serial_latency_ms = atof(optarg); break;
+            case 'J': c.serial_jitter_ms = atof(optarg); break;
+            case 'D': c.serial_drop = atof(optarg); break;
+            case 'r': c.seed = strtoull(optarg, NULL, 0); break;
+            default: print_usage(); return 1;
+        }
+    }
+
+    if (argc - optind != 1 || !c.seconds || !c.pulsecounter_exposure || !c.highres_exposure)
+    {
+        print_usage();
+        return 1;
+    }
+
+    bool ok = true;
+    if (!strcmp(mode, "pulsecounter") || !strcmp(mode, "both"))
+        ok &= run_mode(argv[optind], &c, PROTOCOL_MODE_PULSECOUNTER);
+    if (!strcmp(mode, "highres") || !strcmp(mode, "both"))
+        ok &= run_mode(argv[optind], &c, PROTOCOL_MODE_HIGHRES);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,539 @@
+//***************************************************************************
+//
+//  File        : aggregate.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Merges the trigger and status streams from several timers
+//                into a single time-ordered stream
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "protocol.h"
+#include "record.h"
+#include "serial.h"
+
+enum source_kind {SOURCE_SERIAL, SOURCE_SOCKET, SOURCE_RECORDING};
+
+struct source
+{
+    const char *name;
+    enum source_kind kind;
+    int fd;
+
+    // Recordings are read one chunk ahead so that they can be paced
+    FILE *recording;
+    struct record_chunk *chunk;
+    bool chunk_ready;
+
+    struct protocol_decoder decoder;
+
+    // Latest event time received from this unit
+    int64_t watermark;
+    bool has_time;
+    bool finished;
+
+    uint32_t buffered;
+    uint64_t events;
+    uint64_t late;
+    uint64_t forced;
+};
+
+struct event
+{
+    int64_t time_ns;
+    int64_t received_ns;
+    uint64_t sequence;
+    uint16_t unit;
+    uint8_t type;
+    struct protocol_timestamp timestamp;
+
+    // Device frame number of a trigger, or -1 if the firmware doesn't send one
+    int64_t frame;
+    uint8_t status[2];
+};
+
+/*
+ * Binary min-heap of buffered events from all units, ordered by time
+ * Ties are broken by arrival order so that the output is deterministic
+ */
+struct heap
+{
+    struct event *events;
+    size_t count;
+    size_t capacity;
+};
+
+struct aggregator
+{
+    struct source *sources;
+    uint16_t source_count;
+    struct heap heap;
+
+    // Allowed disorder within one unit's stream (a trigger may be sent
+    // before the timestamp for the second it falls in)
+    int64_t slack_ns;
+
+    // Longest an event may wait for a silent unit before it is released
+    int64_t max_wait_ns;
+
+    // Events buffered per unit before the oldest is released regardless
+    uint32_t reorder_limit;
+
+    double speed;
+    bool fast;
+    int64_t start_ns;
+
+    uint64_t sequence;
+    int64_t last_emitted;
+    bool emitted;
+};
+
+static volatile bool running = true;
+
+static void handle_signal(int sig)
+{
+    (void)sig;
+    running = false;
+}
+
+static bool event_before(const struct event *a, const struct event *b)
+{
+    if (a->time_ns != b->time_ns)
+        return a->time_ns < b->time_ns;
+    return a->sequence < b->sequence;
+}
+
+static void heap_push(struct heap *h, const struct event *e)
+{
+    if (h->count == h->capacity)
+    {
+        h->capacity = h->capacity ? 2 * h->capacity : 1024;
+        h->events = realloc(h->events, h->capacity * sizeof(struct event));
+    }
+
+    size_t i = h->count++;
+    while (i > 0)
+    {
+        size_t parent = (i - 1) / 2;
+        if (!event_before(e, &h->events[parent]))
+            break;
+        h->events[i] = h->events[parent];
+        i = parent;
+    }
+    h->events[i] = *e;
+}
+
+static struct event heap_pop(struct heap *h)
+{
+    struct event top = h->events[0];
+    struct event last = h->events[--h->count];
+
+    size_t i = 0;
+    for (;;)
+    {
+        size_t child = 2 * i + 1;
+        if (child >= h->count)
+            break;
+        if (child + 1 < h->count && event_before(&h->events[child + 1], &h->events[child]))
+            child++;
+        if (!event_before(&h->events[child], &last))
+            break;
+        h->events[i] = h->events[child];
+        i = child;
+    }
+
+    if (h->count)
+        h->events[i] = last;
+    return top;
+}
+
+static void emit(struct aggregator *a, const struct event *e, bool forced)
+{
+    struct source *s = &a->sources[e->unit];
+    bool late = a->emitted && e->time_ns < a->last_emitted;
+    if (late)
+        s->late++;
+    if (forced)
+        s->forced++;
+
+    if (!late)
+    {
+        a->last_emitted = e->time_ns;
+        a->emitted = true;
+    }
+
+    printf("%lld.%09lld %u %s", (long long)(e->time_ns / 1000000000LL),
+           (long long)(e->time_ns % 1000000000LL), e->unit, s->name);
+
+    switch (e->type)
+    {
+        case PACKET_TRIGGER:
+            printf(" trigger");
+            if (e->frame >= 0)
+                printf(" frame=%lld", (long long)e->frame);
+            printf(" progress=%u", e->timestamp.exposure_progress);
+            break;
+        case PACKET_TIMESTAMP:
+            printf(" timestamp %s", (e->timestamp.flags & PROTOCOL_TIMESTAMP_LOCKED) ? "locked" : "unlocked");
+            break;
+        case PACKET_STATUS:
+            printf(" status timer=%u gps=%u", e->status[0], e->status[1]);
+            break;
+        case PACKET_STOP_EXPOSURE:
+            printf(" stop");
+            break;
+    }
+
+    printf("%s\n", late ? " late" : "");
+}
+
+/*
+ * Release every buffered event that no unit can still precede
+ * An event is safe once every unfinished unit has reported a time at least
+ * slack_ns past it, or once it has waited max_wait_ns for a silent unit
+ */
+static void release(struct aggregator *a, int64_t now)
+{
+    while (a->heap.count)
+    {
+        const struct event *e = &a->heap.events[0];
+        bool safe = now - e->received_ns >= a->max_wait_ns;
+        if (!safe)
+        {
+            safe = true;
+            for (uint16_t i = 0; i < a->source_count && safe; i++)
+            {
+                const struct source *s = &a->sources[i];
+                if (!s->finished && (!s->has_time || s->watermark - a->slack_ns < e->time_ns))
+                    safe = false;
+            }
+        }
+
+        if (!safe)
+            break;
+
+        struct event next = heap_pop(&a->heap);
+        a->sources[next.unit].buffered--;
+        emit(a, &next, false);
+    }
+}
+
+static void add_event(struct aggregator *a, uint16_t unit, const struct protocol_packet *p, int64_t now)
+{
+    struct source *s = &a->sources[unit];
+    struct event e = {
+        .received_ns = now,
+        .sequence = a->sequence++,
+        .unit = unit,
+        .type = p->type,
+        .frame = -1,
+    };
+
+    switch (p->type)
+    {
+        case PACKET_TRIGGER:
+        case PACKET_TIMESTAMP:
+            // Keep the frame number, so that gaps left by report thinning survive the merge
+            if (!protocol_parse_trigger(p->data, p->length, &e.timestamp, &e.frame))
+                return;
+
+            e.time_ns = protocol_timestamp_utc_ns(&e.timestamp);
+            if (!s->has_time || e.time_ns > s->watermark)
+                s->watermark = e.time_ns;
+            s->has_time = true;
+            break;
+        case PACKET_STATUS:
+        case PACKET_STOP_EXPOSURE:
+            // Untimed events are placed after the unit's latest time
+            if (p->type == PACKET_STATUS)
+            {
+                if (p->length < 2)
+                    return;
+                memcpy(e.status, p->data, 2);
+            }
+            e.time_ns = s->watermark;
+            break;
+        default:
+            return;
+    }
+
+    s->events++;
+    s->buffered++;
+    heap_push(&a->heap, &e);
+
+    // Bound the unit's reorder buffer by releasing the oldest events overall
+    while (s->buffered > a->reorder_limit)
+    {
+        struct event oldest = heap_pop(&a->heap);
+        a->sources[oldest.unit].buffered--;
+        emit(a, &oldest, true);
+    }
+}
+
+static void decode(struct aggregator *a, uint16_t unit, const uint8_t *data, size_t length, int64_t now)
+{
+    struct source *s = &a->sources[unit];
+    for (size_t i = 0; i < length; i++)
+        if (protocol_decode_byte(&s->decoder, data[i]))
+            add_event(a, unit, &s->decoder.packet, now);
+}
+
+static int connect_socket(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        fprintf(stderr, "Failed to connect to %s: %s\n", path, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Open a unit given as [name=]path
+ * The path may be a serial port, a fanout server socket, or a devreplay recording
+ */
+static bool open_source(struct source *s, char *spec)
+{
+    char *path = spec;
+    char *equals = strchr(spec, '=');
+    s->name = spec;
+    if (equals)
+    {
+        *equals = '\0';
+        path = equals + 1;
+    }
+
+    s->fd = -1;
+    protocol_decoder_init(&s->decoder);
+
+    struct stat st;
+    if (stat(path, &st))
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    if (S_ISCHR(st.st_mode))
+    {
+        s->kind = SOURCE_SERIAL;
+        s->fd = serial_open(path, SERIAL_DEFAULT_BAUD);
+        return s->fd != -1;
+    }
+
+    if (S_ISSOCK(st.st_mode))
+    {
+        s->kind = SOURCE_SOCKET;
+        s->fd = connect_socket(path);
+        return s->fd != -1;
+    }
+
+    s->kind = SOURCE_RECORDING;
+    s->recording = record_open_read(path);
+    s->chunk = malloc(sizeof(struct record_chunk));
+    return s->recording != NULL;
+}
+
+// Load the next device chunk from a recording, marking the unit finished at the end
+static void next_chunk(struct source *s)
+{
+    while ((s->chunk_ready = record_read(s->recording, s->chunk)))
+        if (s->chunk->direction == RECORD_FROM_DEVICE)
+            return;
+
+    s->finished = true;
+}
+
+static void print_usage()
+{
+    printf("Usage: aggregate [options] [name=]<source> ...\n");
+    printf("  -s <ms>       allowed disorder within one unit's stream (default 1000)\n");
+    printf("  -w <ms>       longest wait for a silent unit before releasing events (default 3000)\n");
+    printf("  -r <events>   reorder buffer length per unit (default 4096)\n");
+    printf("  -x <speed>    replay speed for recordings (default 1)\n");
+    printf("  -f            merge recordings as fast as possible (all sources must be recordings)\n");
+    printf("Sources may be serial ports, fanout sockets or devreplay recordings.\n");
+    printf("Output is one line per event: <utc> <unit> <name> <event> [fields] [late]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct aggregator a = {
+        .slack_ns = 1000000000LL,
+        .max_wait_ns = 3000000000LL,
+        .reorder_limit = 4096,
+        .speed = 1,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:w:r:x:f")) != -1)
+    {
+        switch (opt)
+        {
+            case 's': a.slack_ns = (int64_t)(atof(optarg) * 1e6); break;
+            case 'w': a.max_wait_ns = (int64_t)(atof(optarg) * 1e6); break;
+            case 'r': a.reorder_limit = atoi(optarg); break;
+            case 'x': a.speed = atof(optarg); break;
+            case 'f': a.fast = true; break;
+            default: print_usage(); return 1;
+        }
+    }
+
+    a.source_count = argc - optind;
+    if (!a.source_count || !a.reorder_limit || a.speed <= 0)
+    {
+        print_usage();
+        return 1;
+    }
+
+    a.sources = calloc(a.source_count, sizeof(struct source));
+    for (uint16_t i = 0; i < a.source_count; i++)
+    {
+        if (!open_source(&a.sources[i], argv[optind + i]))
+            return 1;
+
+        if (a.fast && a.sources[i].kind != SOURCE_RECORDING)
+        {
+            fprintf(stderr, "-f requires every source to be a recording\n");
+            return 1;
+        }
+
+        if (a.sources[i].kind == SOURCE_RECORDING)
+            next_chunk(&a.sources[i]);
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    struct pollfd *fds = calloc(a.source_count, sizeof(struct pollfd));
+    a.start_ns = serial_time_ns(CLOCK_MONOTONIC);
+
+    while (running)
+    {
+        bool active = false;
+        for (uint16_t i = 0; i < a.source_count; i++)
+            active |= !a.sources[i].finished;
+        if (!active)
+            break;
+
+        if (a.fast)
+        {
+            // Advance the recording that is furthest behind, so that
+            // every reorder buffer stays as short as possible
+            struct source *next = NULL;
+            uint16_t unit = 0;
+            for (uint16_t i = 0; i < a.source_count; i++)
+            {
+                struct source *s = &a.sources[i];
+                if (s->finished)
+                    continue;
+                if (!next || !s->has_time || (next->has_time && s->watermark < next->watermark))
+                {
+                    next = s;
+                    unit = i;
+                }
+            }
+
+            // Arrival times are meaningless here, so events never time out
+            decode(&a, unit, next->chunk->data, next->chunk->length, 0);
+            next_chunk(next);
+            release(&a, 0);
+            continue;
+        }
+
+        int64_t now = serial_time_ns(CLOCK_MONOTONIC);
+        int timeout_ms = 100;
+        for (uint16_t i = 0; i < a.source_count; i++)
+        {
+            struct source *s = &a.sources[i];
+            fds[i] = (struct pollfd){.fd = s->finished ? -1 : s->fd, .events = POLLIN};
+
+            if (s->kind == SOURCE_RECORDING && s->chunk_ready)
+            {
+                int64_t due = a.start_ns + (int64_t)(s->chunk->time_ns / a.speed);
+                int wait = due > now ? (int)((due - now + 999999) / 1000000) : 0;
+                if (wait < timeout_ms)
+                    timeout_ms = wait;
+            }
+        }
+
+        poll(fds, a.source_count, timeout_ms);
+        now = serial_time_ns(CLOCK_MONOTONIC);
+
+        for (uint16_t i = 0; i < a.source_count; i++)
+        {
+            struct source *s = &a.sources[i];
+            if (s->kind == SOURCE_RECORDING)
+            {
+                while (s->chunk_ready && a.start_ns + (int64_t)(s->chunk->time_ns / a.speed) <= now)
+                {
+                    decode(&a, i, s->chunk->data, s->chunk->length, now);
+                    next_chunk(s);
+                }
+            }
+            else if (fds[i].revents & (POLLIN | POLLERR | POLLHUP))
+            {
+                uint8_t buf[256];
+                ssize_t length = read(s->fd, buf, sizeof(buf));
+                if (length > 0)
+                    decode(&a, i, buf, length, now);
+                else if (!(length < 0 && (errno == EINTR || errno == EAGAIN)))
+                {
+                    fprintf(stderr, "Unit %u (%s) closed: %s\n", i, s->name,
+                            length ? strerror(errno) : "end of file");
+                    s->finished = true;
+                }
+            }
+        }
+
+        release(&a, now);
+        fflush(stdout);
+    }
+
+    // Everything left is now in order
+    while (a.heap.count)
+    {
+        struct event e = heap_pop(&a.heap);
+        emit(&a, &e, false);
+    }
+
+    for (uint16_t i = 0; i < a.source_count; i++)
+    {
+        struct source *s = &a.sources[i];
+        fprintf(stderr, "{\"unit\": %u, \"name\": \"%s\", \"events\": %llu, \"late\": %llu, "
+                "\"forced\": %llu, \"errors\": %u}\n", i, s->name,
+                (unsigned long long)s->events, (unsigned long long)s->late,
+                (unsigned long long)s->forced, s->decoder.errors);
+
+        if (s->fd != -1)
+            close(s->fd);
+        if (s->recording)
+            fclose(s->recording);
+        free(s->chunk);
+    }
+
+    free(fds);
+    free(a.heap.events);
+    free(a.sources);
+    return 0;
+}
@@ -0,0 +1,444 @@
+//***************************************************************************
+//
+//  File        : archive.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Append-only binary archive of triggers, timestamps and status
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "archive.h"
+
+_Static_assert(sizeof(struct archive_header) == 64, "archive header must be 64 bytes");
+_Static_assert(sizeof(struct archive_record) == 24, "archive records must be 24 bytes");
+_Static_assert(sizeof(struct archive_index_entry) == 16, "index entries must be 16 bytes");
+
+static void index_path(char *buf, size_t length, const char *path)
+{
+    snprintf(buf, length, "%s.idx", path);
+}
+
+static struct archive_header make_header(const char *magic)
+{
+    struct archive_header h = {
+        .version = ARCHIVE_VERSION,
+        .record_size = sizeof(struct archive_record),
+        .index_stride = ARCHIVE_INDEX_STRIDE,
+    };
+    memcpy(h.magic, magic, 8);
+    return h;
+}
+
+static bool check_header(const struct archive_header *h, const char *magic)
+{
+    return !memcmp(h->magic, magic, 8) && h->version == ARCHIVE_VERSION &&
+        h->record_size == sizeof(struct archive_record) && h->index_stride == ARCHIVE_INDEX_STRIDE;
+}
+
+/*
+ * Open a file for appending, creating it with a header if it is empty
+ * Returns the number of whole entries after the header, or -1 on failure
+ * A partially written final entry is discarded
+ */
+static int64_t open_append(FILE **f, const char *path, const char *magic, size_t entry_size)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st))
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    struct archive_header h;
+    int64_t count = 0;
+    if (st.st_size == 0)
+    {
+        h = make_header(magic);
+        if (write(fd, &h, sizeof(h)) != sizeof(h))
+        {
+            fprintf(stderr, "Failed to write %s\n", path);
+            close(fd);
+            return -1;
+        }
+    }
+    else
+    {
+        if (read(fd, &h, sizeof(h)) != sizeof(h) || !check_header(&h, magic))
+        {
+            fprintf(stderr, "%s is not a compatible archive\n", path);
+            close(fd);
+            return -1;
+        }
+
+        count = (st.st_size - sizeof(h)) / entry_size;
+        if (ftruncate(fd, sizeof(h) + count * entry_size))
+        {
+            close(fd);
+            return -1;
+        }
+    }
+
+    *f = fdopen(fd, "r+b");
+    fseek(*f, 0, SEEK_END);
+    return count;
+}
+
+static bool write_index_entry(struct archive_writer *w, const struct archive_record *record)
+{
+    struct archive_index_entry e = {.time_ns = record->time_ns, .frame = record->frame};
+    return fwrite(&e, sizeof(e), 1, w->index) == 1;
+}
+
+/*
+ * Open an archive for appending, creating it if necessary
+ * The index is regenerated if it does not match the data file
+ */
+bool archive_writer_open(struct archive_writer *w, const char *path)
+{
+    memset(w, 0, sizeof(struct archive_writer));
+
+    int64_t count = open_append(&w->data, path, ARCHIVE_MAGIC, sizeof(struct archive_record));
+    if (count < 0)
+        return false;
+
+    char idx[4096];
+    index_path(idx, sizeof(idx), path);
+    int64_t index_count = open_append(&w->index, idx, ARCHIVE_INDEX_MAGIC, sizeof(struct archive_index_entry));
+    if (index_count < 0)
+    {
+        fclose(w->data);
+        return false;
+    }
+
+    w->count = count;
+    w->last_device_frame = -1;
+    int64_t expected = (count + ARCHIVE_INDEX_STRIDE - 1) / ARCHIVE_INDEX_STRIDE;
+    if (index_count != expected)
+    {
+        fprintf(stderr, "Rebuilding index for %s\n", path);
+        if (ftruncate(fileno(w->index), sizeof(struct archive_header)))
+            return false;
+        fseek(w->index, 0, SEEK_END);
+
+        for (int64_t i = 0; i < count; i += ARCHIVE_INDEX_STRIDE)
+        {
+            struct archive_record record;
+            fseek(w->data, sizeof(struct archive_header) + i * sizeof(struct archive_record), SEEK_SET);
+            if (fread(&record, sizeof(record), 1, w->data) != 1 || !write_index_entry(w, &record))
+                return false;
+        }
+    }
+
+    // Continue the frame numbering and time ordering from the last record
+    if (count)
+    {
+        struct archive_record last;
+        fseek(w->data, sizeof(struct archive_header) + (count - 1) * sizeof(struct archive_record), SEEK_SET);
+        if (fread(&last, sizeof(last), 1, w->data) != 1)
+            return false;
+
+        w->next_frame = last.frame + (last.type == PACKET_TRIGGER ? 1 : 0);
+        w->next_trigger = w->next_frame;
+        w->last_time_ns = w->last_written_ns = last.time_ns;
+    }
+
+    fseek(w->data, 0, SEEK_END);
+    return true;
+}
+
+static void write_record(struct archive_writer *w, struct archive_record *record)
+{
+    if (record->time_ns < w->last_written_ns)
+        record->flags |= ARCHIVE_FLAG_LATE;
+    else
+        w->last_written_ns = record->time_ns;
+
+    // Triggers were numbered on arrival
+    if (record->type != PACKET_TRIGGER)
+        record->frame = w->next_frame;
+    else if (record->frame >= w->next_frame)
+        w->next_frame = record->frame + 1;
+
+    if (w->count % ARCHIVE_INDEX_STRIDE == 0)
+        write_index_entry(w, record);
+
+    fwrite(record, sizeof(struct archive_record), 1, w->data);
+    w->count++;
+}
+
+// Write the oldest pending record
+static void flush_one(struct archive_writer *w)
+{
+    write_record(w, &w->pending[0]);
+    memmove(&w->pending[0], &w->pending[1], --w->pending_count * sizeof(struct archive_record));
+}
+
+/*
+ * Convert a packet from the timer into a record
+ * Records wait in a short insertion-sorted buffer because a trigger can
+ * be sent before the timestamp for the second that it falls in
+ */
+static void add_record(struct archive_writer *w, const struct archive_record *record)
+{
+    if (w->pending_count == ARCHIVE_REORDER_LENGTH)
+        flush_one(w);
+
+    uint8_t i = w->pending_count++;
+    while (i > 0 && w->pending[i - 1].time_ns > record->time_ns)
+    {
+        w->pending[i] = w->pending[i - 1];
+        i--;
+    }
+    w->pending[i] = *record;
+}
+
+/*
+ * Give a trigger the timer's frame number, or the next consecutive number
+ * if the timer (older firmware) doesn't send one
+ */
+static void number_trigger(struct archive_writer *w, struct archive_record *record, int64_t frame)
+{
+    if (frame < 0)
+    {
+        record->frame = w->next_trigger++;
+        return;
+    }
+
+    // A new sequence restarts the timer's count
+    if (frame < w->last_device_frame || w->last_device_frame < 0)
+        w->frame_base = frame >= w->next_trigger ? 0 : w->next_trigger - frame;
+
+    w->last_device_frame = frame;
+    record->frame = w->frame_base + frame;
+    if (record->frame >= w->next_trigger)
+        w->next_trigger = record->frame + 1;
+}
+
+void archive_write_packet(struct archive_writer *w, const struct protocol_packet *p)
+{
+    struct archive_record record = {.type = p->type};
+    struct protocol_timestamp t;
+    struct protocol_frames frames;
+    int64_t frame = -1;
+
+    switch (p->type)
+    {
+        case PACKET_TRIGGER:
+        case PACKET_TIMESTAMP:
+            if (!protocol_parse_trigger(p->data, p->length, &t, &frame))
+                return;
+            if (p->type == PACKET_TRIGGER)
+                number_trigger(w, &record, frame);
+            record.time_ns = protocol_timestamp_utc_ns(&t);
+            record.flags = t.flags;
+            record.exposure_progress = t.exposure_progress;
+            record.utc_offset = t.utc_offset;
+            if (record.time_ns > w->last_time_ns)
+                w->last_time_ns = record.time_ns;
+            break;
+        case PACKET_FRAMES:
+            // Each captured frame is archived as a trigger
+            if (!protocol_parse_frames(p->data, p->length, &frames))
+                return;
+            record.type = PACKET_TRIGGER;
+            record.flags = frames.base.flags;
+            record.utc_offset = frames.base.utc_offset;
+            for (uint8_t i = 0; i < frames.count; i++)
+            {
+                record.frame = w->next_trigger++;
+                record.time_ns = protocol_frame_utc_ns(&frames, i);
+                if (record.time_ns > w->last_time_ns)
+                    w->last_time_ns = record.time_ns;
+                add_record(w, &record);
+            }
+            return;
+        case PACKET_STATUS:
+            if (p->length < 2)
+                return;
+            record.time_ns = w->last_time_ns;
+            record.timer = p->data[0];
+            record.gps = p->data[1];
+            break;
+        case PACKET_STOP_EXPOSURE:
+            record.time_ns = w->last_time_ns;
+            break;
+        default:
+            return;
+    }
+
+    add_record(w, &record);
+}
+
+bool archive_writer_close(struct archive_writer *w)
+{
+    while (w->pending_count)
+        flush_one(w);
+
+    bool ok = !ferror(w->data) && !ferror(w->index);
+    ok &= fclose(w->index) == 0;
+    ok &= fclose(w->data) == 0;
+    return ok;
+}
+
+static const void *map_file(const char *path, const char *magic, int *fd, size_t *size)
+{
+    struct stat st;
+    *fd = open(path, O_RDONLY);
+    if (*fd == -1 || fstat(*fd, &st) || (size_t)st.st_size < sizeof(struct archive_header))
+    {
+        fprintf(stderr, "Failed to open %s\n", path);
+        if (*fd != -1)
+            close(*fd);
+        *fd = -1;
+        return NULL;
+    }
+
+    *size = st.st_size;
+    const void *addr = mmap(NULL, *size, PROT_READ, MAP_SHARED, *fd, 0);
+    if (addr == MAP_FAILED || !check_header(addr, magic))
+    {
+        fprintf(stderr, "%s is not a compatible archive\n", path);
+        if (addr != MAP_FAILED)
+            munmap((void *)addr, *size);
+        close(*fd);
+        *fd = -1;
+        return NULL;
+    }
+
+    return addr;
+}
+
+/*
+ * Map an archive for reading
+ * Records without an index entry (e.g. a missing or stale index) are
+ * still found, by searching the data directly
+ */
+bool archive_reader_open(struct archive_reader *r, const char *path)
+{
+    memset(r, 0, sizeof(struct archive_reader));
+    r->index_fd = -1;
+
+    const uint8_t *data = map_file(path, ARCHIVE_MAGIC, &r->data_fd, &r->data_size);
+    if (!data)
+        return false;
+
+    r->records = (const struct archive_record *)(data + sizeof(struct archive_header));
+    r->count = (r->data_size - sizeof(struct archive_header)) / sizeof(struct archive_record);
+
+    char idx[4096];
+    index_path(idx, sizeof(idx), path);
+    const uint8_t *index = map_file(idx, ARCHIVE_INDEX_MAGIC, &r->index_fd, &r->index_size);
+    if (index)
+    {
+        r->index = (const struct archive_index_entry *)(index + sizeof(struct archive_header));
+        r->index_count = (r->index_size - sizeof(struct archive_header)) / sizeof(struct archive_index_entry);
+
+        // Ignore entries beyond the data (e.g. if the data was truncated)
+        uint64_t max = (r->count + ARCHIVE_INDEX_STRIDE - 1) / ARCHIVE_INDEX_STRIDE;
+        if (r->index_count > max)
+            r->index_count = max;
+    }
+
+    return true;
+}
+
+void archive_reader_close(struct archive_reader *r)
+{
+    if (r->records)
+        munmap((uint8_t *)r->records - sizeof(struct archive_header), r->data_size);
+    if (r->index)
+        munmap((uint8_t *)r->index - sizeof(struct archive_header), r->index_size);
+    if (r->data_fd != -1)
+        close(r->data_fd);
+    if (r->index_fd != -1)
+        close(r->index_fd);
+}
+
+/*
+ * Narrow [*lo, *hi) to the records covered by the last index entry whose key is below the target
+ * The index holds the first record of each block, so the answer lies in that block or at the start of the next
+ */
+static void index_range(const struct archive_reader *r, bool by_time, int64_t key, uint64_t *lo, uint64_t *hi)
+{
+    *lo = 0;
+    *hi = r->count;
+    if (!r->index_count)
+        return;
+
+    uint64_t a = 0, b = r->index_count;
+    while (a < b)
+    {
+        uint64_t mid = a + (b - a) / 2;
+        int64_t k = by_time ? r->index[mid].time_ns : (int64_t)r->index[mid].frame;
+        if (k < key)
+            a = mid + 1;
+        else
+            b = mid;
+    }
+
+    // Entries [0, a) are below the key
+    if (a > 0)
+        *lo = (a - 1) * ARCHIVE_INDEX_STRIDE;
+    if (a < r->index_count)
+        *hi = a * ARCHIVE_INDEX_STRIDE + 1;
+    if (*hi > r->count)
+        *hi = r->count;
+}
+
+/*
+ * Find the first record at or after time_ns
+ * Returns r->count if there is none
+ */
+uint64_t archive_find_time(const struct archive_reader *r, int64_t time_ns)
+{
+    uint64_t lo, hi;
+    index_range(r, true, time_ns, &lo, &hi);
+    while (lo < hi)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (r->records[mid].time_ns < time_ns)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/*
+ * Find the trigger record with the given frame number
+ * Returns the record number, or -1 if there is none
+ */
+int64_t archive_find_frame(const struct archive_reader *r, uint32_t frame)
+{
+    uint64_t lo, hi;
+    index_range(r, false, frame, &lo, &hi);
+    while (lo < hi)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (r->records[mid].frame < frame)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    // Skip the non-trigger records that precede the trigger
+    for (; lo < r->count && r->records[lo].frame == frame; lo++)
+        if (r->records[lo].type == PACKET_TRIGGER)
+            return lo;
+
+    return -1;
+}
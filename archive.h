@@ -0,0 +1,121 @@
+//***************************************************************************
+//
+//  File        : archive.h
+//  Copyright   : 2013 Paul Chote
+//  Description : Append-only binary archive of triggers, timestamps and status
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#ifndef KARAKA_ARCHIVE_H
+#define KARAKA_ARCHIVE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include "protocol.h"
+
+/*
+ * An archive is a data file of fixed-size records sorted by time, and a
+ * sparse index (<path>.idx) holding the time and frame number of every
+ * ARCHIVE_INDEX_STRIDE'th record. Both are little-endian and are read by
+ * mapping them directly into memory. The index can always be rebuilt from
+ * the data file, which is the only copy of the events.
+ */
+#define ARCHIVE_MAGIC "KRKARC1\0"
+#define ARCHIVE_INDEX_MAGIC "KRKIDX1\0"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_INDEX_STRIDE 1024
+
+// Records are sorted by time within this many records of arrival order
+#define ARCHIVE_REORDER_LENGTH 64
+
+// Set on records that arrived too late to be stored in time order
+#define ARCHIVE_FLAG_LATE 0x80
+
+struct archive_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t index_stride;
+    uint32_t reserved[11];
+};
+
+/*
+ * Trigger records carry the timer's own frame number, so that thinned or
+ * lost reports leave gaps. If a new sequence restarts the count below the
+ * archive's last number, that sequence is offset to continue from it.
+ * Triggers from older firmware and captured frames are numbered
+ * consecutively. Other records carry the number after the latest trigger,
+ * so that frame numbers never decrease through the file
+ */
+struct archive_record
+{
+    int64_t time_ns;
+    uint32_t frame;
+    uint8_t type;
+    uint8_t flags;
+    uint16_t exposure_progress;
+    int16_t utc_offset;
+    uint8_t timer;
+    uint8_t gps;
+    uint8_t reserved[4];
+};
+
+struct archive_index_entry
+{
+    int64_t time_ns;
+    uint32_t frame;
+    uint32_t reserved;
+};
+
+struct archive_writer
+{
+    FILE *data;
+    FILE *index;
+    uint64_t count;
+    uint32_t next_frame;
+
+    // Numbering of triggers as they arrive: the next consecutive number,
+    // and the offset applied to the timer's numbers in this sequence
+    uint32_t next_trigger;
+    uint32_t frame_base;
+    int64_t last_device_frame;
+
+    // Latest time seen, used for records without their own time
+    int64_t last_time_ns;
+    int64_t last_written_ns;
+
+    struct archive_record pending[ARCHIVE_REORDER_LENGTH];
+    uint8_t pending_count;
+};
+
+struct archive_reader
+{
+    int data_fd;
+    int index_fd;
+    size_t data_size;
+    size_t index_size;
+
+    const struct archive_record *records;
+    uint64_t count;
+
+    const struct archive_index_entry *index;
+    uint64_t index_count;
+};
+
+bool archive_writer_open(struct archive_writer *w, const char *path);
+void archive_write_packet(struct archive_writer *w, const struct protocol_packet *p);
+bool archive_writer_close(struct archive_writer *w);
+
+bool archive_reader_open(struct archive_reader *r, const char *path);
+void archive_reader_close(struct archive_reader *r);
+uint64_t archive_find_time(const struct archive_reader *r, int64_t time_ns);
+int64_t archive_find_frame(const struct archive_reader *r, uint32_t frame);
+
+#endif
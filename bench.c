@@ -0,0 +1,326 @@
+//***************************************************************************
+//
+//  File        : bench.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Cycle-accurate profiler for main.elf running under simavr
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "protocol.h"
+#include "receiver.h"
+
+#define MAX_SYMBOLS 1024
+#define MAX_DEPTH 32
+
+// 35 vectors of 4 bytes at the start of flash
+#define VECTOR_TABLE_END 0x8C
+
+struct symbol
+{
+    uint32_t address;
+    char name[64];
+};
+
+struct profile
+{
+    // Name reported in the results
+    const char *label;
+
+    // Symbol from avr-nm
+    const char *symbol;
+
+    // Report per-packet cost (total / packets) instead of per-call
+    bool per_packet;
+
+    uint32_t address;
+    uint64_t calls;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+};
+
+static struct profile profiles[] = {
+    {.label = "TIMER1_COMPA_vect", .symbol = "__vector_13"},
+    {.label = "PCINT3_vect", .symbol = "__vector_7"},
+    {.label = "gps_tick", .symbol = "gps_tick", .per_packet = true},
+    {.label = "queue_data", .symbol = "queue_data"},
+    {.label = "display_update", .symbol = "display_update"},
+};
+#define PROFILE_COUNT (sizeof(profiles) / sizeof(profiles[0]))
+
+struct frame
+{
+    struct profile *profile;
+    bool interrupt;
+    uint32_t return_pc;
+    uint16_t sp;
+    avr_cycle_count_t start;
+
+    // Cycles spent in interrupts that fired during this call
+    avr_cycle_count_t interrupted;
+};
+
+struct profiler
+{
+    struct symbol symbols[MAX_SYMBOLS];
+    uint32_t symbol_count;
+
+    // Entry addresses of all interrupt handlers
+    uint32_t vectors[64];
+    uint32_t vector_count;
+
+    struct frame stack[MAX_DEPTH];
+    uint8_t depth;
+    uint32_t last_pc;
+    uint16_t last_sp;
+
+    uint64_t gps_packets;
+    uint64_t usb_packets[256];
+};
+
+static bool load_symbols(struct profiler *p, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        fprintf(stderr, "Failed to open symbol file: %s\n", path);
+        return false;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), f) && p->symbol_count < MAX_SYMBOLS)
+    {
+        struct symbol *s = &p->symbols[p->symbol_count];
+        char type;
+        if (sscanf(line, "%x %c %63s", &s->address, &type, s->name) != 3)
+            continue;
+
+        if (type != 'T' && type != 't')
+            continue;
+
+        if (!strncmp(s->name, "__vector_", 9) && p->vector_count < 64)
+            p->vectors[p->vector_count++] = s->address;
+
+        p->symbol_count++;
+    }
+
+    fclose(f);
+    return true;
+}
+
+static bool find_symbol(struct profiler *p, const char *name, uint32_t *address)
+{
+    for (uint32_t i = 0; i < p->symbol_count; i++)
+    {
+        if (!strcmp(p->symbols[i].name, name))
+        {
+            *address = p->symbols[i].address;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void enter(struct profiler *p, struct sim *sim, struct profile *profile, bool interrupt)
+{
+    if (p->depth == MAX_DEPTH)
+        return;
+
+    // The 16-bit return address (in words) is at the top of the stack
+    uint16_t sp = sim_sp(sim);
+    uint8_t *data = sim->avr->data;
+    struct frame *f = &p->stack[p->depth++];
+    f->profile = profile;
+    f->interrupt = interrupt;
+    f->return_pc = ((data[sp + 1] << 8) | data[sp + 2]) * 2;
+    f->sp = sp;
+    f->start = sim->avr->cycle;
+    f->interrupted = 0;
+}
+
+static void leave(struct profiler *p, struct sim *sim)
+{
+    struct frame *f = &p->stack[--p->depth];
+    avr_cycle_count_t elapsed = sim->avr->cycle - f->start;
+
+    // Exclude interrupt time from everything that was interrupted
+    if (f->interrupt)
+        for (uint8_t i = 0; i < p->depth; i++)
+            p->stack[i].interrupted += elapsed;
+
+    struct profile *profile = f->profile;
+    if (!profile)
+        return;
+
+    elapsed -= f->interrupted;
+    if (!profile->calls || elapsed < profile->min)
+        profile->min = elapsed;
+    if (elapsed > profile->max)
+        profile->max = elapsed;
+    profile->total += elapsed;
+    profile->calls++;
+}
+
+static void step(struct sim *sim, void *param)
+{
+    struct profiler *p = param;
+    uint32_t pc = sim->avr->pc;
+    uint16_t sp = sim_sp(sim);
+    uint32_t last_pc = p->last_pc;
+    uint16_t last_sp = p->last_sp;
+    p->last_pc = pc;
+    p->last_sp = sp;
+
+    // Returned from the innermost tracked call
+    if (p->depth)
+    {
+        struct frame *f = &p->stack[p->depth - 1];
+        if (pc == f->return_pc && sp == f->sp + 2)
+        {
+            leave(p, sim);
+            return;
+        }
+    }
+
+    // Only count arrivals via a call (which pushes the return address)
+    // or via the vector table, not loops that branch back to the entry
+    if (sp != last_sp - 2 && last_pc >= VECTOR_TABLE_END)
+        return;
+
+    struct profile *profile = NULL;
+    for (uint8_t i = 0; i < PROFILE_COUNT; i++)
+        if (profiles[i].address == pc)
+            profile = &profiles[i];
+
+    bool interrupt = false;
+    for (uint8_t i = 0; i < p->vector_count; i++)
+        if (p->vectors[i] == pc)
+            interrupt = true;
+
+    if (profile || interrupt)
+        enter(p, sim, profile, interrupt);
+}
+
+static void packet_received(struct sim *sim, const struct protocol_packet *packet, void *param)
+{
+    (void)sim;
+    struct profiler *p = param;
+    p->usb_packets[packet->type]++;
+}
+
+static void print_usage()
+{
+    printf("Usage: bench [-s seconds] [-e exposure ms] <main.elf> <main.sym>\n");
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned seconds = 10;
+    unsigned exposure = 100;
+
+    int c;
+    while ((c = getopt(argc, argv, "s:e:")) != -1)
+    {
+        switch (c)
+        {
+            case 's': seconds = atoi(optarg); break;
+            case 'e': exposure = atoi(optarg); break;
+            default: print_usage(); return 1;
+        }
+    }
+
+    if (argc - optind != 2 || !seconds || !exposure)
+    {
+        print_usage();
+        return 1;
+    }
+
+    static struct profiler p;
+    if (!load_symbols(&p, argv[optind + 1]))
+        return 1;
+
+    for (uint8_t i = 0; i < PROFILE_COUNT; i++)
+        if (!find_symbol(&p, profiles[i].symbol, &profiles[i].address))
+            fprintf(stderr, "Symbol %s not found (inlined?)\n", profiles[i].symbol);
+
+    struct sim sim;
+    if (!sim_initialize(&sim, argv[optind]))
+        return 1;
+
+    sim.packet_cb = packet_received;
+    sim.cb_param = &p;
+
+    // Start a high resolution sequence once the firmware has initialized
+    uint8_t buf[PROTOCOL_MAX_PACKET_LENGTH];
+    size_t length = protocol_encode_start_exposure(buf, true, PROTOCOL_MODE_HIGHRES, exposure, 1, false,
+                                                   PROTOCOL_EXTERNAL_START_NONE);
+    sim_usb_send(&sim, SIM_FREQUENCY / 5, buf, length);
+
+    // Camera becomes ready 100ms later, and reads out for 30% of each exposure
+    sim_monitor(&sim, SIM_FREQUENCY / 5 + SIM_FREQUENCY / 10, false);
+    sim.readout_cycles = (avr_cycle_count_t)exposure * SIM_FREQUENCY * 3 / 10000;
+
+    // 10us time pulse each second, followed by an 8F-AB packet 50ms later
+    time_t start = 1356998400;
+    for (unsigned i = 1; i <= seconds; i++)
+    {
+        avr_cycle_count_t pulse = (avr_cycle_count_t)i * SIM_FREQUENCY;
+        sim_pps(&sim, pulse, SIM_FREQUENCY / 100000);
+
+        uint8_t packet[RECEIVER_MAX_PACKET_LENGTH];
+        length = receiver_encode_trimble(packet, start + i, 16, TRIMBLE_UTC_TIME | TRIMBLE_UTC_PPS);
+        sim_gps_send(&sim, pulse + SIM_FREQUENCY / 20, packet, length);
+        p.gps_packets++;
+    }
+
+    if (!sim_run(&sim, (avr_cycle_count_t)(seconds + 1) * SIM_FREQUENCY, step, &p))
+    {
+        fprintf(stderr, "Simulation stopped unexpectedly at cycle %llu\n",
+                (unsigned long long)sim.avr->cycle);
+        sim_free(&sim);
+        return 1;
+    }
+
+    // Results are printed as one JSON object per line
+    printf("{\"benchmark\":\"config\",\"frequency\":%lu,\"seconds\":%u,\"exposure_ms\":%u,"
+           "\"triggers\":%llu,\"trigger_packets\":%llu,\"gps_packets\":%llu,\"spi_bytes\":%llu}\n",
+           SIM_FREQUENCY, seconds, exposure, (unsigned long long)sim.triggers,
+           (unsigned long long)p.usb_packets[PACKET_TRIGGER], (unsigned long long)p.gps_packets,
+           (unsigned long long)sim.spi_bytes);
+
+    for (uint8_t i = 0; i < PROFILE_COUNT; i++)
+    {
+        struct profile *r = &profiles[i];
+        if (!r->address)
+        {
+            printf("{\"benchmark\":\"%s\",\"missing\":true}\n", r->label);
+            continue;
+        }
+
+        printf("{\"benchmark\":\"%s\",\"unit\":\"cycles\",\"calls\":%llu,\"total\":%llu,"
+               "\"min\":%llu,\"mean\":%.1f,\"max\":%llu", r->label,
+               (unsigned long long)r->calls, (unsigned long long)r->total,
+               (unsigned long long)r->min, r->calls ? (double)r->total / r->calls : 0,
+               (unsigned long long)r->max);
+
+        // Most calls find no data to process, so estimate the
+        // per-packet cost from the cycles above the idle minimum
+        if (r->per_packet && p.gps_packets)
+            printf(",\"packets\":%llu,\"per_packet\":%.1f", (unsigned long long)p.gps_packets,
+                   (double)(r->total - r->calls * r->min) / p.gps_packets);
+        printf("}\n");
+    }
+
+    sim_free(&sim);
+    return 0;
+}
@@ -16,6 +16,11 @@
 #define BYPASS_DISABLED 0xFF
 #define BYPASS_ENABLED 0x42
 
+// Set while the bootloader is running, so that the watchdog reset used to
+// leave it isn't reported to the application as a watchdog reset
+#define BOOT_ACTIVE 0x42
+uint8_t boot_active __attribute__ ((section(".noinit")));
+
 // Disable watchdog timer early in boot
 uint8_t boot_mcusr __attribute__ ((section(".noinit")));
 void wdt_init(void) __attribute__((naked)) __attribute__((section(".init3")));
@@ -161,11 +166,20 @@ int main(void)
 
 	if (skip_bootloader)
     {
+        // Pass the reset cause to the application, which uses it to decide
+        // whether to resume an interrupted exposure sequence
+        uint8_t flags = boot_mcusr;
+        if (boot_active == BOOT_ACTIVE)
+            flags = (flags & ~_BV(WDRF)) | _BV(EXTRF);
+        boot_active = 0;
+        GPIOR0 = flags;
+
         boot_spm_busy_wait();
         boot_rww_enable();
         asm("jmp 0000");
     }
 
+    boot_active = BOOT_ACTIVE;
     initbootuart();
 
     // Exit bootloader if no data is recieved after ~1 second
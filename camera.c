@@ -11,8 +11,10 @@
 //***************************************************************************
 
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 #include "camera.h"
 #include "main.h"
+#include "usb.h"
 
 enum monitor_mode {MONITOR_IDLE, MONITOR_START, MONITOR_ACQUIRING, MONITOR_STOP};
 volatile enum monitor_mode monitor_mode = MONITOR_IDLE;
@@ -30,6 +32,25 @@ bool monitor_camera_status = true;
 // 1 second
 #define SIMULATED_SHUTDOWN 0x2625
 
+// MODE_CAMERAMASTER: the camera free-runs on its own clock, and the edges of
+// its frame output on the monitor input (PD6, which is also ICP1) are
+// timestamped by Timer1 input capture (falling edge, as START_MILLISECOND_TIMER
+// leaves ICES1 clear). Timer1 runs the millisecond count as
+// in MODE_HIGHRES (through COMPB, so the trigger interrupt stays disabled),
+// so frame times are on the same scale as MODE_HIGHRES trigger times.
+// Frames fill one batch while the main loop sends the other
+static struct frame_batch frame_batches[2];
+static volatile uint8_t batch_filling = 0;
+static uint8_t batch_length = 1;
+
+// Milliseconds since capture started; unlike millisecond_count this is
+// never adjusted when a new second arrives, so batch offsets stay valid
+static volatile uint32_t frame_clock;
+static uint32_t batch_base_clock;
+static uint32_t frame_number;
+static volatile uint16_t frames_dropped;
+static volatile bool flush_requested = false;
+
 void camera_initialize()
 {
     // Set pin as an output, initially high
@@ -90,6 +111,16 @@ static void simulate_camera_busy(uint16_t timer_cnt)
 // simulated internally using fixed delays
 void camera_start_exposing(bool monitor_camera)
 {
+    if (timing_mode == MODE_CAMERAMASTER)
+    {
+        // The camera is already running: there is nothing to wait for,
+        // and the monitor input is carrying the frame clock
+        monitor_camera_status = false;
+        monitor_mode = MONITOR_ACQUIRING;
+        set_timer_status(TIMER_ALIGN);
+        return;
+    }
+
     monitor_camera_status = monitor_camera;
     monitor_mode = MONITOR_START;
 
@@ -99,6 +130,103 @@ void camera_start_exposing(bool monitor_camera)
     set_timer_status(TIMER_WAITING);
 }
 
+// Rejoin a sequence that was interrupted by a watchdog reset
+// The camera is assumed to still be acquiring, so skip the startup wait
+// and align with the original exposure grid at the next time pulse
+void camera_resume_exposing(bool monitor_camera)
+{
+    monitor_camera_status = monitor_camera;
+    monitor_mode = MONITOR_ACQUIRING;
+    set_timer_status(TIMER_ALIGN);
+}
+
+// Acquisition program wants to start observing a free-running camera
+// Timer1 is started and capture enabled at the next time pulse
+void camera_start_capture(uint16_t length)
+{
+    if (length < 1)
+        length = 1;
+    else if (length > FRAME_BATCH_MAX)
+        length = FRAME_BATCH_MAX;
+
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+    {
+        batch_length = length;
+        frame_batches[0].count = frame_batches[1].count = 0;
+        batch_filling = 0;
+        frame_clock = 0;
+        frame_number = 0;
+        frames_dropped = 0;
+        flush_requested = false;
+    }
+
+    // Count milliseconds at the same point in the timer cycle as COMPA
+    OCR1B = OCR1A;
+}
+
+// Disable frame capture and send any frames that are still buffered
+void camera_stop_capture()
+{
+    if (!(TIMSK1 & _BV(ICIE1)))
+        return;
+
+    TIMSK1 = _BV(OCIE1A);
+    camera_flush_frames();
+}
+
+// Send the partially filled batch, so that slow frame rates aren't delayed
+void camera_flush_frames()
+{
+    flush_requested = true;
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+    {
+        message_flags |= FLAG_SEND_FRAMES;
+    }
+}
+
+// Hand the filling batch to the main loop, if it has finished with the other
+static void swap_batches()
+{
+    if (frame_batches[!batch_filling].count)
+        return;
+
+    batch_filling = !batch_filling;
+    message_flags |= FLAG_SEND_FRAMES;
+}
+
+// Called from the main loop to send completed (or flushed) batches
+void camera_send_frames()
+{
+    for (;;)
+    {
+        struct frame_batch *b;
+        ATOMIC_BLOCK(ATOMIC_FORCEON)
+        {
+            if (!frame_batches[!batch_filling].count)
+            {
+                uint8_t count = frame_batches[batch_filling].count;
+                if (count == batch_length || (flush_requested && count))
+                    batch_filling = !batch_filling;
+                flush_requested = false;
+            }
+
+            b = &frame_batches[!batch_filling];
+            if (b->count)
+            {
+                b->dropped = frames_dropped;
+                frames_dropped = 0;
+            }
+        }
+
+        if (!b->count)
+            return;
+
+        // The interrupt won't touch this batch until count is cleared
+        usb_send_frames(b);
+        b->count = 0;
+    }
+}
+
 // Acquisition program wants to stop exposing
 // Set monitor mode and wait for the camera to
 // finish exposing
@@ -127,6 +255,21 @@ void camera_stop_exposing()
     }
 }
 
+// Acquisition program wants to stop exposing without waiting for the
+// camera to finish a readout. A trigger pulse that has already started
+// is left to complete, so that the camera never sees a runt pulse
+void camera_abort_exposing()
+{
+    // Cancel any pending debounce or simulated delay
+    TCCR3B = _BV(WGM32);
+    if (!monitor_camera_status)
+        camera_status = CAMERA_READY;
+
+    monitor_mode = MONITOR_IDLE;
+    message_flags |= FLAG_STOP_EXPOSURE;
+    set_timer_status(TIMER_IDLE);
+}
+
 // Act on status change after a debounce period (if monitoring status)
 // or a fixed delay (if simulated status)
 ISR(TIMER3_COMPA_vect)
@@ -146,8 +289,9 @@ ISR(TIMER3_COMPA_vect)
             set_timer_status(TIMER_ALIGN);
             break;
         case MONITOR_ACQUIRING:
-            // Suppress status updates for exposures < 500ms
-            if (timing_mode == MODE_HIGHRES && exposure_total < 500)
+            // Suppress status updates for exposures < 500ms,
+            // and while waiting for an external start
+            if ((timing_mode == MODE_HIGHRES && exposure_total < 500) || timer_status == TIMER_ARMED)
                 break;
             if (status == CAMERA_BUSY)
                 set_timer_status(TIMER_READOUT);
@@ -188,3 +332,52 @@ ISR(TIMER0_COMPA_vect)
     PORTD &= ~_BV(PD5);
 }
 
+
+// Millisecond count in MODE_CAMERAMASTER
+ISR(TIMER1_COMPB_vect)
+{
+    millisecond_count++;
+    frame_clock++;
+}
+
+// Frame edge from the camera in MODE_CAMERAMASTER
+ISR(TIMER1_CAPT_vect)
+{
+    uint16_t ticks = ICR1;
+    uint16_t count = millisecond_count;
+    uint32_t clock = frame_clock;
+
+    // Capture has priority over the compare interrupt, so a pending compare
+    // means that the timer wrapped before or after the edge: tell from ticks
+    if (bit_is_set(TIFR1, OCF1B) && ticks < 5000)
+    {
+        count++;
+        clock++;
+    }
+
+    frame_number++;
+    if (--trigger_countdown != 0)
+        return;
+    trigger_countdown = trigger_stride;
+
+    struct frame_batch *b = &frame_batches[batch_filling];
+    if (b->count == batch_length)
+    {
+        // Both batches are waiting for the serial link
+        if (frames_dropped != 0xFFFF)
+            frames_dropped++;
+        return;
+    }
+
+    if (b->count == 0)
+    {
+        b->base = current_timestamp;
+        b->base.milliseconds = count;
+        b->first_frame = frame_number;
+        batch_base_clock = clock;
+    }
+
+    b->offsets[b->count++] = (clock - batch_base_clock) * 10000 + ticks;
+    if (b->count == batch_length)
+        swap_batches();
+}
@@ -14,12 +14,38 @@
 #define KARAKA_CAMERA_H
 
 #include <stdbool.h>
+#include "main.h"
+
+// Most frames reported in one FRAMES packet
+#define FRAME_BATCH_MAX 16
+
+// Frame times captured in MODE_CAMERAMASTER
+// Frame i is at base plus offsets[i] 0.1us timer ticks. first_frame numbers
+// every frame edge from 1 at the start of the sequence (including those
+// skipped by the stride), as TRIGGER packets number triggers, and dropped
+// counts frames lost since the previous batch because the serial link could
+// not keep up
+struct frame_batch
+{
+    struct timestamp base;
+    uint32_t first_frame;
+    uint16_t dropped;
+    uint8_t count;
+    uint32_t offsets[FRAME_BATCH_MAX];
+};
 
 void camera_initialize();
 void camera_tick();
 
 void camera_start_exposing(bool monitor_camera);
 void camera_stop_exposing();
+void camera_abort_exposing();
+void camera_resume_exposing(bool monitor_camera);
 void camera_trigger_readout();
 
+void camera_start_capture(uint16_t batch_length);
+void camera_stop_capture();
+void camera_flush_frames();
+void camera_send_frames();
+
 #endif
\ No newline at end of file
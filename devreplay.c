@@ -0,0 +1,591 @@
+//***************************************************************************
+//
+//  File        : devreplay.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Records the serial stream from a timer, and replays it onto
+//                a pty as a stand-in device for host software development
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "protocol.h"
+#include "record.h"
+#include "serial.h"
+
+// Must match got_packet_fmt and unknown_packet_fmt in usb.c
+#define GOT_PACKET_PREFIX "Got packet type '"
+
+struct replay_packet
+{
+    int64_t time_ns;
+    uint8_t type;
+    uint8_t length;
+    uint8_t data[PROTOCOL_MAX_DATA_LENGTH];
+};
+
+struct replay
+{
+    int fd;
+    double speed;
+    bool verbatim;
+
+    // Emulated device state
+    enum protocol_timer_status timer;
+    uint8_t gps;
+    bool start_pending;
+
+    struct protocol_decoder commands;
+
+    uint64_t packets_sent;
+    uint64_t triggers_sent;
+    uint64_t bytes_sent;
+};
+
+static volatile bool running = true;
+
+static void handle_signal(int sig)
+{
+    (void)sig;
+    running = false;
+}
+
+static bool send_packet(struct replay *r, uint8_t type, const void *data, uint8_t length)
+{
+    uint8_t buf[PROTOCOL_MAX_PACKET_LENGTH];
+    size_t size = protocol_encode(buf, type, data, length);
+    if (!size)
+        return false;
+
+    if (!serial_write_all(r->fd, buf, size))
+    {
+        fprintf(stderr, "Write failed: %s\n", strerror(errno));
+        running = false;
+        return false;
+    }
+
+    r->packets_sent++;
+    r->bytes_sent += size;
+    if (type == PACKET_TRIGGER)
+        r->triggers_sent++;
+    return true;
+}
+
+// Matches usb_send_message_fmt_P: a length byte followed by the string
+static void send_message(struct replay *r, const char *fmt, ...)
+{
+    uint8_t data[PROTOCOL_MAX_DATA_LENGTH + 1];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf((char *)&data[1], PROTOCOL_MAX_DATA_LENGTH, fmt, args);
+    va_end(args);
+
+    if (len > PROTOCOL_MAX_DATA_LENGTH - 1)
+        len = PROTOCOL_MAX_DATA_LENGTH - 1;
+
+    data[0] = (uint8_t)len;
+    send_packet(r, PACKET_MESSAGE, data, data[0] + 1);
+}
+
+static void set_timer_status(struct replay *r, enum protocol_timer_status status)
+{
+    r->timer = status;
+    uint8_t data[2] = {r->timer, r->gps};
+    send_packet(r, PACKET_STATUS, data, sizeof(data));
+}
+
+/*
+ * Respond to a command from the host in the same way as parse_packet() in usb.c
+ * The exposure starts at the next timestamp in the recording
+ */
+static void handle_command(struct replay *r, const struct protocol_packet *p)
+{
+    send_message(r, GOT_PACKET_PREFIX "%c'", p->type);
+    switch (p->type)
+    {
+        case PACKET_START_EXPOSURE:
+            r->start_pending = true;
+            set_timer_status(r, PROTOCOL_TIMER_WAITING);
+            break;
+        case PACKET_STOP_EXPOSURE:
+        case PACKET_ABORT_EXPOSURE:
+            r->start_pending = false;
+            set_timer_status(r, PROTOCOL_TIMER_IDLE);
+            break;
+        case PACKET_ENABLE_RELAY:
+            break;
+        default:
+            send_message(r, "Unknown packet type '%c' - ignoring", p->type);
+            break;
+    }
+}
+
+static void read_commands(struct replay *r)
+{
+    uint8_t buf[256];
+    ssize_t length = read(r->fd, buf, sizeof(buf));
+    for (ssize_t i = 0; i < length; i++)
+        if (protocol_decode_byte(&r->commands, buf[i]) && !r->verbatim)
+            handle_command(r, &r->commands.packet);
+}
+
+/*
+ * Forward a recorded packet, rewriting it to match the emulated state
+ * Triggers are only sent while the host has an exposure running, and the
+ * recorded responses to the recording's own commands are replaced by
+ * those generated in handle_command()
+ */
+static void replay_packet(struct replay *r, const struct replay_packet *p)
+{
+    if (r->verbatim)
+    {
+        send_packet(r, p->type, p->data, p->length);
+        return;
+    }
+
+    switch (p->type)
+    {
+        case PACKET_STATUS:
+        {
+            if (p->length < 2)
+                break;
+
+            r->gps = p->data[1];
+            uint8_t data[2] = {r->timer, r->gps};
+            send_packet(r, PACKET_STATUS, data, sizeof(data));
+            break;
+        }
+        case PACKET_TIMESTAMP:
+            send_packet(r, p->type, p->data, p->length);
+            if (r->start_pending)
+            {
+                r->start_pending = false;
+                set_timer_status(r, PROTOCOL_TIMER_EXPOSING);
+            }
+            break;
+        case PACKET_TRIGGER:
+            if (r->timer == PROTOCOL_TIMER_EXPOSING || r->timer == PROTOCOL_TIMER_READOUT)
+                send_packet(r, p->type, p->data, p->length);
+            break;
+        case PACKET_STOP_EXPOSURE:
+            // The device ended the sequence by itself
+            if (r->timer == PROTOCOL_TIMER_EXPOSING || r->timer == PROTOCOL_TIMER_READOUT)
+            {
+                send_packet(r, p->type, p->data, p->length);
+                set_timer_status(r, PROTOCOL_TIMER_IDLE);
+            }
+            break;
+        case PACKET_MESSAGE:
+            if (p->length > sizeof(GOT_PACKET_PREFIX) &&
+                !memcmp(&p->data[1], GOT_PACKET_PREFIX, sizeof(GOT_PACKET_PREFIX) - 1))
+                break;
+            send_packet(r, p->type, p->data, p->length);
+            break;
+        default:
+            send_packet(r, p->type, p->data, p->length);
+            break;
+    }
+}
+
+// Seconds since the unix epoch described by the time fields of a timestamp
+static int64_t timestamp_seconds(const struct protocol_timestamp *t)
+{
+    return protocol_days_from_civil(t->year, t->month, t->day) * 86400 +
+        t->hours * 3600 + t->minutes * 60 + t->seconds;
+}
+
+// Shift the time in a packet by a whole number of seconds
+// Every packet type that carries a time starts with it (FRAMES as its base)
+static void shift_timestamp(struct replay_packet *p, int64_t seconds)
+{
+    switch (p->type)
+    {
+        case PACKET_TIMESTAMP:
+        case PACKET_TRIGGER:
+        case PACKET_PPS_PHASE:
+        case PACKET_START_EDGE:
+        case PACKET_FORECAST:
+        case PACKET_RECOVERY:
+        case PACKET_INTEGRITY:
+        case PACKET_FRAMES:
+            break;
+        default:
+            return;
+    }
+
+    struct protocol_timestamp t;
+    if (!protocol_parse_timestamp(p->data, p->length, &t))
+        return;
+
+    time_t shifted = timestamp_seconds(&t) + seconds;
+    struct tm tm;
+    gmtime_r(&shifted, &tm);
+    t.year = tm.tm_year + 1900;
+    t.month = tm.tm_mon + 1;
+    t.day = tm.tm_mday;
+    t.hours = tm.tm_hour;
+    t.minutes = tm.tm_min;
+    t.seconds = tm.tm_sec;
+    protocol_pack_timestamp(&t, p->data);
+}
+
+/*
+ * Decode the device side of a recording into packets
+ * Each packet takes the arrival time of the chunk holding its final byte
+ * Returns the packet count, or -1 on failure
+ */
+static ssize_t load_recording(const char *path, struct replay_packet **packets)
+{
+    FILE *f = record_open_read(path);
+    if (!f)
+        return -1;
+
+    struct record_chunk *chunk = malloc(sizeof(struct record_chunk));
+    struct protocol_decoder d;
+    protocol_decoder_init(&d);
+
+    size_t count = 0, capacity = 0;
+    *packets = NULL;
+
+    while (record_read(f, chunk))
+    {
+        if (chunk->direction != RECORD_FROM_DEVICE)
+            continue;
+
+        for (uint16_t i = 0; i < chunk->length; i++)
+        {
+            if (!protocol_decode_byte(&d, chunk->data[i]))
+                continue;
+
+            if (d.packet.length > PROTOCOL_MAX_DATA_LENGTH)
+                continue;
+
+            if (count == capacity)
+            {
+                capacity = capacity ? 2 * capacity : 1024;
+                *packets = realloc(*packets, capacity * sizeof(struct replay_packet));
+            }
+
+            struct replay_packet *p = &(*packets)[count++];
+            p->time_ns = chunk->time_ns;
+            p->type = d.packet.type;
+            p->length = d.packet.length;
+            memcpy(p->data, d.packet.data, d.packet.length);
+        }
+    }
+
+    if (d.errors)
+        fprintf(stderr, "Skipped %u corrupted packets in %s\n", d.errors, path);
+
+    free(chunk);
+    fclose(f);
+    return count;
+}
+
+static int replay(const char *path, const char *port, double speed, bool verbatim, bool loop, int rebase_ms)
+{
+    struct replay_packet *packets;
+    ssize_t count = load_recording(path, &packets);
+    if (count <= 0)
+    {
+        if (count == 0)
+            fprintf(stderr, "No packets found in %s\n", path);
+        return 1;
+    }
+
+    struct replay r = {
+        .speed = speed,
+        .verbatim = verbatim,
+        .timer = PROTOCOL_TIMER_IDLE,
+        .gps = PROTOCOL_GPS_UNAVAILABLE,
+    };
+    protocol_decoder_init(&r.commands);
+
+    if (port)
+        r.fd = serial_open(port, SERIAL_DEFAULT_BAUD);
+    else
+    {
+        char name[256];
+        r.fd = serial_open_pty(name, sizeof(name));
+        if (r.fd != -1)
+            printf("pty %s\n", name);
+    }
+
+    if (r.fd == -1)
+    {
+        free(packets);
+        return 1;
+    }
+
+    // Leave room after the final packet so that looped recordings don't bunch up
+    int64_t duration = packets[count - 1].time_ns + 1000000000LL;
+    int64_t begin = serial_time_ns(CLOCK_MONOTONIC);
+    int64_t start = begin;
+    int64_t offset = 0;
+    int64_t shift = 0;
+
+    if (rebase_ms >= 0)
+    {
+        // Schedule the first timestamp rebase_ms after the next second boundary
+        // and rewrite the recorded times to match the system clock
+        ssize_t first = 0;
+        struct protocol_timestamp t;
+        while (first < count && (packets[first].type != PACKET_TIMESTAMP ||
+               !protocol_parse_timestamp(packets[first].data, packets[first].length, &t)))
+            first++;
+
+        if (first == count)
+        {
+            fprintf(stderr, "No timestamps found in %s\n", path);
+            close(r.fd);
+            free(packets);
+            return 1;
+        }
+
+        int64_t real = serial_time_ns(CLOCK_REALTIME);
+        int64_t target = real / 1000000000LL + 1;
+        start = begin + target * 1000000000LL + rebase_ms * 1000000LL - real - packets[first].time_ns;
+        shift = target - timestamp_seconds(&t);
+
+        // Whole seconds, so that looped timestamps stay on the second boundaries
+        duration = (duration + 999999999LL) / 1000000000LL * 1000000000LL;
+    }
+
+    for (ssize_t i = 0; running; i++)
+    {
+        if (i == count)
+        {
+            if (!loop)
+                break;
+            i = 0;
+            offset += duration;
+        }
+
+        int64_t due = start + (int64_t)((offset + packets[i].time_ns) / speed);
+        for (;;)
+        {
+            int64_t now = serial_time_ns(CLOCK_MONOTONIC);
+            if (now >= due || !running)
+                break;
+
+            struct pollfd pfd = {.fd = r.fd, .events = POLLIN};
+            int timeout_ms = (int)((due - now + 999999) / 1000000);
+            if (poll(&pfd, 1, timeout_ms) > 0 && (pfd.revents & POLLIN))
+                read_commands(&r);
+        }
+
+        if (rebase_ms >= 0)
+        {
+            struct replay_packet p = packets[i];
+            shift_timestamp(&p, shift + offset / 1000000000LL);
+            replay_packet(&r, &p);
+        }
+        else
+            replay_packet(&r, &packets[i]);
+    }
+
+    double elapsed = (serial_time_ns(CLOCK_MONOTONIC) - begin) / 1e9;
+    fprintf(stderr, "{\"packets\": %llu, \"triggers\": %llu, \"bytes\": %llu, \"seconds\": %.3f, "
+            "\"trigger_rate\": %.1f, \"byte_rate\": %.0f}\n",
+            (unsigned long long)r.packets_sent, (unsigned long long)r.triggers_sent,
+            (unsigned long long)r.bytes_sent, elapsed,
+            r.triggers_sent / elapsed, r.bytes_sent / elapsed);
+
+    close(r.fd);
+    free(packets);
+    return 0;
+}
+
+/*
+ * Parse a START_EXPOSURE specification of the form mode,exposure[,stride[,align[,edge]]]
+ */
+static bool parse_start(const char *spec, uint8_t *buf, size_t *length)
+{
+    unsigned mode, exposure, stride = 1, align = 1, edge = PROTOCOL_EXTERNAL_START_NONE;
+    if (sscanf(spec, "%u,%u,%u,%u,%u", &mode, &exposure, &stride, &align, &edge) < 2 ||
+        mode > PROTOCOL_MODE_CAMERAMASTER || exposure == 0 || exposure > 0xFFFF || stride == 0 || stride > 0xFF ||
+        edge > PROTOCOL_EXTERNAL_START_FALLING)
+        return false;
+
+    *length = protocol_encode_start_exposure(buf, false, mode, exposure, stride, align, edge);
+    return true;
+}
+
+static bool send_recorded(int fd, FILE *f, int64_t start, const uint8_t *data, size_t length)
+{
+    if (!serial_write_all(fd, data, length))
+        return false;
+    return record_write(f, serial_time_ns(CLOCK_MONOTONIC) - start, RECORD_TO_DEVICE, data, length);
+}
+
+static int record(const char *path, const char *port, unsigned seconds, const char *start_spec)
+{
+    uint8_t start_packet[PROTOCOL_MAX_PACKET_LENGTH];
+    size_t start_length = 0;
+    if (start_spec && !parse_start(start_spec, start_packet, &start_length))
+    {
+        fprintf(stderr, "Invalid exposure specification: %s\n", start_spec);
+        return 1;
+    }
+
+    int fd = serial_open(port, SERIAL_DEFAULT_BAUD);
+    if (fd == -1)
+        return 1;
+
+    FILE *f = record_open_write(path);
+    if (!f)
+    {
+        close(fd);
+        return 1;
+    }
+
+    struct protocol_decoder d;
+    protocol_decoder_init(&d);
+    uint64_t bytes = 0, packets = 0, triggers = 0;
+
+    int64_t start = serial_time_ns(CLOCK_MONOTONIC);
+    if (start_length && !send_recorded(fd, f, start, start_packet, start_length))
+    {
+        fprintf(stderr, "Failed to send exposure command: %s\n", strerror(errno));
+        running = false;
+    }
+
+    // Keep recording for a second after the stop command to capture the response
+    int64_t end = 0;
+    for (;;)
+    {
+        int64_t now = serial_time_ns(CLOCK_MONOTONIC);
+        if (!end && (!running || (seconds && now - start >= seconds * 1000000000LL)))
+        {
+            end = now;
+            if (start_length)
+            {
+                uint8_t stop[PROTOCOL_MAX_PACKET_LENGTH];
+                size_t length = protocol_encode(stop, PACKET_STOP_EXPOSURE, NULL, 0);
+                if (!send_recorded(fd, f, start, stop, length))
+                    break;
+                end += 1000000000LL;
+            }
+        }
+
+        if (end && now >= end)
+            break;
+
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+
+        uint8_t buf[RECORD_MAX_CHUNK_LENGTH];
+        ssize_t length = read(fd, buf, sizeof(buf));
+        int64_t arrival = serial_time_ns(CLOCK_MONOTONIC);
+        if (length <= 0)
+        {
+            if (length < 0 && errno == EINTR)
+                continue;
+            fprintf(stderr, "Read failed: %s\n", length ? strerror(errno) : "end of file");
+            break;
+        }
+
+        if (!record_write(f, arrival - start, RECORD_FROM_DEVICE, buf, length))
+        {
+            fprintf(stderr, "Failed to write %s\n", path);
+            break;
+        }
+
+        bytes += length;
+        for (ssize_t i = 0; i < length; i++)
+        {
+            if (protocol_decode_byte(&d, buf[i]))
+            {
+                packets++;
+                if (d.packet.type == PACKET_TRIGGER)
+                    triggers++;
+            }
+        }
+    }
+
+    fprintf(stderr, "{\"bytes\": %llu, \"packets\": %llu, \"triggers\": %llu, \"errors\": %u}\n",
+            (unsigned long long)bytes, (unsigned long long)packets,
+            (unsigned long long)triggers, d.errors);
+
+    fclose(f);
+    close(fd);
+    return 0;
+}
+
+static void print_usage()
+{
+    printf("Usage: devreplay -r <port> [-n <seconds>] [-S <spec>] <recording>\n");
+    printf("       devreplay [-x <speed>] [-l] [-a] [-N <ms>] [-o <port>] <recording>\n");
+    printf("Record mode:\n");
+    printf("  -r <port>     record the stream from the timer on this port\n");
+    printf("  -n <seconds>  stop after this many seconds (default: run until interrupted)\n");
+    printf("  -S <spec>     start an exposure sequence, stopping it at the end of the recording\n");
+    printf("                spec is mode,exposure[,stride[,align[,edge]]]; mode 0 counts pulses, 1 is ms,\n");
+    printf("                2 timestamps a free-running camera (exposure is then the batch length);\n");
+    printf("                edge 1 or 2 arms the timer to start on a rising or falling start input\n");
+    printf("Replay mode:\n");
+    printf("  -x <speed>    replay speed relative to the recording (default 1)\n");
+    printf("  -l            loop the recording until interrupted\n");
+    printf("  -a            replay every packet verbatim, ignoring commands from the host\n");
+    printf("  -N <ms>       rewrite timestamps to the system clock, sending each one\n");
+    printf("                this many ms after the second it describes (requires -x 1)\n");
+    printf("  -o <port>     write to a serial port instead of creating a pty\n");
+    printf("By default, recorded triggers are only replayed between the host's\n");
+    printf("START and STOP commands, and status packets follow the emulated state.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *record_port = NULL;
+    const char *output_port = NULL;
+    const char *start_spec = NULL;
+    unsigned seconds = 0;
+    double speed = 1;
+    bool loop = false;
+    bool verbatim = false;
+    int rebase_ms = -1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:n:S:x:laN:o:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'r': record_port = optarg; break;
+            case 'n': seconds = atoi(optarg); break;
+            case 'S': start_spec = optarg; break;
+            case 'x': speed = atof(optarg); break;
+            case 'l': loop = true; break;
+            case 'a': verbatim = true; break;
+            case 'N': rebase_ms = atoi(optarg); break;
+            case 'o': output_port = optarg; break;
+            default: print_usage(); return 1;
+        }
+    }
+
+    if (optind != argc - 1 || speed <= 0 || (rebase_ms >= 0 && speed != 1))
+    {
+        print_usage();
+        return 1;
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if (record_port)
+        return record(argv[optind], record_port, seconds, start_spec);
+
+    return replay(argv[optind], output_port, speed, verbatim, loop, rebase_ms);
+}
@@ -0,0 +1,155 @@
+//***************************************************************************
+//
+//  File        : diag.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Runs the on-board benchmarks and prints the results
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "protocol.h"
+#include "serial.h"
+
+// The benchmarks wait for the send buffer to drain twice, which
+// takes well under a second at 9600 baud
+#define REPLY_TIMEOUT_MS 5000
+
+// Start of the message sent instead if the timer is busy (see usb.c)
+#define BUSY_PREFIX "Ignoring benchmark request"
+
+static double cycles_us(uint32_t cycles, uint32_t f_cpu)
+{
+    return cycles * 1e6 / f_cpu;
+}
+
+static void print_result(const struct protocol_benchmark *b)
+{
+    const char *display = b->display_type == PROTOCOL_DISPLAY_LCD ? "lcd" :
+        (b->display_type == PROTOCOL_DISPLAY_LED ? "led" : "unknown");
+
+    double spi_rate = b->spi_byte ? (double)b->f_cpu / b->spi_byte : 0;
+    printf("{\"f_cpu\": %u, \"display\": \"%s\", \"display_redraw_us\": %.1f, "
+           "\"spi_bytes_per_second\": %.0f, \"queue_bytes\": %u, \"queue_us\": %.1f, "
+           "\"tx_bytes_per_second\": %u, \"usb_parse_us\": %.1f, \"gps_trimble_us\": %.1f, "
+           "\"gps_magellan_us\": %.1f, \"isr_latency_cycles\": %u}\n",
+           b->f_cpu, display, cycles_us(b->display_redraw, b->f_cpu),
+           spi_rate, b->queue_length, cycles_us(b->queue_cycles, b->f_cpu),
+           b->tx_bytes_per_second, cycles_us(b->usb_parse, b->f_cpu), cycles_us(b->gps_trimble, b->f_cpu),
+           cycles_us(b->gps_magellan, b->f_cpu), b->isr_latency);
+}
+
+static void print_usage()
+{
+    printf("Usage: diag [options] <port>\n");
+    printf("  -b <baud>   line rate (default 9600)\n");
+    printf("  -v          print the timer's messages to stderr\n");
+    printf("The timer must be idle. Prints one JSON line of results; a value of 0\n");
+    printf("means that the test could not run on this hardware (e.g. SPI with an LCD).\n");
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned baud = SERIAL_DEFAULT_BAUD;
+    bool verbose = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:v")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b': baud = atoi(optarg); break;
+            case 'v': verbose = true; break;
+            default: print_usage(); return 1;
+        }
+    }
+
+    if (optind != argc - 1 || !baud)
+    {
+        print_usage();
+        return 1;
+    }
+
+    int fd = serial_open(argv[optind], baud);
+    if (fd == -1)
+        return 1;
+
+    tcflush(fd, TCIFLUSH);
+
+    uint8_t request[PROTOCOL_MAX_PACKET_LENGTH];
+    size_t request_length = protocol_encode(request, PACKET_BENCHMARK, NULL, 0);
+    if (!serial_write_all(fd, request, request_length))
+    {
+        close(fd);
+        return 1;
+    }
+
+    struct protocol_decoder d;
+    protocol_decoder_init(&d);
+
+    int status = 2;
+    int64_t deadline = serial_time_ns(CLOCK_MONOTONIC) + REPLY_TIMEOUT_MS * 1000000LL;
+    while (status == 2)
+    {
+        int remaining = (int)((deadline - serial_time_ns(CLOCK_MONOTONIC)) / 1000000);
+        if (remaining <= 0)
+        {
+            fprintf(stderr, "No reply from the timer\n");
+            break;
+        }
+
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, remaining) <= 0)
+            continue;
+
+        uint8_t buf[256];
+        ssize_t length = read(fd, buf, sizeof(buf));
+        if (length <= 0)
+        {
+            if (length < 0 && errno == EINTR)
+                continue;
+            fprintf(stderr, "Read failed: %s\n", length ? strerror(errno) : "end of file");
+            status = 1;
+            break;
+        }
+
+        for (ssize_t i = 0; i < length && status == 2; i++)
+        {
+            if (!protocol_decode_byte(&d, buf[i]))
+                continue;
+
+            struct protocol_benchmark b;
+            if (d.packet.type == PACKET_MESSAGE && d.packet.length > 0)
+            {
+                if (verbose)
+                    fprintf(stderr, "%.*s\n", d.packet.data[0], &d.packet.data[1]);
+
+                // Refused because a sequence is running
+                if (d.packet.data[0] >= sizeof(BUSY_PREFIX) - 1 &&
+                    !memcmp(&d.packet.data[1], BUSY_PREFIX, sizeof(BUSY_PREFIX) - 1))
+                {
+                    fprintf(stderr, "%.*s\n", d.packet.data[0], &d.packet.data[1]);
+                    status = 1;
+                }
+            }
+            else if (d.packet.type == PACKET_BENCHMARK && protocol_parse_benchmark(d.packet.data, d.packet.length, &b))
+            {
+                print_result(&b);
+                status = 0;
+            }
+        }
+    }
+
+    close(fd);
+    return status;
+}
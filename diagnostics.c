@@ -0,0 +1,223 @@
+//***************************************************************************
+//
+//  File        : diagnostics.c
+//  Copyright   : 2013 Paul Chote
+//  Description : On-board micro-benchmarks for comparing hardware revisions
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/wdt.h>
+#include "diagnostics.h"
+#include "display.h"
+#include "gps.h"
+#include "main.h"
+#include "usb.h"
+
+/*
+ * The tests borrow Timer1, which is stopped while the timer is idle, and
+ * stall the main loop for a few hundred milliseconds while the send buffer
+ * drains. They are only run on request, and never during a sequence
+ */
+
+// Timer1 clock selections: one cycle per tick (6.5ms range),
+// or 64 cycles per tick (419ms range)
+#define CLOCK_FAST _BV(CS10)
+#define CLOCK_SLOW (_BV(CS11) | _BV(CS10))
+
+// Number of times each test is repeated
+#define RUNS 4
+#define LATENCY_PROBES 8
+#define SPI_TEST_BYTES 64
+
+volatile bool latency_probe_pending = false;
+volatile uint16_t latency_probe_ticks;
+
+static const char msg_running[] PROGMEM = "Running diagnostics: the display and serial link will pause briefly";
+
+// START_EXPOSURE for a 1s MODE_HIGHRES sequence
+static const uint8_t usb_test_packet[] PROGMEM = {
+    '$', '$', 'E', 7, 0x00, 0x01, 0xE8, 0x03, 0x01, 0x00, 0x00, 0xEB, '\r', '\n'
+};
+
+// 8F-AB: 12:45:30 UTC 2013-06-15, locked
+// The UTC offset (16s) exercises the 0x10 byte stuffing
+static const uint8_t trimble_test_packet[] PROGMEM = {
+    0x10, 0x8F, 0xAB,
+    0x00, 0x07, 0x6E, 0x5A, 0x06, 0xE4, 0x00, 0x10, 0x10, 0x03,
+    0x1E, 0x2D, 0x0C, 0x0F, 0x06, 0x07, 0xDD,
+    0x10, 0x03
+};
+
+// $$A: 12:45:30 1994-06-15, which the parser moves forward 1024 weeks
+static const uint8_t magellan_test_packet[] PROGMEM = {
+    '$', '$', 'A',
+    0x00, 0x0C, 0x2D, 0x1E, 0x0F, 0x06, 0x07, 0xCA,
+    0xBA, '\n'
+};
+
+static void timer_start(uint8_t clock)
+{
+    TCCR1B = 0;
+    TCNT1 = 0;
+    TIFR1 = _BV(TOV1);
+    TCCR1B = clock;
+}
+
+// Cycles since timer_start(), or UINT32_MAX if the timer overflowed
+static uint32_t timer_stop()
+{
+    uint8_t clock = TCCR1B;
+    TCCR1B = 0;
+
+    if (bit_is_set(TIFR1, TOV1))
+        return UINT32_MAX;
+
+    uint32_t ticks = TCNT1;
+    return clock == CLOCK_SLOW ? ticks * 64 : ticks;
+}
+
+static uint16_t clamp16(uint32_t cycles)
+{
+    return cycles > UINT16_MAX ? UINT16_MAX : cycles;
+}
+
+// Fewest cycles over RUNS parses of a synthetic packet, or 0 if it was rejected
+static uint16_t time_parser(bool (*parse)(const uint8_t *, uint8_t), const uint8_t *packet_P,
+                            uint8_t length, uint32_t overhead)
+{
+    uint8_t data[24];
+    memcpy_P(data, packet_P, length);
+
+    uint32_t best = UINT32_MAX;
+    for (uint8_t i = 0; i < RUNS; i++)
+    {
+        timer_start(CLOCK_FAST);
+        bool parsed = parse(data, length);
+        uint32_t cycles = timer_stop() - overhead;
+        if (!parsed)
+            return 0;
+
+        if (cycles < best)
+            best = cycles;
+    }
+
+    return clamp16(best);
+}
+
+// Raise PCINT2 by toggling PC7 (TOSC2, unconnected) as an output
+static uint16_t time_interrupt_latency()
+{
+    uint8_t mask = PCMSK2;
+    DDRC |= _BV(DDC7);
+    PCMSK2 = _BV(PCINT23);
+    PCIFR = _BV(PCIF2);
+    PCICR |= _BV(PCIE2);
+
+    uint16_t best = UINT16_MAX;
+    timer_start(CLOCK_FAST);
+    for (uint8_t i = 0; i < LATENCY_PROBES; i++)
+    {
+        latency_probe_pending = true;
+        uint16_t start = TCNT1;
+        PINC = _BV(PINC7);
+        while (latency_probe_pending);
+
+        uint16_t cycles = latency_probe_ticks - start;
+        if (cycles < best)
+            best = cycles;
+    }
+    timer_stop();
+
+    PCICR &= ~_BV(PCIE2);
+    PCMSK2 = mask;
+    PCIFR = _BV(PCIF2);
+    DDRC &= ~_BV(DDC7);
+
+    return best;
+}
+
+/*
+ * Run each benchmark and send the results in a BENCHMARK packet
+ * Must only be called from the main loop while the timer is idle
+ */
+void diagnostics_run()
+{
+    struct benchmark_result r = {
+        .f_cpu = F_CPU,
+        .display = display_type
+    };
+
+    uint8_t timsk = TIMSK1;
+    uint16_t tcnt = TCNT1;
+    TIMSK1 = 0;
+    wdt_reset();
+
+    // Cost of starting and stopping the timer, removed from the short tests
+    timer_start(CLOCK_FAST);
+    uint32_t overhead = timer_stop();
+
+    // Send buffer: start from empty so that queueing never blocks
+    // The packet adds a length byte, $$, type, length, checksum and \r\n
+    while (usb_send_pending());
+    timer_start(CLOCK_FAST);
+    usb_send_message_P(msg_running);
+    r.queue_cycles = clamp16(timer_stop() - overhead);
+    r.queue_length = strlen_P(msg_running) + 8;
+
+    wdt_reset();
+    uint8_t pending = usb_send_pending();
+    timer_start(CLOCK_SLOW);
+    while (usb_send_pending());
+    uint32_t drain = timer_stop();
+    if (drain != UINT32_MAX && drain > 0)
+        r.tx_rate = clamp16(pending * F_CPU / drain);
+
+    // Parsers
+    r.usb_parse = time_parser(usb_parse_bytes, usb_test_packet, sizeof(usb_test_packet), overhead);
+    r.gps_trimble = time_parser(gps_parse_bytes, trimble_test_packet, sizeof(trimble_test_packet), overhead);
+    r.gps_magellan = time_parser(gps_parse_bytes, magellan_test_packet, sizeof(magellan_test_packet), overhead);
+
+    // Display
+    uint32_t best = UINT32_MAX;
+    for (uint8_t i = 0; i < RUNS; i++)
+    {
+        // An LCD redraw may take a large part of the watchdog timeout
+        wdt_reset();
+        timer_start(CLOCK_SLOW);
+        display_update();
+        uint32_t cycles = timer_stop();
+        if (cycles < best)
+            best = cycles;
+    }
+    r.display_redraw = best;
+
+    best = UINT32_MAX;
+    for (uint8_t i = 0; i < RUNS; i++)
+    {
+        timer_start(CLOCK_FAST);
+        bool sent = display_spi_test(SPI_TEST_BYTES);
+        uint32_t cycles = timer_stop() - overhead;
+        if (sent && cycles < best)
+            best = cycles;
+    }
+    if (best != UINT32_MAX)
+        r.spi_byte = best / SPI_TEST_BYTES;
+
+    wdt_reset();
+    r.isr_latency = time_interrupt_latency();
+
+    // Return Timer1 to the stopped millisecond timer
+    STOP_MILLISECOND_TIMER;
+    TCNT1 = tcnt;
+    TIFR1 = _BV(OCF1A) | _BV(OCF1B) | _BV(TOV1) | _BV(ICF1);
+    TIMSK1 = timsk;
+
+    usb_send_benchmark(&r);
+}
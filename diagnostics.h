@@ -0,0 +1,63 @@
+//***************************************************************************
+//
+//  File        : diagnostics.h
+//  Copyright   : 2013 Paul Chote
+//  Description : On-board micro-benchmarks for comparing hardware revisions
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#ifndef KARAKA_DIAGNOSTICS_H
+#define KARAKA_DIAGNOSTICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "display.h"
+
+// Results of diagnostics_run(), in CPU cycles unless noted
+// Each is the fewest cycles over several runs, so that unrelated
+// interrupts are excluded. 0 means that the test could not be run
+struct benchmark_result
+{
+    // CPU cycles per second, to convert the counts to times
+    uint32_t f_cpu;
+
+    // Driver used for display_redraw
+    enum display_type display;
+
+    // One call to display_update(), redrawing every module
+    uint32_t display_redraw;
+
+    // One byte on the display SPI bus (LED displays only)
+    uint16_t spi_byte;
+
+    // Queueing a MESSAGE packet of queue_length bytes (including framing)
+    // into an empty send buffer, and the rate (bytes/s) that it then drained
+    uint8_t queue_length;
+    uint16_t queue_cycles;
+    uint16_t tx_rate;
+
+    // Framing a START_EXPOSURE packet, without acting on it
+    uint16_t usb_parse;
+
+    // Framing and decoding a Trimble 8F-AB and a Magellan time packet,
+    // without setting the time
+    uint16_t gps_trimble;
+    uint16_t gps_magellan;
+
+    // From a pin change to the first instruction of the PCINT2 handler,
+    // i.e. the latency removed from START_EDGE times
+    uint16_t isr_latency;
+};
+
+// Set by diagnostics_run() before raising PCINT2
+// The handler records TCNT1 and clears the flag
+extern volatile bool latency_probe_pending;
+extern volatile uint16_t latency_probe_ticks;
+
+void diagnostics_run();
+
+#endif
@@ -18,7 +18,6 @@
 #include <avr/interrupt.h>
 #include <util/delay.h>
 #include <util/atomic.h>
-#include <stdio.h>
 
 static const uint8_t led_chars[96][5] PROGMEM = {
     {0x00,0x20,0x40,0x60,0x80}, //   :0x20
@@ -134,12 +133,6 @@ enum display_exposure_mode
     EXPOSURE_HIDE    = _BV(2),
 };
 
-enum display_type
-{
-    DISPLAY_LED = _BV(0),
-    DISPLAY_LCD = _BV(1)
-};
-
 enum lcd_data_type
 {
     LCD_COMMAND = 0x00,
@@ -152,6 +145,7 @@ static const char msg_noserial[]    PROGMEM = "NO SERIAL CONNECTION";
 static const char msg_idle[]        PROGMEM = "        IDLE        ";
 static const char msg_wait[]        PROGMEM = " WAITING FOR CAMERA ";
 static const char msg_relay[]       PROGMEM = "     RELAY MODE     ";
+static const char msg_armed[]       PROGMEM = " WAITING FOR START  ";
 static const char msg_expose_c[]    PROGMEM = "       EXPOSE       ";
 static const char msg_readout_c[]   PROGMEM = "       READOUT      ";
 
@@ -159,13 +153,20 @@ static const char msg_readout_c[]   PROGMEM = "       READOUT      ";
 static const char msg_align[]       PROGMEM = "  ALIGN             ";
 static const char msg_expose[]      PROGMEM = "  EXPOSE            ";
 static const char msg_readout[]     PROGMEM = "  READOUT           ";
-static const char fmt_countdown[]   PROGMEM = "           %03d/%03d  ";
-static const char fmt_percentage[]  PROGMEM = "              %3d%%  ";
+static const char tpl_countdown[]   PROGMEM = "           000/000  ";
+static const char tpl_percentage[]  PROGMEM = "                 %  ";
 
 // Bottom display
-static const char fmt_time_utc[]    PROGMEM = "    %02d:%02d:%02d UTC    ";
-static const char fmt_time_gps[]    PROGMEM = "    %02d:%02d:%02d GPS    ";
-static const char fmt_time_nolock[] PROGMEM = " %02d:%02d:%02d NOT LOCKED ";
+static const char tpl_time_utc[]    PROGMEM = "    00:00:00 UTC    ";
+static const char tpl_time_gps[]    PROGMEM = "    00:00:00 GPS    ";
+static const char tpl_time_nolock[] PROGMEM = " 00:00:00 NOT LOCKED";
+
+// Positions of the fields in the templates
+#define COUNTDOWN_PROGRESS 11
+#define COUNTDOWN_TOTAL    15
+#define PERCENTAGE_VALUE   14
+#define TIME_HOURS         4
+#define TIME_HOURS_NOLOCK  1
 static const char msg_syncing[]     PROGMEM = "  SYNCING TO SERIAL ";
 
 static const uint8_t led_display_map[4] = {_BV(PB1), _BV(PB2), _BV(PB3), _BV(PB4)};
@@ -191,6 +192,24 @@ static void led_send_byte(uint8_t display, uint8_t b)
     PORTB |= display;
 }
 
+/*
+ * Clock count bytes out on the SPI bus without selecting a display
+ * Used to measure the bus rate. Returns false if the bus isn't in use
+ */
+bool display_spi_test(uint8_t count)
+{
+    if (display_type != DISPLAY_LED)
+        return false;
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        SPDR = 0;
+        loop_until_bit_is_set(SPSR, SPIF);
+    }
+
+    return true;
+}
+
 /*
  * Set the brightness of the display
  * Uses bottom 3 bits of display_brightness to set
@@ -389,32 +408,108 @@ static void set_msg_P(enum display_flags flags, const char *msg)
     }
 }
 
-static void set_fmt_P(enum display_flags flags, const char *fmt, ...)
+/*
+ * Display a 20 char string from ram on a subset of display modules
+ */
+static void set_msg(enum display_flags flags, const char *msg)
 {
-    va_list args;
-    char buf[21];
-
-    va_start(args, fmt);
-    vsprintf_P(buf, fmt, args);
-    va_end(args);
-
     if (flags & DISPLAY_TOP)
     {
         if (flags & DISPLAY_LEFT)
-            set_display(0, buf);
+            set_display(0, msg);
         if (flags & DISPLAY_RIGHT)
-            set_display(1, buf + 10);
+            set_display(1, msg + 10);
     }
 
     if (flags & DISPLAY_BOTTOM)
     {
         if (flags & DISPLAY_LEFT)
-            set_display(2, buf);
+            set_display(2, msg);
         if (flags & DISPLAY_RIGHT)
-            set_display(3, buf + 10);
+            set_display(3, msg + 10);
     }
 }
 
+/*
+ * Write value right-aligned into the width chars at field, padded with pad
+ * Values too wide for the field are shown as all 9s, so the layout never
+ * shifts and a large value is never mistaken for a small one
+ */
+static void render_digits(char *field, uint8_t width, uint16_t value, char pad)
+{
+    char *c = field + width;
+    do
+    {
+        *--c = '0' + value % 10;
+        value /= 10;
+    } while (value && c != field);
+
+    if (value)
+    {
+        for (c = field; c != field + width; c++)
+            *c = '9';
+        return;
+    }
+
+    while (c != field)
+        *--c = pad;
+}
+
+// Two digit fields (times) only need 8-bit arithmetic
+static void render_digits2(char *field, uint8_t value)
+{
+    if (value > 99)
+        value = 99;
+
+    field[0] = '0' + value / 10;
+    field[1] = '0' + value % 10;
+}
+
+// The format_ functions fill a 20 char line for set_msg()
+static void format_countdown(char *buf, uint16_t progress, uint16_t total)
+{
+    memcpy_P(buf, tpl_countdown, 20);
+    render_digits(buf + COUNTDOWN_PROGRESS, 3, progress, '0');
+    render_digits(buf + COUNTDOWN_TOTAL, 3, total, '0');
+}
+
+static void format_percentage(char *buf, uint16_t percentage)
+{
+    memcpy_P(buf, tpl_percentage, 20);
+    render_digits(buf + PERCENTAGE_VALUE, 3, percentage, ' ');
+}
+
+static void format_clock_P(char *buf, const char *tpl, uint8_t field,
+                           uint8_t hours, uint8_t minutes, uint8_t seconds)
+{
+    memcpy_P(buf, tpl, 20);
+    render_digits2(buf + field, hours);
+    render_digits2(buf + field + 3, minutes);
+    render_digits2(buf + field + 6, seconds);
+}
+
+static void set_countdown(enum display_flags flags, uint16_t progress, uint16_t total)
+{
+    char buf[20];
+    format_countdown(buf, progress, total);
+    set_msg(flags, buf);
+}
+
+static void set_percentage(enum display_flags flags, uint16_t percentage)
+{
+    char buf[20];
+    format_percentage(buf, percentage);
+    set_msg(flags, buf);
+}
+
+static void set_clock_P(enum display_flags flags, const char *tpl, uint8_t field,
+                        uint8_t hours, uint8_t minutes, uint8_t seconds)
+{
+    char buf[20];
+    format_clock_P(buf, tpl, field, hours, minutes, seconds);
+    set_msg(flags, buf);
+}
+
 void display_initialize()
 {
     // Read display select pin
@@ -470,9 +565,12 @@ void display_update()
         case TIMER_WAITING:
             set_msg_P(DISPLAY_TOP | DISPLAY_LEFT | DISPLAY_RIGHT, msg_wait);
             break;
+        case TIMER_ARMED:
+            set_msg_P(DISPLAY_TOP | DISPLAY_LEFT | DISPLAY_RIGHT, msg_armed);
+            break;
         case TIMER_ALIGN:
             set_msg_P(DISPLAY_TOP | DISPLAY_LEFT, msg_align);
-            set_fmt_P(DISPLAY_TOP | DISPLAY_RIGHT, fmt_countdown, current_timestamp.seconds % align_boundary, align_boundary);
+            set_countdown(DISPLAY_TOP | DISPLAY_RIGHT, current_timestamp.seconds % align_boundary, align_boundary);
             break;
         case TIMER_EXPOSING:
         case TIMER_READOUT:
@@ -489,11 +587,11 @@ void display_update()
                     const char *msg = status == TIMER_EXPOSING ? msg_expose : msg_readout;
                     set_msg_P(DISPLAY_TOP | DISPLAY_LEFT, msg);
                     if (timing_mode == MODE_HIGHRES)
-                        set_fmt_P(DISPLAY_TOP | DISPLAY_RIGHT, fmt_countdown,
-                                  display_progress / 1000, exposure_total / 1000);
+                        set_countdown(DISPLAY_TOP | DISPLAY_RIGHT,
+                                      display_progress / 1000, exposure_total / 1000);
                     else
-                        set_fmt_P(DISPLAY_TOP | DISPLAY_RIGHT, fmt_countdown,
-                                  display_progress, exposure_total);
+                        set_countdown(DISPLAY_TOP | DISPLAY_RIGHT,
+                                      display_progress, exposure_total);
                     break;
                 }
                 case EXPOSURE_PERCENT:
@@ -501,7 +599,7 @@ void display_update()
                     const char *msg = status == TIMER_EXPOSING ? msg_expose : msg_readout;
                     uint16_t percentage = display_progress / (exposure_total / 100);
                     set_msg_P(DISPLAY_TOP | DISPLAY_LEFT, msg);
-                    set_fmt_P(DISPLAY_TOP | DISPLAY_RIGHT, fmt_percentage, percentage);
+                    set_percentage(DISPLAY_TOP | DISPLAY_RIGHT, percentage);
                     break;
                 }
             }
@@ -516,9 +614,11 @@ void display_update()
     {
         case GPS_ACTIVE:
         {
-            const char *fmt = (current_timestamp.flags & TIMESTAMP_LOCKED) ?
-                (current_timestamp.flags & TIMESTAMP_IS_GPS) ? fmt_time_gps : fmt_time_utc : fmt_time_nolock;
-            set_fmt_P(DISPLAY_BOTTOM | DISPLAY_LEFT | DISPLAY_RIGHT, fmt,
+            bool locked = current_timestamp.flags & TIMESTAMP_LOCKED;
+            const char *tpl = locked ?
+                (current_timestamp.flags & TIMESTAMP_IS_GPS) ? tpl_time_gps : tpl_time_utc : tpl_time_nolock;
+            set_clock_P(DISPLAY_BOTTOM | DISPLAY_LEFT | DISPLAY_RIGHT, tpl,
+                locked ? TIME_HOURS : TIME_HOURS_NOLOCK,
                 current_timestamp.hours,
                 current_timestamp.minutes,
                 current_timestamp.seconds
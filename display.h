@@ -13,8 +13,21 @@
 #ifndef KARAKA_DISPLAY_H
 #define KARAKA_DISPLAY_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <avr/io.h>
+
+enum display_type
+{
+    DISPLAY_LED = _BV(0),
+    DISPLAY_LCD = _BV(1)
+};
+
+extern enum display_type display_type;
+
 void display_initialize();
 void display_update_config();
 void display_update();
+bool display_spi_test(uint8_t count);
 
 #endif
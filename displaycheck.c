@@ -0,0 +1,203 @@
+//***************************************************************************
+//
+//  File        : displaycheck.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Checks the display's line formatting on the host against
+//                the printf formats that it replaced
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// The formatters are private to display.c
+#include "display.c"
+
+// Firmware state referenced by display.c
+uint8_t timing_mode = MODE_PULSECOUNTER;
+uint16_t exposure_total = 0;
+volatile uint16_t exposure_countdown = 0;
+uint8_t align_boundary = 1;
+struct timestamp current_timestamp;
+volatile enum timer_status timer_status = TIMER_IDLE;
+volatile enum gps_status gps_status = GPS_UNAVAILABLE;
+
+// Formats used before display.c stopped using printf
+#define OLD_COUNTDOWN   "           %03u/%03u  "
+#define OLD_PERCENTAGE  "              %3u%%  "
+#define OLD_TIME_UTC    "    %02u:%02u:%02u UTC    "
+#define OLD_TIME_GPS    "    %02u:%02u:%02u GPS    "
+#define OLD_TIME_NOLOCK " %02u:%02u:%02u NOT LOCKED "
+
+static const uint16_t boundaries[] = {0, 1, 9, 10, 99, 100, 999, 1000, 9999, 10000, 65535};
+#define BOUNDARY_COUNT (sizeof(boundaries) / sizeof(boundaries[0]))
+
+static unsigned cases = 0;
+static unsigned failures = 0;
+
+// Values too wide for a field are shown as all 9s
+static unsigned saturate(unsigned value, unsigned max)
+{
+    return value > max ? max : value;
+}
+
+static void expect(const char *what, const char *actual, size_t length, const char *expected)
+{
+    cases++;
+    if (strlen(expected) < length || memcmp(actual, expected, length))
+    {
+        failures++;
+        fprintf(stderr, "%s: got \"%.*s\", expected \"%.*s\"\n", what, (int)length, actual, (int)length, expected);
+    }
+}
+
+static void check_digits()
+{
+    char field[3], expected[8], what[64];
+    for (uint32_t v = 0; v <= UINT16_MAX; v++)
+    {
+        snprintf(what, sizeof(what), "render_digits(%u, '0')", v);
+        render_digits(field, 3, v, '0');
+        snprintf(expected, sizeof(expected), "%03u", saturate(v, 999));
+        expect(what, field, 3, expected);
+
+        snprintf(what, sizeof(what), "render_digits(%u, ' ')", v);
+        render_digits(field, 3, v, ' ');
+        snprintf(expected, sizeof(expected), "%3u", saturate(v, 999));
+        expect(what, field, 3, expected);
+    }
+
+    // One digit fields, including the overflow from 9 to 10
+    for (uint16_t v = 0; v <= 10; v++)
+    {
+        snprintf(what, sizeof(what), "render_digits(%u, width 1)", v);
+        render_digits(field, 1, v, '0');
+        snprintf(expected, sizeof(expected), "%u", saturate(v, 9));
+        expect(what, field, 1, expected);
+    }
+
+    for (uint16_t v = 0; v <= UINT8_MAX; v++)
+    {
+        snprintf(what, sizeof(what), "render_digits2(%u)", v);
+        render_digits2(field, v);
+        snprintf(expected, sizeof(expected), "%02u", saturate(v, 99));
+        expect(what, field, 2, expected);
+    }
+}
+
+static void check_countdown(uint16_t progress, uint16_t total)
+{
+    char buf[20], expected[32], what[64];
+    snprintf(what, sizeof(what), "format_countdown(%u, %u)", progress, total);
+    format_countdown(buf, progress, total);
+    snprintf(expected, sizeof(expected), OLD_COUNTDOWN, saturate(progress, 999), saturate(total, 999));
+    expect(what, buf, 20, expected);
+}
+
+static void check_percentage(uint16_t percentage)
+{
+    char buf[20], expected[32], what[64];
+    snprintf(what, sizeof(what), "format_percentage(%u)", percentage);
+    format_percentage(buf, percentage);
+    snprintf(expected, sizeof(expected), OLD_PERCENTAGE, saturate(percentage, 999));
+    expect(what, buf, 20, expected);
+}
+
+static void check_clocks()
+{
+    char buf[20], expected[32], what[64];
+    for (uint8_t h = 0; h < 24; h++)
+    {
+        for (uint8_t m = 0; m < 60; m++)
+        {
+            // Includes leap seconds
+            for (uint8_t s = 0; s <= 60; s++)
+            {
+                snprintf(what, sizeof(what), "format_clock_P(UTC, %02u:%02u:%02u)", h, m, s);
+                format_clock_P(buf, tpl_time_utc, TIME_HOURS, h, m, s);
+                snprintf(expected, sizeof(expected), OLD_TIME_UTC, h, m, s);
+                expect(what, buf, 20, expected);
+
+                snprintf(what, sizeof(what), "format_clock_P(GPS, %02u:%02u:%02u)", h, m, s);
+                format_clock_P(buf, tpl_time_gps, TIME_HOURS, h, m, s);
+                snprintf(expected, sizeof(expected), OLD_TIME_GPS, h, m, s);
+                expect(what, buf, 20, expected);
+
+                // The old format was 21 chars: the display only ever showed the first 20
+                snprintf(what, sizeof(what), "format_clock_P(NOT LOCKED, %02u:%02u:%02u)", h, m, s);
+                format_clock_P(buf, tpl_time_nolock, TIME_HOURS_NOLOCK, h, m, s);
+                snprintf(expected, sizeof(expected), OLD_TIME_NOLOCK, h, m, s);
+                expect(what, buf, 20, expected);
+            }
+        }
+    }
+}
+
+/*
+ * Long exposures: the line that display_update() would choose, at the
+ * start, middle and end of the exposure
+ */
+static void check_exposure(enum timing_mode mode, uint16_t total)
+{
+    timing_mode = mode;
+    exposure_total = total;
+    display_update_config();
+
+    uint16_t progress[] = {0, total / 2, total - 1};
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        uint16_t p = progress[i];
+        if (exposure_mode == EXPOSURE_PERCENT)
+            check_percentage(p / (total / 100));
+        else if (exposure_mode == EXPOSURE_SECONDS)
+        {
+            if (mode == MODE_HIGHRES)
+                check_countdown(p / 1000, total / 1000);
+            else
+                check_countdown(p, total);
+        }
+    }
+
+    // Second counts that don't fit the countdown must switch to a percentage
+    if (mode == MODE_PULSECOUNTER && total > 999)
+    {
+        cases++;
+        if (exposure_mode != EXPOSURE_PERCENT)
+        {
+            failures++;
+            fprintf(stderr, "%us exposure is not shown as a percentage\n", total);
+        }
+    }
+}
+
+int main()
+{
+    check_digits();
+
+    for (uint8_t i = 0; i < BOUNDARY_COUNT; i++)
+    {
+        check_percentage(boundaries[i]);
+        for (uint8_t j = 0; j < BOUNDARY_COUNT; j++)
+            check_countdown(boundaries[i], boundaries[j]);
+    }
+
+    for (uint16_t p = 0; p <= 100; p++)
+        check_percentage(p);
+
+    check_clocks();
+
+    const uint16_t exposures[] = {2, 9, 10, 99, 100, 999, 1000, 1001, 1500, 3600, 9999, 10000, 65535};
+    for (uint8_t i = 0; i < sizeof(exposures) / sizeof(exposures[0]); i++)
+        check_exposure(MODE_PULSECOUNTER, exposures[i]);
+
+    const uint16_t highres_exposures[] = {2000, 2500, 9000, 10000, 60000, 65000, 65535};
+    for (uint8_t i = 0; i < sizeof(highres_exposures) / sizeof(highres_exposures[0]); i++)
+        check_exposure(MODE_HIGHRES, highres_exposures[i]);
+
+    printf("display-check: %u of %u cases ok\n", cases - failures, cases);
+    return failures ? 1 : 0;
+}
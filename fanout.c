@@ -0,0 +1,498 @@
+//***************************************************************************
+//
+//  File        : fanout.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Owns the timer's serial port and shares the packet stream
+//                with multiple local clients
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "protocol.h"
+#include "serial.h"
+
+#define MAX_CLIENTS 32
+#define DEFAULT_SOCKET "/tmp/karaka.sock"
+#define DEFAULT_QUEUE_LENGTH 256
+
+struct slot
+{
+    uint8_t length;
+    uint8_t bytes[PROTOCOL_MAX_PACKET_LENGTH];
+};
+
+/*
+ * Each client has a ring of whole encoded packets. The packet currently being
+ * written is moved out of the ring into pending, so that dropping the oldest
+ * queued packet can never truncate one that is half way to the client
+ */
+struct client
+{
+    int fd;
+    struct protocol_decoder commands;
+
+    struct slot *queue;
+    uint16_t queue_read;
+    uint16_t queue_count;
+
+    uint8_t pending[PROTOCOL_MAX_PACKET_LENGTH];
+    uint8_t pending_length;
+    uint8_t pending_sent;
+
+    // Packets dropped since the client was last told about them
+    uint32_t dropped;
+    uint64_t total_dropped;
+};
+
+struct server
+{
+    int device;
+    int listeners[2];
+    struct client clients[MAX_CLIENTS];
+    uint16_t queue_length;
+
+    // Index of the client allowed to start and stop exposures, or -1
+    int controller;
+
+    // Most recent state, sent to clients as they connect
+    struct slot last_status;
+    struct slot last_timestamp;
+};
+
+static volatile bool running = true;
+
+static void handle_signal(int sig)
+{
+    (void)sig;
+    running = false;
+}
+
+static void set_nonblocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static void queue_packet(struct server *s, struct client *c, const uint8_t *bytes, uint8_t length)
+{
+    if (c->queue_count == s->queue_length)
+    {
+        // Drop the oldest queued packet
+        c->queue_read = (c->queue_read + 1) % s->queue_length;
+        c->queue_count--;
+        c->dropped++;
+        c->total_dropped++;
+    }
+
+    struct slot *slot = &c->queue[(c->queue_read + c->queue_count++) % s->queue_length];
+    slot->length = length;
+    memcpy(slot->bytes, bytes, length);
+}
+
+// Encode a MESSAGE packet in the format used by usb_send_message_fmt_P
+static uint8_t encode_message(uint8_t *buf, const char *fmt, va_list args)
+{
+    uint8_t data[PROTOCOL_MAX_DATA_LENGTH + 1];
+    int len = vsnprintf((char *)&data[1], PROTOCOL_MAX_DATA_LENGTH, fmt, args);
+    if (len > PROTOCOL_MAX_DATA_LENGTH - 1)
+        len = PROTOCOL_MAX_DATA_LENGTH - 1;
+    data[0] = (uint8_t)len;
+
+    return protocol_encode(buf, PACKET_MESSAGE, data, data[0] + 1);
+}
+
+// Send a message to a single client
+static void queue_message(struct server *s, struct client *c, const char *fmt, ...)
+{
+    uint8_t buf[PROTOCOL_MAX_PACKET_LENGTH];
+    va_list args;
+    va_start(args, fmt);
+    uint8_t length = encode_message(buf, fmt, args);
+    va_end(args);
+
+    queue_packet(s, c, buf, length);
+}
+
+// Place a message directly in the client's pending buffer, ahead of the queue
+static void set_pending_message(struct client *c, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    c->pending_length = encode_message(c->pending, fmt, args);
+    va_end(args);
+    c->pending_sent = 0;
+}
+
+static void close_client(struct server *s, int index)
+{
+    struct client *c = &s->clients[index];
+    if (c->total_dropped)
+        fprintf(stderr, "Client %d disconnected after dropping %llu packets\n",
+                index, (unsigned long long)c->total_dropped);
+
+    close(c->fd);
+    free(c->queue);
+    c->fd = -1;
+    c->queue = NULL;
+
+    // Release control, but leave any running sequence alone
+    if (s->controller == index)
+        s->controller = -1;
+}
+
+/*
+ * Write as much queued data as the client will accept without blocking
+ */
+static void flush_client(struct server *s, int index)
+{
+    struct client *c = &s->clients[index];
+    for (;;)
+    {
+        if (c->pending_sent == c->pending_length)
+        {
+            if (c->dropped)
+            {
+                // Report the gap in place of the missing packets
+                set_pending_message(c, "Server dropped %u packets: client is reading too slowly", c->dropped);
+                c->dropped = 0;
+            }
+            else
+            {
+                if (!c->queue_count)
+                    return;
+
+                struct slot *slot = &c->queue[c->queue_read];
+                memcpy(c->pending, slot->bytes, slot->length);
+                c->pending_length = slot->length;
+                c->pending_sent = 0;
+                c->queue_read = (c->queue_read + 1) % s->queue_length;
+                c->queue_count--;
+            }
+        }
+
+        ssize_t written = send(c->fd, c->pending + c->pending_sent,
+                               c->pending_length - c->pending_sent, MSG_NOSIGNAL);
+        if (written < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                close_client(s, index);
+            return;
+        }
+
+        c->pending_sent += written;
+    }
+}
+
+static void broadcast(struct server *s, const uint8_t *bytes, uint8_t length)
+{
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        if (s->clients[i].fd != -1)
+            queue_packet(s, &s->clients[i], bytes, length);
+}
+
+static void accept_client(struct server *s, int listener)
+{
+    int fd = accept(listener, NULL, NULL);
+    if (fd == -1)
+        return;
+
+    int index = 0;
+    while (index < MAX_CLIENTS && s->clients[index].fd != -1)
+        index++;
+
+    if (index == MAX_CLIENTS)
+    {
+        fprintf(stderr, "Rejecting client: limit of %d reached\n", MAX_CLIENTS);
+        close(fd);
+        return;
+    }
+
+    set_nonblocking(fd);
+    struct client *c = &s->clients[index];
+    memset(c, 0, sizeof(struct client));
+    c->fd = fd;
+    c->queue = malloc(s->queue_length * sizeof(struct slot));
+    protocol_decoder_init(&c->commands);
+
+    if (s->last_status.length)
+        queue_packet(s, c, s->last_status.bytes, s->last_status.length);
+    if (s->last_timestamp.length)
+        queue_packet(s, c, s->last_timestamp.bytes, s->last_timestamp.length);
+}
+
+/*
+ * Forward a command from a client to the timer
+ * Only one client may control exposures: the first to start a sequence holds
+ * control until it stops the sequence, the timer finishes it, or it disconnects
+ */
+static void handle_command(struct server *s, int index, const struct protocol_packet *p)
+{
+    struct client *c = &s->clients[index];
+    bool stop = p->type == PACKET_STOP_EXPOSURE || p->type == PACKET_ABORT_EXPOSURE;
+    bool control = p->type == PACKET_START_EXPOSURE || stop || p->type == PACKET_ENABLE_RELAY;
+
+    if (control && s->controller != -1 && s->controller != index)
+    {
+        queue_message(s, c, "Ignoring command '%c': exposures are controlled by another client", p->type);
+        return;
+    }
+
+    if (p->type == PACKET_START_EXPOSURE)
+        s->controller = index;
+    else if (stop)
+        s->controller = -1;
+
+    uint8_t buf[PROTOCOL_MAX_PACKET_LENGTH];
+    size_t length = protocol_encode(buf, p->type, p->data, p->length);
+    if (!length)
+        return;
+
+    if (!serial_write_all(s->device, buf, length))
+    {
+        fprintf(stderr, "Failed to write to timer: %s\n", strerror(errno));
+        running = false;
+    }
+}
+
+static void read_client(struct server *s, int index)
+{
+    struct client *c = &s->clients[index];
+    uint8_t buf[256];
+    ssize_t length = recv(c->fd, buf, sizeof(buf), 0);
+    if (length <= 0)
+    {
+        if (length == 0 || (errno != EAGAIN && errno != EINTR))
+            close_client(s, index);
+        return;
+    }
+
+    for (ssize_t i = 0; i < length && c->fd != -1; i++)
+        if (protocol_decode_byte(&c->commands, buf[i]))
+            handle_command(s, index, &c->commands.packet);
+}
+
+static void handle_device_packet(struct server *s, const struct protocol_packet *p)
+{
+    uint8_t buf[PROTOCOL_MAX_PACKET_LENGTH];
+    size_t length = protocol_encode(buf, p->type, p->data, p->length);
+    if (!length)
+        return;
+
+    if (p->type == PACKET_STATUS || p->type == PACKET_TIMESTAMP)
+    {
+        struct slot *last = p->type == PACKET_STATUS ? &s->last_status : &s->last_timestamp;
+        last->length = length;
+        memcpy(last->bytes, buf, length);
+    }
+
+    // The timer finished the sequence by itself
+    if (p->type == PACKET_STOP_EXPOSURE ||
+        (p->type == PACKET_STATUS && p->length >= 1 && p->data[0] == PROTOCOL_TIMER_IDLE))
+        s->controller = -1;
+
+    broadcast(s, buf, length);
+}
+
+static int open_unix_listener(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 8))
+    {
+        fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    set_nonblocking(fd);
+    return fd;
+}
+
+/*
+ * Listen for TCP clients on [host:]port
+ * Binds to the loopback interface unless a host is given
+ */
+static int open_tcp_listener(const char *spec)
+{
+    char host[256] = "127.0.0.1";
+    const char *port = spec;
+    const char *colon = strrchr(spec, ':');
+    if (colon)
+    {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+        port = colon + 1;
+    }
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE};
+    struct addrinfo *info;
+    if (getaddrinfo(host, port, &hints, &info))
+    {
+        fprintf(stderr, "Invalid TCP address: %s\n", spec);
+        return -1;
+    }
+
+    int fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    int reuse = 1;
+    if (fd != -1)
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    if (fd == -1 || bind(fd, info->ai_addr, info->ai_addrlen) || listen(fd, 8))
+    {
+        fprintf(stderr, "Failed to listen on %s: %s\n", spec, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        fd = -1;
+    }
+    else
+        set_nonblocking(fd);
+
+    freeaddrinfo(info);
+    return fd;
+}
+
+static void print_usage()
+{
+    printf("Usage: fanout [options] <port>\n");
+    printf("  -s <path>         unix socket path (default %s)\n", DEFAULT_SOCKET);
+    printf("  -t <[host:]port>  also accept TCP clients (default host 127.0.0.1)\n");
+    printf("  -q <packets>      per-client queue length (default %d)\n", DEFAULT_QUEUE_LENGTH);
+    printf("  -b <baud>         line rate (default 9600)\n");
+    printf("Clients receive every packet from the timer and may send commands in the\n");
+    printf("same framing. The oldest queued packets are dropped for slow clients.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *socket_path = DEFAULT_SOCKET;
+    const char *tcp = NULL;
+    unsigned baud = SERIAL_DEFAULT_BAUD;
+    struct server s = {
+        .listeners = {-1, -1},
+        .queue_length = DEFAULT_QUEUE_LENGTH,
+        .controller = -1,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:t:q:b:")) != -1)
+    {
+        switch (opt)
+        {
+            case 's': socket_path = optarg; break;
+            case 't': tcp = optarg; break;
+            case 'q': s.queue_length = atoi(optarg); break;
+            case 'b': baud = atoi(optarg); break;
+            default: print_usage(); return 1;
+        }
+    }
+
+    if (optind != argc - 1 || !s.queue_length || !baud)
+    {
+        print_usage();
+        return 1;
+    }
+
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        s.clients[i].fd = -1;
+
+    s.device = serial_open(argv[optind], baud);
+    if (s.device == -1)
+        return 1;
+
+    s.listeners[0] = open_unix_listener(socket_path);
+    if (s.listeners[0] == -1)
+        return 1;
+
+    if (tcp && (s.listeners[1] = open_tcp_listener(tcp)) == -1)
+        return 1;
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    struct protocol_decoder d;
+    protocol_decoder_init(&d);
+
+    while (running)
+    {
+        // Device, listeners, then clients
+        struct pollfd fds[3 + MAX_CLIENTS];
+        fds[0] = (struct pollfd){.fd = s.device, .events = POLLIN};
+        for (int i = 0; i < 2; i++)
+            fds[1 + i] = (struct pollfd){.fd = s.listeners[i], .events = POLLIN};
+        for (int i = 0; i < MAX_CLIENTS; i++)
+        {
+            struct client *c = &s.clients[i];
+            bool waiting = c->pending_sent != c->pending_length || c->queue_count || c->dropped;
+            fds[3 + i] = (struct pollfd){.fd = c->fd, .events = POLLIN | (waiting ? POLLOUT : 0)};
+        }
+
+        if (poll(fds, 3 + MAX_CLIENTS, 1000) <= 0)
+            continue;
+
+        if (fds[0].revents & (POLLIN | POLLERR | POLLHUP))
+        {
+            uint8_t buf[256];
+            ssize_t length = read(s.device, buf, sizeof(buf));
+            if (length <= 0 && !(length < 0 && errno == EINTR))
+            {
+                fprintf(stderr, "Read failed: %s\n", length ? strerror(errno) : "end of file");
+                break;
+            }
+
+            for (ssize_t i = 0; i < length; i++)
+                if (protocol_decode_byte(&d, buf[i]))
+                    handle_device_packet(&s, &d.packet);
+        }
+
+        for (int i = 0; i < 2; i++)
+            if (fds[1 + i].revents & POLLIN)
+                accept_client(&s, s.listeners[i]);
+
+        for (int i = 0; i < MAX_CLIENTS; i++)
+        {
+            // Clients accepted during this iteration were not polled
+            if (s.clients[i].fd == -1 || fds[3 + i].fd != s.clients[i].fd)
+                continue;
+
+            if (fds[3 + i].revents & (POLLIN | POLLERR | POLLHUP))
+                read_client(&s, i);
+
+            if (s.clients[i].fd != -1)
+                flush_client(&s, i);
+        }
+    }
+
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        if (s.clients[i].fd != -1)
+            close_client(&s, i);
+
+    for (int i = 0; i < 2; i++)
+        if (s.listeners[i] != -1)
+            close(s.listeners[i]);
+
+    unlink(socket_path);
+    close(s.device);
+    return 0;
+}
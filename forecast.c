@@ -0,0 +1,185 @@
+//***************************************************************************
+//
+//  File        : forecast.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Checks the FORECAST packets in a recorded stream against
+//                the triggers that followed them
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "protocol.h"
+#include "record.h"
+
+/*
+ * Each FORECAST packet supersedes the previous one. A trigger is "announced"
+ * if the most recent forecast listed its exact time, "mismatched" if it
+ * fell inside the forecast span but not on the announced grid, and
+ * "unannounced" otherwise (e.g. the first second of a sequence, before any
+ * forecast has been sent).
+ */
+struct checker
+{
+    struct protocol_forecast forecast;
+    bool have_forecast;
+    bool verbose;
+
+    uint64_t forecasts;
+    uint64_t cancels;
+    uint64_t triggers;
+    uint64_t announced;
+    uint64_t mismatched;
+    uint64_t unannounced;
+
+    // Shortest time between a forecast's base time and a trigger it announced
+    int64_t min_lead_ns;
+};
+
+static void print_time(const char *label, int64_t t)
+{
+    printf(" %s=%lld.%03lld", label, (long long)(t / 1000000000LL), (long long)(t % 1000000000LL / 1000000));
+}
+
+static void add_packet(struct checker *c, const struct protocol_packet *p)
+{
+    struct protocol_forecast f;
+    struct protocol_timestamp t;
+
+    if (p->type == PACKET_FORECAST && protocol_parse_forecast(p->data, p->length, &f))
+    {
+        c->forecasts++;
+        if (!f.count)
+            c->cancels++;
+
+        c->forecast = f;
+        c->have_forecast = f.count > 0;
+    }
+    else if (p->type == PACKET_TRIGGER && protocol_parse_timestamp(p->data, p->length, &t))
+    {
+        int64_t trigger = protocol_timestamp_utc_ns(&t);
+        c->triggers++;
+
+        const char *result = "unannounced";
+        int64_t error = 0;
+        if (c->have_forecast && c->forecast.period_ms)
+        {
+            int64_t first = protocol_forecast_trigger_ns(&c->forecast, 0);
+            int64_t period = c->forecast.period_ms * 1000000LL;
+            int64_t k = (trigger - first + period / 2) / period;
+            if (trigger >= first - period / 2 && k < c->forecast.count)
+            {
+                int64_t expected = protocol_forecast_trigger_ns(&c->forecast, k);
+                error = trigger - expected;
+                if (error == 0)
+                {
+                    result = "announced";
+                    c->announced++;
+
+                    int64_t lead = trigger - protocol_timestamp_utc_ns(&c->forecast.base);
+                    if (c->announced == 1 || lead < c->min_lead_ns)
+                        c->min_lead_ns = lead;
+                }
+                else
+                {
+                    result = "mismatched";
+                    c->mismatched++;
+                }
+            }
+        }
+
+        if (!strcmp(result, "unannounced"))
+            c->unannounced++;
+
+        if (c->verbose)
+        {
+            printf("%llu %s", (unsigned long long)c->triggers - 1, result);
+            print_time("time", trigger);
+            if (error)
+                printf(" error_ms=%lld", (long long)(error / 1000000));
+            printf("\n");
+        }
+    }
+}
+
+static bool check_stream(const char *path, struct checker *c)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    struct protocol_decoder d;
+    protocol_decoder_init(&d);
+
+    // Accept devreplay recordings or raw captures of the stream
+    char magic[8];
+    if (fread(magic, 1, 8, f) == 8 && !memcmp(magic, RECORD_MAGIC, 8))
+    {
+        struct record_chunk *chunk = malloc(sizeof(struct record_chunk));
+        while (record_read(f, chunk))
+            if (chunk->direction == RECORD_FROM_DEVICE)
+                for (uint16_t i = 0; i < chunk->length; i++)
+                    if (protocol_decode_byte(&d, chunk->data[i]))
+                        add_packet(c, &d.packet);
+        free(chunk);
+    }
+    else
+    {
+        rewind(f);
+        int b;
+        while ((b = fgetc(f)) != EOF)
+            if (protocol_decode_byte(&d, b))
+                add_packet(c, &d.packet);
+    }
+
+    fclose(f);
+    return true;
+}
+
+static void print_usage()
+{
+    printf("Usage: forecast [-v] <recording|capture>\n");
+    printf("  -v   print one line per trigger: <index> <announced|mismatched|unannounced> time=<utc>\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct checker c = {0};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "v")) != -1)
+    {
+        switch (opt)
+        {
+            case 'v': c.verbose = true; break;
+            default: print_usage(); return 1;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        print_usage();
+        return 1;
+    }
+
+    if (!check_stream(argv[optind], &c))
+        return 1;
+
+    fprintf(stderr, "{\"forecasts\": %llu, \"cancels\": %llu, \"triggers\": %llu, \"announced\": %llu, "
+            "\"mismatched\": %llu, \"unannounced\": %llu, \"min_lead_ms\": %lld}\n",
+            (unsigned long long)c.forecasts, (unsigned long long)c.cancels, (unsigned long long)c.triggers,
+            (unsigned long long)c.announced, (unsigned long long)c.mismatched, (unsigned long long)c.unannounced,
+            (long long)(c.min_lead_ns / 1000000));
+
+    return c.mismatched ? 2 : 0;
+}
@@ -0,0 +1,266 @@
+//***************************************************************************
+//
+//  File        : framematch.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Matches TRIGGER packets from the timer with camera frames
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <string.h>
+#include "framematch.h"
+
+/*
+ * Each trigger predicts that its frame will reach the host latency_ns after
+ * the trigger time. Frames before the oldest trigger's frame belong to
+ * exposures without a TRIGGER packet (trigger_stride > 1, or a lost packet);
+ * a trigger whose frame never arrives is reported once a later frame is seen
+ * or its arrival window has passed.
+ */
+
+static void emit(struct framematch *m, struct framematch_event *e)
+{
+    m->counts[e->type]++;
+    if (m->callback)
+        m->callback(e, m->param);
+}
+
+static struct framematch_trigger pop_trigger(struct framematch *m)
+{
+    struct framematch_trigger t = m->triggers[m->trigger_read];
+    m->trigger_read = (m->trigger_read + 1) % FRAMEMATCH_QUEUE_LENGTH;
+    m->trigger_count--;
+    return t;
+}
+
+static struct framematch_frame pop_frame(struct framematch *m)
+{
+    struct framematch_frame f = m->frames[m->frame_read];
+    m->frame_read = (m->frame_read + 1) % FRAMEMATCH_QUEUE_LENGTH;
+    m->frame_count--;
+    return f;
+}
+
+static int64_t round_div(int64_t a, int64_t b)
+{
+    return a >= 0 ? (a + b / 2) / b : -((-a + b / 2) / b);
+}
+
+// A frame that will never be matched: only an error if the stride says it should have been
+static void unmatched_frame(struct framematch *m, const struct framematch_frame *f)
+{
+    if (!m->locked || (f->id - m->last_frame_id) % m->config.stride != 0)
+        return;
+
+    emit(m, &(struct framematch_event){
+        .type = FRAMEMATCH_MISSING_TRIGGER,
+        .frame_id = f->id,
+        .frame_ns = f->arrival_ns
+    });
+}
+
+static void match(struct framematch *m)
+{
+    struct framematch_trigger t = pop_trigger(m);
+    struct framematch_frame f = pop_frame(m);
+
+    // Track slow changes in readout and transfer time
+    m->latency_ns += (f.arrival_ns - t.time_ns - m->latency_ns) / 16;
+
+    m->locked = true;
+    m->last_frame_id = f.id;
+    m->last_trigger_ns = t.time_ns;
+
+    emit(m, &(struct framematch_event){
+        .type = FRAMEMATCH_MATCHED,
+        .trigger_index = t.index,
+        .trigger_ns = t.time_ns,
+        .frame_id = f.id,
+        .frame_ns = f.arrival_ns
+    });
+}
+
+static void missing_frame(struct framematch *m)
+{
+    struct framematch_trigger t = pop_trigger(m);
+    emit(m, &(struct framematch_event){
+        .type = FRAMEMATCH_MISSING_FRAME,
+        .trigger_index = t.index,
+        .trigger_ns = t.time_ns
+    });
+}
+
+/*
+ * Unless the first frame number is known, the first match (and the first
+ * after a sequence error) pairs frames with triggers by arrival time alone,
+ * so the configured latency must be right to within half a period. Once locked, the frame number expected for each
+ * trigger is known from the trigger times, so frames are matched by number
+ * and the arrival time is only used to notice numbering that has jumped
+ * backwards or forwards. This keeps working at frame rates where the host's
+ * arrival jitter spans several frames.
+ *
+ * now_ns < 0 means that only the data itself is used, without timeouts
+ */
+static void process(struct framematch *m, int64_t now_ns)
+{
+    int64_t tolerance = m->config.tolerance_ns;
+    while (m->trigger_count)
+    {
+        const struct framematch_trigger *t = &m->triggers[m->trigger_read];
+        int64_t predicted = t->time_ns + m->latency_ns;
+        bool timed_out = now_ns >= 0 && now_ns > predicted + tolerance;
+
+        if (!m->locked && t->index == 0 && m->config.first_frame_id >= 0)
+        {
+            // The first frame number is known, so timing is not needed
+            uint64_t first = m->config.first_frame_id;
+            while (m->frame_count && m->frames[m->frame_read].id < first)
+                pop_frame(m);
+
+            if (m->frame_count && m->frames[m->frame_read].id == first)
+                match(m);
+            else if (m->frame_count || timed_out)
+                missing_frame(m);
+            else
+                return;
+
+            continue;
+        }
+
+        if (!m->locked)
+        {
+            int64_t window = tolerance < m->config.period_ns / 2 ? tolerance : m->config.period_ns / 2;
+
+            // Frames from exposures before this trigger
+            while (m->frame_count && m->frames[m->frame_read].arrival_ns < predicted - window)
+                pop_frame(m);
+
+            if (m->frame_count && m->frames[m->frame_read].arrival_ns <= predicted + window)
+                match(m);
+            else if (m->frame_count || timed_out)
+                missing_frame(m);
+            else
+                return;
+
+            continue;
+        }
+
+        uint64_t expected = m->last_frame_id + round_div(t->time_ns - m->last_trigger_ns, m->config.period_ns);
+        while (m->frame_count)
+        {
+            const struct framematch_frame *f = &m->frames[m->frame_read];
+            if (f->id >= expected || f->arrival_ns > predicted + tolerance)
+                break;
+
+            struct framematch_frame skipped = pop_frame(m);
+            unmatched_frame(m, &skipped);
+        }
+
+        if (m->frame_count)
+        {
+            const struct framematch_frame *f = &m->frames[m->frame_read];
+            if (f->id == expected)
+                match(m);
+            else if (f->id > expected && f->arrival_ns >= predicted - tolerance)
+                missing_frame(m);
+            else
+            {
+                // The frame numbers no longer agree with the trigger times
+                // (e.g. the camera restarted its numbering): resynchronise by time
+                emit(m, &(struct framematch_event){
+                    .type = FRAMEMATCH_SEQUENCE_ERROR,
+                    .trigger_index = t->index,
+                    .trigger_ns = t->time_ns,
+                    .frame_id = f->id,
+                    .frame_ns = f->arrival_ns,
+                    .expected_frame_id = expected
+                });
+                m->locked = false;
+            }
+        }
+        else if (timed_out)
+            missing_frame(m);
+        else
+            return;
+    }
+
+    // With no triggers queued, a frame is given up on once its own TRIGGER
+    // packet would have arrived
+    if (now_ns < 0)
+        return;
+
+    int64_t timeout = m->config.trigger_delay_ns + tolerance - m->latency_ns;
+    while (m->frame_count && now_ns - m->frames[m->frame_read].arrival_ns > timeout)
+    {
+        struct framematch_frame f = pop_frame(m);
+        unmatched_frame(m, &f);
+    }
+}
+
+void framematch_init(struct framematch *m, const struct framematch_config *config,
+                     framematch_callback callback, void *param)
+{
+    memset(m, 0, sizeof(struct framematch));
+    m->config = *config;
+    if (m->config.stride == 0)
+        m->config.stride = 1;
+
+    m->callback = callback;
+    m->param = param;
+    m->latency_ns = config->latency_ns;
+}
+
+/*
+ * Add a trigger time (the UTC time from a TRIGGER packet)
+ */
+void framematch_add_trigger(struct framematch *m, int64_t trigger_ns)
+{
+    if (m->trigger_count == FRAMEMATCH_QUEUE_LENGTH)
+    {
+        struct framematch_trigger t = pop_trigger(m);
+        emit(m, &(struct framematch_event){
+            .type = FRAMEMATCH_OVERFLOW,
+            .trigger_index = t.index,
+            .trigger_ns = t.time_ns
+        });
+    }
+
+    struct framematch_trigger *t = &m->triggers[(m->trigger_read + m->trigger_count++) % FRAMEMATCH_QUEUE_LENGTH];
+    t->index = m->next_trigger_index++;
+    t->time_ns = trigger_ns;
+    process(m, -1);
+}
+
+/*
+ * Add a frame from the camera, with its sequence number and the host
+ * (UTC) time that it arrived
+ */
+void framematch_add_frame(struct framematch *m, uint64_t frame_id, int64_t arrival_ns)
+{
+    if (m->frame_count == FRAMEMATCH_QUEUE_LENGTH)
+    {
+        struct framematch_frame f = pop_frame(m);
+        emit(m, &(struct framematch_event){
+            .type = FRAMEMATCH_OVERFLOW,
+            .frame_id = f.id,
+            .frame_ns = f.arrival_ns
+        });
+    }
+
+    struct framematch_frame *f = &m->frames[(m->frame_read + m->frame_count++) % FRAMEMATCH_QUEUE_LENGTH];
+    f->id = frame_id;
+    f->arrival_ns = arrival_ns;
+    process(m, -1);
+}
+
+/*
+ * Apply timeouts, so that a lost frame or trigger is reported even if
+ * the other stream has stopped. Call periodically with the host time
+ */
+void framematch_update(struct framematch *m, int64_t now_ns)
+{
+    process(m, now_ns);
+}
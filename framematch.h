@@ -0,0 +1,133 @@
+//***************************************************************************
+//
+//  File        : framematch.h
+//  Copyright   : 2013 Paul Chote
+//  Description : Matches TRIGGER packets from the timer with camera frames
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#ifndef KARAKA_FRAMEMATCH_H
+#define KARAKA_FRAMEMATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Triggers and frames waiting to be matched; the oldest are discarded beyond this
+#define FRAMEMATCH_QUEUE_LENGTH 1024
+
+struct framematch_config
+{
+    // Exposure period, and the number of frames per TRIGGER packet (trigger_stride)
+    int64_t period_ns;
+    uint32_t stride;
+
+    // Expected delay from the end of an exposure (the trigger time) to the
+    // frame reaching the host: readout, transfer and any host clock offset.
+    // This is refined from matched pairs as the sequence runs
+    int64_t latency_ns;
+
+    // Longest time from the trigger time until its TRIGGER packet reaches the
+    // host (serial transfer and host scheduling). Unmatched frames are held
+    // this long before being reported as missing a trigger
+    int64_t trigger_delay_ns;
+
+    // Frame number of the first triggered exposure, if the camera numbers
+    // frames from a known value at the start of the sequence, or -1. Without
+    // it, the first match is made by arrival time alone
+    int64_t first_frame_id;
+
+    // Largest difference between the expected and actual frame arrival that
+    // is accepted as a match. When pairing by arrival time alone, at most
+    // half the period is used
+    int64_t tolerance_ns;
+};
+
+enum framematch_event_type
+{
+    // A trigger and a frame were paired
+    FRAMEMATCH_MATCHED,
+
+    // No frame arrived for a trigger
+    FRAMEMATCH_MISSING_FRAME,
+
+    // A frame that should have been triggered had no TRIGGER packet
+    FRAMEMATCH_MISSING_TRIGGER,
+
+    // The frame numbers between two matches don't agree with the trigger times
+    FRAMEMATCH_SEQUENCE_ERROR,
+
+    // A queue overflowed because the other stream stalled
+    FRAMEMATCH_OVERFLOW,
+};
+
+struct framematch_event
+{
+    enum framematch_event_type type;
+
+    // Set for events involving a trigger
+    uint64_t trigger_index;
+    int64_t trigger_ns;
+
+    // Set for events involving a frame
+    uint64_t frame_id;
+    int64_t frame_ns;
+
+    // For FRAMEMATCH_SEQUENCE_ERROR, the frame number that was expected
+    uint64_t expected_frame_id;
+};
+
+typedef void (*framematch_callback)(const struct framematch_event *event, void *param);
+
+struct framematch_trigger
+{
+    uint64_t index;
+    int64_t time_ns;
+};
+
+struct framematch_frame
+{
+    uint64_t id;
+    int64_t arrival_ns;
+};
+
+/*
+ * All storage is held in the struct, so a matcher can be declared
+ * statically or on the stack and never allocates
+ */
+struct framematch
+{
+    struct framematch_config config;
+    framematch_callback callback;
+    void *param;
+
+    struct framematch_trigger triggers[FRAMEMATCH_QUEUE_LENGTH];
+    uint16_t trigger_read;
+    uint16_t trigger_count;
+    uint64_t next_trigger_index;
+
+    struct framematch_frame frames[FRAMEMATCH_QUEUE_LENGTH];
+    uint16_t frame_read;
+    uint16_t frame_count;
+
+    // Running estimate of the trigger to arrival latency
+    int64_t latency_ns;
+
+    // The most recent match, used to check frame numbering
+    bool locked;
+    uint64_t last_frame_id;
+    int64_t last_trigger_ns;
+
+    uint64_t counts[FRAMEMATCH_OVERFLOW + 1];
+};
+
+void framematch_init(struct framematch *m, const struct framematch_config *config,
+                     framematch_callback callback, void *param);
+void framematch_add_trigger(struct framematch *m, int64_t trigger_ns);
+void framematch_add_frame(struct framematch *m, uint64_t frame_id, int64_t arrival_ns);
+void framematch_update(struct framematch *m, int64_t now_ns);
+
+#endif
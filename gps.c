@@ -211,7 +211,11 @@ static uint8_t is_leap_year(uint16_t year)
     return (year % 400) ? 0 : 1;
 }
 
-void parse_packet(struct gps_packet *p)
+/*
+ * Decode a complete packet into t
+ * Returns true if the packet holds a time
+ */
+static bool decode_packet(struct gps_packet *p, struct timestamp *t)
 {
     static bool magellan_time_locked = false;
     switch (p->length)
@@ -220,7 +224,7 @@ void parse_packet(struct gps_packet *p)
         {
             struct trimble_timestamp *tt = &p->data.trimble;
 
-            struct timestamp t = (struct timestamp) {
+            *t = (struct timestamp) {
                 .year = swap_bytes(tt->year),
                 .month = tt->month,
                 .day = tt->day,
@@ -235,17 +239,16 @@ void parse_packet(struct gps_packet *p)
 
             // UTC Time, Locked
             if (tt->flags == 0x03)
-                t.flags = TIMESTAMP_LOCKED;
+                t->flags = TIMESTAMP_LOCKED;
 
             // GPS Time, Locked
             else if (tt->flags == 0x00)
             {
-                t.flags = TIMESTAMP_LOCKED | TIMESTAMP_IS_GPS;
-                t.utc_offset = swap_bytes(tt->utc_offset);
+                t->flags = TIMESTAMP_LOCKED | TIMESTAMP_IS_GPS;
+                t->utc_offset = swap_bytes(tt->utc_offset);
             }
 
-            set_time(&t);
-            break;
+            return true;
         }
         case sizeof(struct magellan_status):
         {
@@ -275,7 +278,8 @@ void parse_packet(struct gps_packet *p)
             mt->month = 1;
 
             // Advance full years
-            while (day >= 366)
+            // Day 366 is still within the current year if it is a leap year
+            while (day > (is_leap_year(mt->year) ? 366 : 365))
             {
                 day -= is_leap_year(mt->year) ? 366 : 365;
                 mt->year++;
@@ -286,7 +290,7 @@ void parse_packet(struct gps_packet *p)
             while (day > days[mt->month - 1])
                 day -= days[mt->month++ - 1];
 
-            set_time(&(struct timestamp){
+            *t = (struct timestamp) {
                 .year = mt->year,
                 .month = mt->month,
                 .day = day,
@@ -297,10 +301,123 @@ void parse_packet(struct gps_packet *p)
                 .flags = magellan_time_locked ? TIMESTAMP_LOCKED : 0,
                 .utc_offset = 0,
                 .exposure_progress = 0
-            });
+            };
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Add a received byte to packet p
+ * Returns true if a packet holding a time has been decoded into t
+ */
+static bool process_byte(struct gps_packet *p, uint8_t b, struct timestamp *t)
+{
+    bool decoded = false;
+    switch (p->state)
+    {
+    case TB_HEADER:
+    case MGL_HEADERA:
+        if (b == 0x10)
+            p->state = TB_TYPEA;
+        else if (b == '$')
+            p->state = MGL_HEADERB;
+        break;
+
+    // Trimble packets
+    case TB_TYPEA:
+        // We only care about 8F-AB
+        if (b == 0x8F)
+            p->state++;
+        else
+            p->state = TB_HEADER;
+        break;
+    case TB_TYPEB:
+        if (b == 0xAB)
+        {
+            p->length = sizeof(struct trimble_timestamp);
+            p->progress = 0;
+            p->extra = 0;
+            p->state++;
+        }
+        else
+            p->state = TB_HEADER;
+        break;
+    case TB_DATA:
+        // Padding byte - The next byte is another 0x10, or 0x03 (frame-end)
+        if (b == 0x10 && (p->extra ^= 1))
             break;
+
+        p->data.bytes[p->progress++] = b;
+        if (p->progress == p->length)
+            p->state++;
+        break;
+    case TB_FOOTERA:
+        if (b == 0x10)
+            p->state++;
+        else
+        {
+            usb_send_message_fmt_P(invalid_packet_fmt, b, 0x10);
+            usb_send_raw(p->data.bytes, p->length);
+            p->state = TB_HEADER;
+        }
+        break;
+    case TB_FOOTERB:
+        if (b == 0x03)
+            decoded = decode_packet(p, t);
+        else
+        {
+            usb_send_message_fmt_P(invalid_packet_fmt, b, 0x03);
+            usb_send_raw(p->data.bytes, p->length);
+        }
+        p->state = TB_HEADER;
+        break;
+
+    // Magellan packets
+    case MGL_HEADERB:
+        if (b == '$')
+            p->state++;
+        else
+            p->state = MGL_HEADERA;
+        break;
+    case MGL_TYPE:
+        if (b == 'A' || b == 'H')
+        {
+            p->length = b == 'A' ? sizeof(struct magellan_timestamp) : sizeof(struct magellan_status);
+            p->progress = 0;
+            p->extra = b;
+            p->state++;
+        }
+        else
+            p->state = TB_HEADER;
+        break;
+    case MGL_DATA:
+        p->extra ^= b;
+        p->data.bytes[p->progress++] = b;
+        if (p->progress == p->length)
+            p->state++;
+        break;
+    case MGL_CHECKSUM:
+        if (p->extra == b)
+            p->state++;
+        else
+        {
+            usb_send_message_fmt_P(checksum_failed_fmt, b, p->extra);
+            p->state = MGL_HEADERA;
         }
+        break;
+    case MGL_FOOTER:
+        if (b == '\n')
+            decoded = decode_packet(p, t);
+        else
+            usb_send_message_fmt_P(invalid_packet_fmt, b, '\n');
+        p->state = MGL_HEADERA;
+        break;
     }
+
+    return decoded;
 }
 
 void gps_tick()
@@ -312,105 +429,24 @@ void gps_tick()
         if (timer_status == TIMER_RELAY)
             usb_send_byte(b);
 
-        switch (p.state)
-        {
-        case TB_HEADER:
-        case MGL_HEADERA:
-            if (b == 0x10)
-                p.state = TB_TYPEA;
-            else if (b == '$')
-                p.state = MGL_HEADERB;
-            break;
+        struct timestamp t;
+        if (process_byte(&p, b, &t))
+            set_time(&t);
+    }
+}
 
-        // Trimble packets
-        case TB_TYPEA:
-            // We only care about 8F-AB
-            if (b == 0x8F)
-                p.state++;
-            else
-                p.state = TB_HEADER;
-            break;
-        case TB_TYPEB:
-            if (b == 0xAB)
-            {
-                p.length = sizeof(struct trimble_timestamp);
-                p.progress = 0;
-                p.extra = 0;
-                p.state++;
-            }
-            else
-                p.state = TB_HEADER;
-            break;
-        case TB_DATA:
-            // Padding byte - The next byte is another 0x10, or 0x03 (frame-end)
-            if (b == 0x10 && (p.extra ^= 1))
-                break;
-
-            p.data.bytes[p.progress++] = b;
-            if (p.progress == p.length)
-                p.state++;
-            break;
-        case TB_FOOTERA:
-            if (b == 0x10)
-                p.state++;
-            else
-            {
-                usb_send_message_fmt_P(invalid_packet_fmt, b, 0x10);
-                usb_send_raw(p.data.bytes, p.length);
-                p.state = TB_HEADER;
-            }
-            break;
-        case TB_FOOTERB:
-            if (b == 0x03)
-                parse_packet(&p);
-            else
-            {
-                usb_send_message_fmt_P(invalid_packet_fmt, b, 0x03);
-                usb_send_raw(p.data.bytes, p.length);
-            }
-            p.state = TB_HEADER;
-            break;
+/*
+ * Run a separate parser over data, without setting the time
+ * Used to measure the parsing cost on synthetic input
+ * Returns true if the data contained a time packet
+ */
+bool gps_parse_bytes(const uint8_t *data, uint8_t length)
+{
+    struct gps_packet p = {.state = TB_HEADER};
+    struct timestamp t;
+    bool decoded = false;
+    for (uint8_t i = 0; i < length; i++)
+        decoded |= process_byte(&p, data[i], &t);
 
-        // Magellan packets
-        case MGL_HEADERB:
-            if (b == '$')
-                p.state++;
-            else
-                p.state = MGL_HEADERA;
-            break;
-        case MGL_TYPE:
-            if (b == 'A' || b == 'H')
-            {
-                p.length = b == 'A' ? sizeof(struct magellan_timestamp) : sizeof(struct magellan_status);
-                p.progress = 0;
-                p.extra = b;
-                p.state++;
-            }
-            else
-                p.state = TB_HEADER;
-            break;
-        case MGL_DATA:
-            p.extra ^= b;
-            p.data.bytes[p.progress++] = b;
-            if (p.progress == p.length)
-                p.state++;
-            break;
-        case MGL_CHECKSUM:
-            if (p.extra == b)
-                p.state++;
-            else
-            {
-                usb_send_message_fmt_P(checksum_failed_fmt, b, p.extra);
-                p.state = MGL_HEADERA;
-            }
-            break;
-        case MGL_FOOTER:
-            if (b == '\n')
-                parse_packet(&p);
-            else
-                usb_send_message_fmt_P(invalid_packet_fmt, b, '\n');
-            p.state = MGL_HEADERA;
-            break;
-        }
-    }
+    return decoded;
 }
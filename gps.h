@@ -19,5 +19,6 @@
 void gps_send_byte(uint8_t b);
 void gps_initialize();
 void gps_tick();
+bool gps_parse_bytes(const uint8_t *data, uint8_t length);
 
 #endif
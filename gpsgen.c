@@ -0,0 +1,300 @@
+//***************************************************************************
+//
+//  File        : gpsgen.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Stands in for a GPS receiver, emitting timing packets on a
+//                pty or serial port with a matching time pulse model
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "receiver.h"
+#include "serial.h"
+
+enum format {FORMAT_TRIMBLE, FORMAT_MAGELLAN, FORMAT_UBX};
+
+struct config
+{
+    enum format format;
+    bool supplemental;
+    unsigned baud;
+    unsigned seconds;
+    int64_t start_time;
+    int16_t leap_seconds;
+
+    double latency_ms;
+    double jitter_ms;
+    double pps_width_ms;
+    double pps_jitter_us;
+    double pps_drop;
+    double packet_drop;
+    double bad_checksum;
+    unsigned rollovers;
+};
+
+static volatile bool running = true;
+static uint64_t rng_state = 1;
+
+static void handle_signal(int sig)
+{
+    (void)sig;
+    running = false;
+}
+
+static double random_uniform()
+{
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (double)((rng_state * 2685821657736338717ULL) >> 11) / (double)(1ULL << 53);
+}
+
+static void sleep_until(int64_t ns)
+{
+    struct timespec t = {.tv_sec = ns / 1000000000LL, .tv_nsec = ns % 1000000000LL};
+    while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &t, NULL) == EINTR && running);
+}
+
+// Discard configuration commands sent by the timer
+static void drain_input(int fd)
+{
+    uint8_t buf[256];
+    while (read(fd, buf, sizeof(buf)) > 0);
+}
+
+/*
+ * Write data at the configured line rate, starting at start_ns
+ * A pty delivers bytes instantly, so the pacing is done here
+ */
+static void write_paced(int fd, const uint8_t *data, size_t length, int64_t start_ns, unsigned baud)
+{
+    int64_t byte_ns = 10 * 1000000000LL / baud;
+    for (size_t i = 0; i < length && running; i++)
+    {
+        sleep_until(start_ns + i * byte_ns);
+        if (!serial_write_all(fd, &data[i], 1))
+        {
+            fprintf(stderr, "Write failed: %s\n", strerror(errno));
+            running = false;
+        }
+    }
+}
+
+/*
+ * Build the packets describing the second that started at utc
+ * Returns the total length written to buf
+ */
+static size_t build_packets(const struct config *c, uint8_t *buf, time_t utc, bool *corrupted)
+{
+    // A receiver that has lost track of the GPS week rollover reports dates 1024 weeks early
+    time_t reported = utc - (time_t)c->rollovers * RECEIVER_MAGELLAN_EPOCH_OFFSET;
+
+    size_t length = 0;
+    size_t corrupt_offset = 0;
+    switch (c->format)
+    {
+        case FORMAT_TRIMBLE:
+            length = receiver_encode_trimble(buf, reported, c->leap_seconds,
+                                             TRIMBLE_UTC_TIME | TRIMBLE_UTC_PPS);
+            // TSIP has no checksum; corrupt the DLE ETX footer instead
+            corrupt_offset = length - 1;
+            if (c->supplemental)
+                length += receiver_encode_trimble_supplemental(buf + length,
+                                                               (float)(random_uniform() * 20 - 10), 40.0f);
+            break;
+        case FORMAT_MAGELLAN:
+            length = receiver_encode_magellan_status(buf, true);
+            length += receiver_encode_magellan_time(buf + length, reported);
+            corrupt_offset = length - 2;
+            break;
+        case FORMAT_UBX:
+            length = receiver_encode_ubx_timeutc(buf, reported, c->leap_seconds, true);
+            corrupt_offset = length - 1;
+            length += receiver_encode_ubx_timtp(buf + length, reported + 1, c->leap_seconds,
+                                                (int32_t)(random_uniform() * 4000 - 2000));
+            break;
+    }
+
+    *corrupted = random_uniform() < c->bad_checksum;
+    if (*corrupted)
+        buf[corrupt_offset] ^= 0x5A;
+
+    return length;
+}
+
+static void print_usage()
+{
+    printf("Usage: gpsgen [options]\n");
+    printf("  -f <format>   trimble, trimble-ac, magellan or ubx (default trimble)\n");
+    printf("  -o <port>     write to a serial port instead of creating a pty\n");
+    printf("  -P <port>     drive the time pulse on the DTR line of a serial port\n");
+    printf("  -b <baud>     line rate (default 9600)\n");
+    printf("  -n <seconds>  stop after this many seconds (default: run until interrupted)\n");
+    printf("  -t <time>     unix time reported for the first second (default: system clock)\n");
+    printf("  -L <seconds>  GPS-UTC leap seconds (default 18)\n");
+    printf("  -l <ms>       packet latency after the pulse (default 50)\n");
+    printf("  -j <ms>       uniform packet latency jitter (default 0)\n");
+    printf("  -w <ms>       pulse width (default 10)\n");
+    printf("  -J <us>       gaussian pulse jitter (default 0)\n");
+    printf("  -d <p>        probability of dropping a packet (default 0)\n");
+    printf("  -D <p>        probability of dropping a pulse (default 0)\n");
+    printf("  -c <p>        probability of a bad checksum (default 0)\n");
+    printf("  -r <count>    report dates this many week rollovers early (default 0)\n");
+    printf("  -s <seed>     random seed (default 1)\n");
+    printf("Pulse and packet events are printed to stdout, one per line.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct config c = {
+        .format = FORMAT_TRIMBLE,
+        .baud = SERIAL_DEFAULT_BAUD,
+        .leap_seconds = 18,
+        .latency_ms = 50,
+        .pps_width_ms = 10,
+    };
+    const char *output_port = NULL;
+    const char *pps_port = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:o:P:b:n:t:L:l:j:w:J:d:D:c:r:s:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'f':
+                if (!strcmp(optarg, "trimble"))
+                    c.format = FORMAT_TRIMBLE;
+                else if (!strcmp(optarg, "trimble-ac"))
+                {
+                    c.format = FORMAT_TRIMBLE;
+                    c.supplemental = true;
+                }
+                else if (!strcmp(optarg, "magellan"))
+                    c.format = FORMAT_MAGELLAN;
+                else if (!strcmp(optarg, "ubx"))
+                    c.format = FORMAT_UBX;
+                else
+                {
+                    print_usage();
+                    return 1;
+                }
+                break;
+            case 'o': output_port = optarg; break;
+            case 'P': pps_port = optarg; break;
+            case 'b': c.baud = atoi(optarg); break;
+            case 'n': c.seconds = atoi(optarg); break;
+            case 't': c.start_time = strtoll(optarg, NULL, 0); break;
+            case 'L': c.leap_seconds = atoi(optarg); break;
+            case 'l': c.latency_ms = atof(optarg); break;
+            case 'j': c.jitter_ms = atof(optarg); break;
+            case 'w': c.pps_width_ms = atof(optarg); break;
+            case 'J': c.pps_jitter_us = atof(optarg); break;
+            case 'd': c.packet_drop = atof(optarg); break;
+            case 'D': c.pps_drop = atof(optarg); break;
+            case 'c': c.bad_checksum = atof(optarg); break;
+            case 'r': c.rollovers = atoi(optarg); break;
+            case 's': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+            default: print_usage(); return 1;
+        }
+    }
+
+    if (optind != argc || !c.baud)
+    {
+        print_usage();
+        return 1;
+    }
+
+    int fd;
+    if (output_port)
+        fd = serial_open(output_port, c.baud);
+    else
+    {
+        char name[256];
+        fd = serial_open_pty(name, sizeof(name));
+        if (fd != -1)
+            printf("pty %s\n", name);
+    }
+
+    if (fd == -1)
+        return 1;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    int pps_fd = -1;
+    if (pps_port)
+    {
+        pps_fd = serial_open(pps_port, 0);
+        if (pps_fd == -1)
+            return 1;
+        serial_set_line(pps_fd, TIOCM_DTR, false);
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    // Pulses are aligned with the system clock's second boundaries
+    int64_t second = serial_time_ns(CLOCK_REALTIME) / 1000000000LL + 1;
+    int64_t offset = c.start_time ? c.start_time - second : 0;
+
+    for (unsigned i = 0; running && (!c.seconds || i < c.seconds); i++, second++)
+    {
+        time_t utc = second + offset;
+
+        // Gaussian pulse jitter (Box-Muller)
+        double u = fmax(random_uniform(), 1e-300);
+        double jitter = c.pps_jitter_us * sqrt(-2 * log(u)) * cos(2 * M_PI * random_uniform());
+        int64_t pulse_ns = second * 1000000000LL + (int64_t)(jitter * 1000);
+        sleep_until(pulse_ns);
+        drain_input(fd);
+
+        if (random_uniform() < c.pps_drop)
+            printf("pps %lld dropped\n", (long long)utc);
+        else
+        {
+            if (pps_fd != -1)
+            {
+                serial_set_line(pps_fd, TIOCM_DTR, true);
+                sleep_until(pulse_ns + (int64_t)(c.pps_width_ms * 1e6));
+                serial_set_line(pps_fd, TIOCM_DTR, false);
+            }
+            printf("pps %lld\n", (long long)utc);
+        }
+
+        if (random_uniform() < c.packet_drop)
+        {
+            printf("packet %lld dropped\n", (long long)utc);
+            continue;
+        }
+
+        uint8_t buf[2 * RECEIVER_MAX_PACKET_LENGTH];
+        bool corrupted;
+        size_t length = build_packets(&c, buf, utc, &corrupted);
+
+        double delay_ms = c.latency_ms + c.jitter_ms * random_uniform();
+        write_paced(fd, buf, length, second * 1000000000LL + (int64_t)(delay_ms * 1e6), c.baud);
+        printf("packet %lld%s\n", (long long)utc, corrupted ? " corrupted" : "");
+    }
+
+    // Give the reader time to collect the final packet before the pty disappears
+    sleep_until(serial_time_ns(CLOCK_REALTIME) + 500000000LL);
+
+    if (pps_fd != -1)
+        close(pps_fd);
+    close(fd);
+    return 0;
+}
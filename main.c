@@ -10,9 +10,11 @@
 //
 //***************************************************************************
 
+#include <stddef.h>
 #include <avr/eeprom.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <avr/wdt.h>
 #include <util/atomic.h>
 
 #include "main.h"
@@ -20,6 +22,7 @@
 #include "display.h"
 #include "usb.h"
 #include "camera.h"
+#include "diagnostics.h"
 
 const char msg_duplicate_pulse[] PROGMEM = "WARNING: Missed serial data or duplicate time pulse";
 const char msg_missing_pulse[]   PROGMEM = "WARNING: Missed time pulse";
@@ -35,6 +38,10 @@ uint8_t timing_mode = MODE_PULSECOUNTER;
 
 uint16_t exposure_total = 0;
 uint8_t trigger_stride = 0;
+
+// Exposures per TRIGGER packet: trigger_stride, multiplied by a
+// power of two while the serial link is congested
+volatile uint8_t report_stride = 0;
 uint8_t align_boundary = 0;
 
 volatile uint16_t exposure_countdown = 0;
@@ -63,10 +70,463 @@ inline void set_gps_status(enum gps_status status)
 volatile uint16_t millisecond_count = 0;
 volatile int16_t millisecond_drift = 0;
 volatile struct timestamp download_timestamp;
+
+// Number of the exposure reported by download_timestamp, counting
+// camera triggers from 1 at the start of the sequence
+volatile uint32_t download_frame;
+volatile struct pps_phase pps_phase;
 volatile bool record_trigger = false;
 
+// Timer state latched by the time pulse interrupt for the main loop
+struct pulse_capture
+{
+    uint16_t ticks;
+    uint16_t count;
+    bool wrapped;
+    uint16_t countdown;
+    uint32_t exposures;
+};
+
+static volatile struct pulse_capture pulse_capture;
+static volatile bool pulse_captured = false;
+
+/*
+ * External start input (PC5, TDI on the JTAG header)
+ *
+ * Neither input capture pin is free on this board (ICP1 is the camera
+ * input and ICP3 drives the display), so the edge is taken as a pin
+ * change interrupt that reads Timer1 before anything else. The fixed
+ * delay between the edge and that read is removed from the reported time.
+ * START_EDGE_LATENCY is estimated from the instruction timings (pin
+ * synchronizer, interrupt response and ISR prologue) and should be
+ * calibrated against the trigger output with an oscilloscope
+ */
+#define START_EDGE_LATENCY 30
+static volatile enum external_start external_start = EXTERNAL_START_NONE;
+volatile struct pps_phase start_edge;
+
 struct timestamp current_timestamp;
 
+/*
+ * Shadow timing cross-check
+ *
+ * Each timing mode also runs the other one's method in the background.
+ * MODE_HIGHRES counts the pulses alongside its millisecond count, and
+ * MODE_PULSECOUNTER runs Timer1 (otherwise idle) as a free-running
+ * prescaled clock alongside its pulse count. At each pulse the interrupt
+ * samples both, and the main loop compares the time since the sequence
+ * started according to each. Crystal error makes them drift apart slowly,
+ * so only a sudden change in their difference is reported: that means
+ * one of them has miscounted (a missed or duplicate pulse, or a lost
+ * millisecond interrupt)
+ */
+#define INTEGRITY_THRESHOLD_MS 10
+
+struct integrity_sample
+{
+    uint32_t exposures;
+    uint16_t countdown;
+    uint32_t pulses;
+    uint32_t shadow_ticks;
+    bool restart;
+};
+
+static volatile struct integrity_sample integrity_sample;
+static volatile bool integrity_restart = false;
+static uint16_t integrity_last_timer;
+struct integrity_event integrity_event;
+
+/*
+ * Sequence state that survives a watchdog reset
+ *
+ * The exposure grid of a sequence is fixed by the time pulse that began
+ * the first exposure (epoch), the exposure length and the trigger stride,
+ * so after a reset the firmware can rejoin the same grid at any later
+ * pulse. This lives in .noinit so that the C runtime doesn't clear it, and
+ * is protected by a checksum because SRAM holds garbage after power-on.
+ * The exposure count is updated by the timing interrupts, so it is kept
+ * outside the checksum with an inverted copy instead.
+ */
+struct recovery_state
+{
+    bool active;
+    uint8_t mode;
+    uint16_t exposure_total;
+    uint8_t trigger_stride;
+    uint8_t align_boundary;
+    bool use_monitor;
+
+    // Seconds since 2000-01-01 of the pulse that began the first exposure
+    // Zero until the sequence has aligned
+    uint32_t epoch;
+    uint16_t checksum;
+};
+
+static struct recovery_state recovery_state __attribute__ ((section(".noinit")));
+
+// Camera triggers since the sequence started, which also numbers the
+// frames in TRIGGER packets. It continues across a resume, so frame
+// numbers stay on the original grid
+static volatile uint32_t recovery_exposures __attribute__ ((section(".noinit")));
+static volatile uint32_t recovery_exposures_check __attribute__ ((section(".noinit")));
+
+// MCUSR at reset, as passed on by the bootloader in GPIOR0
+static uint8_t reset_flags __attribute__ ((section(".noinit")));
+
+// Disable the watchdog before the C runtime initialization, as it stays
+// enabled after a watchdog reset
+void wdt_init(void) __attribute__((naked)) __attribute__((section(".init3")));
+void wdt_init(void)
+{
+    reset_flags = GPIOR0 | MCUSR;
+    MCUSR = 0;
+    wdt_disable();
+}
+
+volatile struct recovery_event recovery_event;
+
+// Grid position to apply at the next time pulse when resuming a sequence
+// Calculated in set_time so that the pulse interrupt has no work to do
+static volatile bool resume_pending = false;
+static volatile bool resume_ready = false;
+static volatile bool resume_trigger_now;
+static volatile uint16_t resume_exposure_countdown;
+static volatile uint8_t resume_trigger_countdown;
+
+static uint16_t recovery_checksum()
+{
+    // Fletcher-16 over everything but the checksum
+    uint8_t a = 0x5A, b = 0;
+    const uint8_t *data = (const uint8_t *)&recovery_state;
+    for (uint8_t i = 0; i < offsetof(struct recovery_state, checksum); i++)
+    {
+        a += data[i];
+        b += a;
+    }
+
+    return (b << 8) | a;
+}
+
+static void count_exposure()
+{
+    recovery_exposures++;
+    recovery_exposures_check = ~recovery_exposures;
+}
+
+// Seconds since 2000-01-01 (valid until 2100)
+static uint32_t timestamp_seconds(const struct timestamp *t)
+{
+    static const uint16_t month_start[] PROGMEM = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+    uint8_t years = t->year - 2000;
+    uint16_t days = years * 365U + (years + 3) / 4 + pgm_read_word(&month_start[t->month - 1]) + t->day - 1;
+    if (t->month > 2 && (years % 4) == 0)
+        days++;
+
+    return ((days * 24UL + t->hours) * 60 + t->minutes) * 60 + t->seconds;
+}
+
+// Called when a sequence is configured
+void recovery_start_sequence(bool use_monitor)
+{
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+    {
+        resume_pending = false;
+        recovery_state = (struct recovery_state){
+            .active = true,
+            .mode = timing_mode,
+            .exposure_total = exposure_total,
+            .trigger_stride = trigger_stride,
+            .align_boundary = align_boundary,
+            .use_monitor = use_monitor,
+            .epoch = 0
+        };
+        recovery_state.checksum = recovery_checksum();
+    }
+}
+
+// Called when a sequence is stopped, or must not be resumed
+void recovery_stop_sequence()
+{
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+    {
+        resume_pending = false;
+        recovery_state.active = false;
+        recovery_state.checksum = recovery_checksum();
+    }
+}
+
+/*
+ * Resume an interrupted sequence if the reset came from the watchdog,
+ * otherwise forget it: external resets come from the host reopening the
+ * port, and power-on leaves SRAM undefined
+ */
+static void recovery_initialize()
+{
+    bool valid = recovery_state.checksum == recovery_checksum() &&
+        recovery_state.active && recovery_state.epoch != 0 && recovery_state.exposure_total &&
+        recovery_state.mode != MODE_CAMERAMASTER &&
+        recovery_exposures_check == ~recovery_exposures;
+
+    if (!valid || !(reset_flags & _BV(WDRF)) || (reset_flags & (_BV(EXTRF) | _BV(PORF))) || timer_status == TIMER_RELAY)
+    {
+        recovery_stop_sequence();
+        return;
+    }
+
+    timing_mode = recovery_state.mode;
+    exposure_total = recovery_state.exposure_total;
+    trigger_stride = report_stride = recovery_state.trigger_stride;
+    align_boundary = recovery_state.align_boundary;
+
+    resume_pending = true;
+    camera_resume_exposing(recovery_state.use_monitor);
+    display_update_config();
+}
+
+/*
+ * Work out where the resume pulse (the one following t) falls on the
+ * sequence grid, and the countdowns that reproduce the original triggers
+ */
+static void plan_resume(const struct timestamp *t)
+{
+    uint32_t now = timestamp_seconds(t) + 1;
+    if (now <= recovery_state.epoch)
+    {
+        // The clock has gone backwards: the saved grid can't be trusted
+        recovery_stop_sequence();
+        camera_stop_exposing();
+        return;
+    }
+
+    uint32_t elapsed = now - recovery_state.epoch;
+    uint16_t total = exposure_total;
+    uint8_t stride = trigger_stride;
+    uint32_t exposure;
+
+    if (timing_mode == MODE_HIGHRES)
+    {
+        // Exposure j ends j * total ms after the epoch, and is triggered if
+        // j is a multiple of stride. Work within one trigger cycle to keep
+        // the arithmetic in 32 bits
+        uint32_t cycle = (uint32_t)total * stride;
+        uint32_t phase = elapsed % cycle;
+        for (uint8_t i = 0; i < 3; i++)
+            phase = phase * 10 % cycle;
+
+        resume_trigger_now = false;
+        resume_exposure_countdown = total - phase % total;
+        resume_trigger_countdown = stride - phase / total;
+
+        // Exposures completed: elapsed * 1000 / total, kept in 32 bits
+        exposure = (elapsed / total) * 1000 + (elapsed % total) * 1000 / total + 1;
+    }
+    else
+    {
+        // Exposure k (from 0) ends at the pulse k * total seconds after the
+        // epoch, and is triggered if k + 1 is a multiple of stride
+        uint16_t remainder = elapsed % total;
+        uint32_t next = elapsed / total + (remainder ? 1 : 0);
+
+        resume_trigger_now = remainder == 0;
+        resume_exposure_countdown = total - remainder;
+        resume_trigger_countdown = stride - next % stride;
+        exposure = next + 1;
+    }
+
+    recovery_event.time = *t;
+    recovery_event.exposure = exposure;
+    recovery_event.lost = exposure - 1 - recovery_exposures;
+    recovery_event.reset_flags = reset_flags;
+    resume_ready = true;
+}
+
+// Called with interrupts disabled, with the active path's exposure count
+// and countdown and the Timer1 count latched at the pulse
+static inline void sample_integrity(uint32_t exposures, uint16_t countdown, uint16_t timer)
+{
+    if (timing_mode == MODE_PULSECOUNTER)
+    {
+        integrity_sample.shadow_ticks += (uint16_t)(timer - integrity_last_timer);
+        integrity_last_timer = timer;
+    }
+    else
+        integrity_sample.pulses++;
+
+    integrity_sample.exposures = exposures;
+    integrity_sample.countdown = countdown;
+    integrity_sample.restart = integrity_restart;
+    integrity_restart = false;
+    message_flags |= FLAG_CHECK_INTEGRITY;
+}
+
+// Start the shadow clock for MODE_PULSECOUNTER: Timer1 at clk/1024, without
+// interrupts. Called from the pulse interrupt as the first exposure starts
+static inline void start_shadow_clock()
+{
+    TIMSK1 = 0;
+    TCNT1 = 0;
+    integrity_last_timer = 0;
+    TCCR1B = _BV(CS12) | _BV(CS10);
+}
+
+/*
+ * Build the phase, integrity and drift reports from the state latched by
+ * the last time pulse. Must run before set_time() replaces the time that
+ * the pulse belongs to
+ */
+static void process_pulse_capture()
+{
+    if (!pulse_captured)
+        return;
+
+    struct pulse_capture c;
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+    {
+        c = *(struct pulse_capture *)&pulse_capture;
+        pulse_captured = false;
+    }
+
+    if (timing_mode == MODE_PULSECOUNTER)
+    {
+        ATOMIC_BLOCK(ATOMIC_FORCEON)
+        {
+            sample_integrity(c.exposures, c.countdown, c.ticks);
+        }
+        return;
+    }
+
+    uint16_t count = c.count;
+    if (c.wrapped)
+    {
+        count++;
+
+        // Include the pending millisecond in the exposure count
+        if (--c.countdown == 0)
+        {
+            c.countdown = exposure_total;
+            c.exposures++;
+        }
+    }
+
+    pps_phase.time = current_timestamp;
+    pps_phase.time.milliseconds = count;
+    pps_phase.ticks = c.ticks;
+
+    uint16_t flags = FLAG_SEND_PPS_PHASE;
+
+    // Test for time drift
+    uint16_t drift = c.count % 1000;
+    if (drift != 0)
+    {
+        millisecond_drift = drift > 500 ? (drift - 1000) : drift;
+        flags |= FLAG_TIME_DRIFT;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+    {
+        if (timing_mode == MODE_HIGHRES)
+            sample_integrity(c.exposures, c.countdown, c.ticks);
+        message_flags |= flags;
+    }
+}
+
+/*
+ * Compare the latest sample from the active timing path and its shadow
+ */
+static void check_integrity()
+{
+    static bool have_baseline = false;
+    static int32_t last_difference;
+    static uint32_t shadow_ms, last_shadow_ticks;
+    static uint16_t shadow_remainder;
+
+    struct integrity_sample s;
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+    {
+        s = *(struct integrity_sample *)&integrity_sample;
+    }
+
+    if (s.restart)
+        have_baseline = false;
+
+    uint32_t active_ms;
+    if (timing_mode == MODE_HIGHRES)
+    {
+        active_ms = s.exposures * exposure_total + (exposure_total - s.countdown);
+        shadow_ms = s.pulses * 1000;
+    }
+    else if (timing_mode == MODE_PULSECOUNTER)
+    {
+        // The first exposure starts with the first trigger
+        active_ms = ((s.exposures - 1) * exposure_total + (exposure_total - s.countdown)) * 1000;
+
+        // Convert 1024-cycle ticks to ms, carrying the remainder
+        if (have_baseline)
+        {
+            uint32_t t = (s.shadow_ticks - last_shadow_ticks) * 1024 + shadow_remainder;
+            shadow_ms += t / (F_CPU / 1000);
+            shadow_remainder = t % (F_CPU / 1000);
+        }
+        else
+        {
+            shadow_ms = active_ms;
+            shadow_remainder = 0;
+        }
+
+        last_shadow_ticks = s.shadow_ticks;
+    }
+    else
+        return;
+
+    int32_t difference = (int32_t)(active_ms - shadow_ms);
+    int32_t jump = difference - last_difference;
+    if (have_baseline && (jump > INTEGRITY_THRESHOLD_MS || jump < -INTEGRITY_THRESHOLD_MS))
+    {
+        integrity_event.time = current_timestamp;
+        integrity_event.active_ms = active_ms;
+        integrity_event.shadow_ms = shadow_ms;
+        integrity_event.jump_ms = jump;
+        usb_send_integrity();
+    }
+
+    last_difference = difference;
+    have_baseline = true;
+}
+
+/*
+ * Select the edge that starts the next sequence, and disarm any sequence
+ * that is still waiting for one
+ */
+void external_start_configure(enum external_start edge)
+{
+    // May be called from the receive interrupt
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        PCICR &= ~_BV(PCIE2);
+        if (timer_status == TIMER_ARMED)
+        {
+            STOP_MILLISECOND_TIMER;
+            millisecond_count = 0;
+            TIFR1 = _BV(OCF1A) | _BV(OCF1B) | _BV(ICF1);
+            TIMSK1 = _BV(OCIE1A);
+        }
+
+        external_start = edge;
+        if (edge != EXTERNAL_START_NONE)
+        {
+            // The pin is shared with JTAG, which stays disabled until the
+            // next reset. JTD must be written twice within four cycles
+            uint8_t mcucr = MCUCR | _BV(JTD);
+            MCUCR = mcucr;
+            MCUCR = mcucr;
+
+            DDRC &= ~_BV(DDC5);
+            PORTC |= _BV(PC5);
+            PCMSK2 |= _BV(PCINT21);
+        }
+    }
+}
+
 int main(void)
 {
     // Enable pin change interrupt for pulse input
@@ -93,6 +553,12 @@ int main(void)
 		eeprom_update_byte(RELAY_EEPROM_OFFSET, RELAY_DISABLED);
 	}
 
+    recovery_initialize();
+
+    // Reset if the main loop stops running, so that a hang costs a few
+    // frames rather than the rest of the sequence
+    wdt_enable(WDTO_2S);
+
     // Enable interrupts
     sei();
     gps_initialize();
@@ -100,10 +566,13 @@ int main(void)
     // Main program loop
     for (;;)
     {
+        wdt_reset();
+        process_pulse_capture();
+
         // Handle message flags set via interrupt
         if (message_flags && timer_status != TIMER_RELAY)
         {
-            uint8_t temp_int_flags = 0;
+            uint16_t temp_int_flags = 0;
             ATOMIC_BLOCK(ATOMIC_FORCEON)
             {
                 temp_int_flags = message_flags;
@@ -113,14 +582,35 @@ int main(void)
             if (temp_int_flags & FLAG_SEND_TRIGGER)
                 usb_send_trigger();
 
+            if (temp_int_flags & FLAG_SEND_PPS_PHASE)
+                usb_send_pps_phase();
+
+            if (temp_int_flags & FLAG_SEND_START_EDGE)
+                usb_send_start_edge();
+
+            if (temp_int_flags & FLAG_CHECK_INTEGRITY)
+                check_integrity();
+
             if (temp_int_flags & FLAG_SEND_TIMESTAMP)
                 usb_send_timestamp();
 
+            if (temp_int_flags & FLAG_SEND_FORECAST)
+                usb_send_forecast();
+
+            if (temp_int_flags & FLAG_SEND_RECOVERY)
+                usb_send_recovery();
+
+            if (temp_int_flags & FLAG_SEND_FRAMES)
+                camera_send_frames();
+
             if (temp_int_flags & FLAG_SEND_STATUS)
                 usb_send_status(timer_status, gps_status);
 
             if (temp_int_flags & FLAG_STOP_EXPOSURE)
+            {
                 usb_stop_exposure();
+                usb_send_link_stats();
+            }
 
             if (temp_int_flags & FLAG_DUPLICATE_PULSE)
                 usb_send_message_P(msg_duplicate_pulse);
@@ -153,12 +643,14 @@ ISR(TIMER1_COMPA_vect)
     {
         camera_trigger_readout();
         exposure_countdown = exposure_total;
+        count_exposure();
 
         if (--trigger_countdown == 0)
         {
             download_timestamp = current_timestamp;
             download_timestamp.milliseconds = millisecond_count;
-            trigger_countdown = trigger_stride;
+            download_frame = recovery_exposures;
+            trigger_countdown = report_stride;
             message_flags |= FLAG_SEND_TRIGGER;
         }
     }
@@ -185,19 +677,27 @@ ISR(PCINT3_vect)
     {
         case TIMER_EXPOSING:
         case TIMER_READOUT:
-            if (timing_mode == MODE_HIGHRES)
+            if (timing_mode != MODE_PULSECOUNTER)
             {
-                // Test for time drift
-                // Doesn't need to be atomic, as interrupts are disabled in an interrupt context
-                uint16_t drift = millisecond_count;
-                while (drift >= 1000)
-                    drift -= 1000;
-
-                if (drift != 0)
-                {
-                    millisecond_drift = drift > 500 ? (drift - 1000) : drift;
-                    message_flags |= FLAG_TIME_DRIFT;
-                }
+                // Capture the timer phase so that the host can interpolate
+                // trigger times between pulses after the fact.
+                // A pending compare match means that the timer has wrapped
+                // but the millisecond interrupt hasn't run yet
+                // MODE_CAMERAMASTER counts through COMPB, leaving OCF1A always set
+                //
+                // Only the raw state is latched here, so that the millisecond
+                // interrupt (which often fires with the pulse) isn't held off.
+                // The main loop builds the packets from it
+                uint8_t pending = timing_mode == MODE_CAMERAMASTER ? OCF1B : OCF1A;
+                pulse_capture.ticks = TCNT1;
+                pulse_capture.count = millisecond_count;
+                pulse_capture.wrapped = bit_is_set(TIFR1, pending);
+                if (pulse_capture.wrapped)
+                    pulse_capture.ticks = TCNT1;
+
+                pulse_capture.countdown = exposure_countdown;
+                pulse_capture.exposures = recovery_exposures;
+                pulse_captured = true;
             }
             else
             {
@@ -209,16 +709,85 @@ ISR(PCINT3_vect)
                     camera_trigger_readout();
                     exposure_countdown = exposure_total;
                     record_trigger = true;
+                    count_exposure();
                 }
+
+                pulse_capture.ticks = TCNT1;
+                pulse_capture.countdown = exposure_countdown;
+                pulse_capture.exposures = recovery_exposures;
+                pulse_captured = true;
             }
             break;
         case TIMER_ALIGN:
+            if (external_start != EXTERNAL_START_NONE)
+            {
+                // Run the millisecond count from this pulse (through COMPB,
+                // so that no triggers are sent) until the start edge arrives.
+                // current_timestamp still holds the previous second until this
+                // pulse's time arrives, so count from 1000: set_time() then
+                // brings the count back within the new second
+                millisecond_count = 1000;
+                OCR1B = OCR1A;
+                TIFR1 = _BV(OCF1B);
+                TIMSK1 = _BV(OCIE1B);
+                TCNT1 = 355;
+                START_MILLISECOND_TIMER;
+
+                PCIFR = _BV(PCIF2);
+                PCICR |= _BV(PCIE2);
+                set_timer_status(TIMER_ARMED);
+                break;
+            }
+
+            if (resume_pending)
+            {
+                // Rejoin the grid of a sequence interrupted by a watchdog reset
+                // The countdowns were calculated when the last time arrived
+                if (!resume_ready)
+                    break;
+
+                trigger_countdown = resume_trigger_countdown;
+                integrity_restart = true;
+                if (timing_mode == MODE_HIGHRES)
+                {
+                    exposure_countdown = resume_exposure_countdown;
+                    TIFR1 = _BV(OCF1A) | _BV(OCF1B) | _BV(ICF1);
+                    TIMSK1 = _BV(OCIE1A);
+                    TCNT1 = 355;
+                    START_MILLISECOND_TIMER;
+                }
+                else
+                {
+                    start_shadow_clock();
+                    if (resume_trigger_now)
+                    {
+                        camera_trigger_readout();
+                        exposure_countdown = exposure_total;
+                        record_trigger = true;
+                    }
+                    else
+                        exposure_countdown = resume_exposure_countdown;
+                }
+
+                resume_pending = resume_ready = false;
+                recovery_exposures = recovery_event.exposure - 1;
+                if (resume_trigger_now)
+                    count_exposure();
+                else
+                    recovery_exposures_check = ~recovery_exposures;
+
+                set_timer_status(TIMER_EXPOSING);
+                message_flags |= FLAG_SEND_RECOVERY;
+                break;
+            }
+
             // Start the first exposure so that a (potentially future) exposure
             // boundary will occur on the minute
             if (current_timestamp.seconds % align_boundary != align_boundary - 1)
                 break;
 
             set_timer_status(TIMER_EXPOSING);
+            integrity_restart = true;
             if (timing_mode == MODE_HIGHRES)
             {
                 // Enable the millisecond timer to begin sending triggers
@@ -229,19 +798,44 @@ ISR(PCINT3_vect)
                 // Constants for configuring the millisecond timer
                 // MILLISECOND_TCNT is calibrated with an oscilloscope
                 // to minimize the offset between 1Hz signal and triggers
+                //
+                // The shadow clock of an earlier MODE_PULSECOUNTER sequence runs
+                // past OCR1A, leaving a stale compare match that would otherwise
+                // fire as soon as the interrupt is enabled
+                TIFR1 = _BV(OCF1A) | _BV(OCF1B) | _BV(ICF1);
+                TIMSK1 = _BV(OCIE1A);
                 TCNT1 = 355;
                 START_MILLISECOND_TIMER;
+                recovery_exposures = 0;
+            }
+            else if (timing_mode == MODE_CAMERAMASTER)
+            {
+                // Run the millisecond count exactly as in MODE_HIGHRES,
+                // and start timestamping the camera's frame output
+                TCNT1 = 355;
+                START_MILLISECOND_TIMER;
+                TIFR1 = _BV(ICF1) | _BV(OCF1B);
+                TIMSK1 = _BV(OCIE1B) | _BV(ICIE1);
+                break;
             }
             else
             {
                 camera_trigger_readout();
                 exposure_countdown = exposure_total;
                 record_trigger = true;
+                recovery_exposures = 1;
+                start_shadow_clock();
             }
+
+            // Save the grid so that it can be resumed after a reset
+            recovery_exposures_check = ~recovery_exposures;
+            recovery_state.epoch = timestamp_seconds(&current_timestamp) + 1;
+            recovery_state.checksum = recovery_checksum();
             break;
         case TIMER_RELAY:
             camera_trigger_readout();
             break;
+        case TIMER_ARMED:
         case TIMER_WAITING:
         case TIMER_IDLE:
             // Do nothing
@@ -254,13 +848,114 @@ ISR(PCINT3_vect)
     gps_last_data = GPS_PULSE;
 }
 
+/*
+ * External start input interrupt handler
+ * Fired on any level change from PC5 while armed, or from PC7 for diagnostics
+ */
+ISR(PCINT2_vect)
+{
+    uint16_t ticks = TCNT1;
+
+    // Raised by diagnostics_run() to measure the interrupt latency
+    if (latency_probe_pending)
+    {
+        latency_probe_ticks = ticks;
+        latency_probe_pending = false;
+        return;
+    }
+
+    // Ignore the opposite edge
+    bool rising = bit_is_set(PINC, PC5);
+    if (timer_status != TIMER_ARMED || rising != (external_start == EXTERNAL_START_RISING))
+        return;
+
+    // Latch the edge time as for pps_phase, then remove the interrupt latency
+    uint16_t count = millisecond_count;
+    if (bit_is_set(TIFR1, OCF1B) && ticks < 5000)
+        count++;
+
+    // The count never reads 0 here (see TIMER_ALIGN), so this can't wrap
+    if (ticks >= START_EDGE_LATENCY)
+        ticks -= START_EDGE_LATENCY;
+    else
+    {
+        ticks += 10000 - START_EDGE_LATENCY;
+        count--;
+    }
+
+    // Confirm that the input still holds the configured level, so
+    // that a glitch of the opposite polarity doesn't start the sequence
+    if (bit_is_set(PINC, PC5) ? !rising : rising)
+        return;
+
+    start_edge.time = current_timestamp;
+    start_edge.time.milliseconds = count;
+    start_edge.ticks = ticks;
+    message_flags |= FLAG_SEND_START_EDGE;
+
+    PCICR &= ~_BV(PCIE2);
+    external_start = EXTERNAL_START_NONE;
+
+    switch (timing_mode)
+    {
+        case MODE_HIGHRES:
+            // Hand the millisecond count over to the trigger interrupt
+            // The first exposure starts at the next millisecond boundary,
+            // so that trigger times stay on the millisecond grid
+            if (bit_is_set(TIFR1, OCF1B))
+                millisecond_count++;
+
+            TIFR1 = _BV(OCF1A) | _BV(OCF1B);
+            TIMSK1 = _BV(OCIE1A);
+            recovery_exposures = 0;
+            recovery_exposures_check = ~recovery_exposures;
+            integrity_restart = true;
+            set_timer_status(TIMER_EXPOSING);
+            break;
+        case MODE_CAMERAMASTER:
+            // Timestamp frames from the edge onwards
+            TIFR1 = _BV(ICF1);
+            TIMSK1 = _BV(OCIE1B) | _BV(ICIE1);
+            set_timer_status(TIMER_EXPOSING);
+            break;
+        default:
+            // Exposures are counted in whole seconds, so begin at the next pulse
+            STOP_MILLISECOND_TIMER;
+            millisecond_count = 0;
+            TIFR1 = _BV(OCF1A) | _BV(OCF1B) | _BV(ICF1);
+            TIMSK1 = _BV(OCIE1A);
+            align_boundary = 1;
+            set_timer_status(TIMER_ALIGN);
+            break;
+    }
+}
+
 void set_time(struct timestamp *t)
 {
+    process_pulse_capture();
+    resume_ready = false;
     ATOMIC_BLOCK(ATOMIC_FORCEON)
     {
         current_timestamp = *t;
+        message_flags |= FLAG_SEND_TIMESTAMP;
+    }
+
+    if (resume_pending)
+        plan_resume(t);
+
+    // Announce the upcoming triggers, or send the frames captured so far
+    if (timer_status == TIMER_EXPOSING || timer_status == TIMER_READOUT)
+    {
+        if (timing_mode == MODE_CAMERAMASTER)
+            camera_flush_frames();
+        else
+        {
+            ATOMIC_BLOCK(ATOMIC_FORCEON)
+            {
+                message_flags |= FLAG_SEND_FORECAST;
+            }
+        }
     }
-    message_flags |= FLAG_SEND_TIMESTAMP;
 
     if (gps_status != GPS_ACTIVE)
         set_gps_status(GPS_ACTIVE);
@@ -271,7 +966,8 @@ void set_time(struct timestamp *t)
         if (--trigger_countdown == 0)
         {
             download_timestamp = current_timestamp;
-            trigger_countdown = trigger_stride;
+            download_frame = recovery_exposures;
+            trigger_countdown = report_stride;
             message_flags |= FLAG_SEND_TRIGGER;
         }
     }
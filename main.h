@@ -23,6 +23,7 @@ enum timing_mode
 {
     MODE_PULSECOUNTER = 0,
     MODE_HIGHRES = 1,
+    MODE_CAMERAMASTER = 2,
 };
 
 extern uint8_t timing_mode;
@@ -46,10 +47,12 @@ extern uint8_t timing_mode;
 extern uint16_t exposure_total;
 extern volatile uint16_t exposure_countdown;
 extern uint8_t trigger_stride;
+extern volatile uint8_t report_stride;
 extern volatile uint8_t trigger_countdown;
 extern uint8_t align_boundary;
 extern volatile uint16_t millisecond_count;
 
+// Holds more than 8 flags, so is 16 bits wide even with -fshort-enums
 enum message_flags
 {
     FLAG_SEND_STATUS       = _BV(0),
@@ -59,6 +62,12 @@ enum message_flags
     FLAG_TIME_DRIFT        = _BV(4),
     FLAG_DUPLICATE_PULSE   = _BV(5),
     FLAG_MISSING_PULSE     = _BV(6),
+    FLAG_SEND_PPS_PHASE    = _BV(7),
+    FLAG_SEND_FORECAST     = _BV(8),
+    FLAG_SEND_RECOVERY     = _BV(9),
+    FLAG_SEND_FRAMES       = _BV(10),
+    FLAG_SEND_START_EDGE   = _BV(11),
+    FLAG_CHECK_INTEGRITY   = _BV(12),
 };
 
 extern volatile enum message_flags message_flags;
@@ -84,8 +93,65 @@ struct timestamp
 };
 
 extern volatile struct timestamp download_timestamp;
+extern volatile uint32_t download_frame;
 extern struct timestamp current_timestamp;
 
+// Millisecond timer phase captured at a time pulse in MODE_HIGHRES
+// time holds the time that a trigger at the pulse would have reported,
+// and ticks the 0.1us timer count within that millisecond
+struct pps_phase
+{
+    struct timestamp time;
+    uint16_t ticks;
+};
+
+extern volatile struct pps_phase pps_phase;
+
+// Input edge that starts an armed sequence, or EXTERNAL_START_NONE to
+// start at the first aligned time pulse
+enum external_start
+{
+    EXTERNAL_START_NONE = 0,
+    EXTERNAL_START_RISING = 1,
+    EXTERNAL_START_FALLING = 2
+};
+
+// Time of the edge that started an armed sequence, in the same form as pps_phase
+extern volatile struct pps_phase start_edge;
+
+void external_start_configure(enum external_start edge);
+
+// Sent when a sequence resumes after a watchdog reset
+// time is the last GPS time before the resume pulse, exposure the number
+// (counting from 1) of the next exposure to end, and lost the number of
+// exposures that ended without a trigger pulse during the outage
+struct recovery_event
+{
+    struct timestamp time;
+    uint32_t exposure;
+    uint32_t lost;
+    uint8_t reset_flags;
+};
+
+extern volatile struct recovery_event recovery_event;
+
+// Sent when the shadow timing check finds that the active timing path and
+// its shadow have suddenly disagreed. active_ms and shadow_ms are the time
+// since the sequence started (or resumed) according to each, and jump_ms
+// is the change in their difference since the previous pulse
+struct integrity_event
+{
+    struct timestamp time;
+    uint32_t active_ms;
+    uint32_t shadow_ms;
+    int32_t jump_ms;
+};
+
+extern struct integrity_event integrity_event;
+
+void recovery_start_sequence(bool use_monitor);
+void recovery_stop_sequence();
+
 enum timer_status
 {
     TIMER_IDLE,
@@ -93,7 +159,8 @@ enum timer_status
     TIMER_ALIGN,
     TIMER_EXPOSING,
     TIMER_READOUT,
-    TIMER_RELAY
+    TIMER_RELAY,
+    TIMER_ARMED
 };
 
 extern volatile enum timer_status timer_status;
@@ -0,0 +1,230 @@
+//***************************************************************************
+//
+//  File        : matchbench.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Runs the frame matcher against simulated trigger and frame
+//                streams with injected losses
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "framematch.h"
+#include "serial.h"
+
+/*
+ * Exposure i ends at i * period. The camera delivers frame i (numbered from
+ * first_id) after the readout latency plus host jitter, and the timer sends
+ * a TRIGGER packet for every stride'th exposure, which reaches the host
+ * after a serial delay. Either may be lost. The two streams are fed to the
+ * matcher in host arrival order, with periodic timeout updates, and the
+ * reported errors are compared with the losses that were injected.
+ */
+struct arrival
+{
+    int64_t host_ns;
+    int64_t time_ns;
+    uint64_t id;
+};
+
+struct injected
+{
+    uint64_t lost_frames;
+    uint64_t lost_triggers;
+    uint64_t lost_both;
+};
+
+static uint64_t rng_state = 1;
+static uint64_t random_next()
+{
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static double random_uniform()
+{
+    return (random_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static bool verbose = false;
+static int64_t period;
+static uint64_t first_id = 1000;
+static uint64_t mispaired = 0;
+
+static void print_event(const struct framematch_event *e, void *param)
+{
+    (void)param;
+
+    // Check the pairing against the simulation's ground truth
+    if (e->type == FRAMEMATCH_MATCHED)
+    {
+        if (e->frame_id - first_id != (uint64_t)(e->trigger_ns / period))
+            mispaired++;
+        return;
+    }
+
+    if (!verbose)
+        return;
+
+    const char *names[] = {"matched", "missing_frame", "missing_trigger", "sequence_error", "overflow"};
+    printf("%s trigger=%llu frame=%llu expected=%llu\n", names[e->type],
+           (unsigned long long)e->trigger_index, (unsigned long long)e->frame_id,
+           (unsigned long long)e->expected_frame_id);
+}
+
+static void print_usage()
+{
+    printf("Usage: matchbench [options]\n");
+    printf("  -n <frames>  number of exposures (default 10000000)\n");
+    printf("  -r <hz>      frame rate (default 5000)\n");
+    printf("  -s <stride>  frames per TRIGGER packet (default 1)\n");
+    printf("  -l <us>      readout latency (default 3000)\n");
+    printf("  -j <us>      frame arrival jitter (default 1000)\n");
+    printf("  -f <prob>    probability that a frame is lost (default 0.001)\n");
+    printf("  -t <prob>    probability that a TRIGGER packet is lost (default 0.001)\n");
+    printf("  -u           don't tell the matcher the first frame number\n");
+    printf("  -v           print each reported error\n");
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t frames = 10000000;
+    double rate = 5000;
+    uint32_t stride = 1;
+    double latency_us = 3000, jitter_us = 1000;
+    double frame_loss = 0.001, trigger_loss = 0.001;
+    bool anchored = true;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:s:l:j:f:t:uv")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': frames = strtoull(optarg, NULL, 0); break;
+            case 'r': rate = atof(optarg); break;
+            case 's': stride = (uint32_t)atoi(optarg); break;
+            case 'l': latency_us = atof(optarg); break;
+            case 'j': jitter_us = atof(optarg); break;
+            case 'f': frame_loss = atof(optarg); break;
+            case 't': trigger_loss = atof(optarg); break;
+            case 'u': anchored = false; break;
+            case 'v': verbose = true; break;
+            default: print_usage(); return 1;
+        }
+    }
+
+    if (stride < 1 || rate <= 0 || !frames)
+    {
+        print_usage();
+        return 1;
+    }
+
+    period = (int64_t)(1e9 / rate);
+    int64_t latency = (int64_t)(latency_us * 1000);
+    int64_t jitter = (int64_t)(jitter_us * 1000);
+    int64_t serial_delay = 20000000;
+
+    struct arrival *frame_stream = malloc(frames * sizeof(struct arrival));
+    struct arrival *trigger_stream = malloc((frames / stride + 1) * sizeof(struct arrival));
+    if (!frame_stream || !trigger_stream)
+    {
+        fprintf(stderr, "Failed to allocate %llu frames\n", (unsigned long long)frames);
+        return 1;
+    }
+
+    // The first triggered exposure is never lost, so that the matcher can lock
+    struct injected injected = {0};
+    size_t frame_count = 0, trigger_count = 0;
+    int64_t last_arrival = 0;
+    for (uint64_t i = 0; i < frames; i++)
+    {
+        int64_t t = (int64_t)i * period;
+        bool triggered = i % stride == 0;
+        bool lose_frame = i > 0 && random_uniform() < frame_loss;
+        bool lose_trigger = i > 0 && triggered && random_uniform() < trigger_loss;
+
+        if (!lose_frame)
+        {
+            // Frames are delivered in order
+            int64_t arrival = t + latency + (int64_t)(jitter * random_uniform());
+            if (arrival <= last_arrival)
+                arrival = last_arrival + 1;
+            last_arrival = arrival;
+            frame_stream[frame_count++] = (struct arrival){.host_ns = arrival, .id = first_id + i};
+        }
+
+        if (triggered && !lose_trigger)
+            trigger_stream[trigger_count++] = (struct arrival){.host_ns = t + serial_delay, .time_ns = t};
+
+        if (triggered && lose_frame && lose_trigger)
+            injected.lost_both++;
+        else if (triggered && lose_frame)
+            injected.lost_frames++;
+        else if (lose_trigger)
+            injected.lost_triggers++;
+    }
+
+    static struct framematch m;
+    struct framematch_config config = {
+        .period_ns = period,
+        .stride = stride,
+        .latency_ns = latency + jitter / 2,
+        .trigger_delay_ns = serial_delay + 5000000,
+        .first_frame_id = anchored ? (int64_t)first_id : -1,
+        .tolerance_ns = jitter / 2 + period / 4
+    };
+    framematch_init(&m, &config, print_event, NULL);
+
+    size_t fi = 0, ti = 0;
+    int64_t next_update = 0;
+    int64_t start = serial_time_ns(CLOCK_MONOTONIC);
+    while (fi < frame_count || ti < trigger_count)
+    {
+        bool frame = ti == trigger_count || (fi < frame_count && frame_stream[fi].host_ns < trigger_stream[ti].host_ns);
+        int64_t host = frame ? frame_stream[fi].host_ns : trigger_stream[ti].host_ns;
+
+        // Poll once per host millisecond, as an acquisition loop would
+        if (host >= next_update)
+        {
+            framematch_update(&m, host);
+            next_update = host + 1000000;
+        }
+
+        if (frame)
+        {
+            framematch_add_frame(&m, frame_stream[fi].id, frame_stream[fi].host_ns);
+            fi++;
+        }
+        else
+        {
+            framematch_add_trigger(&m, trigger_stream[ti].time_ns);
+            ti++;
+        }
+    }
+    framematch_update(&m, last_arrival + serial_delay + 1000000000LL);
+    double elapsed = (double)(serial_time_ns(CLOCK_MONOTONIC) - start);
+
+    printf("{\"frames\": %llu, \"rate_hz\": %.0f, \"stride\": %u, \"ns_per_event\": %.1f, "
+           "\"injected\": {\"lost_frames\": %llu, \"lost_triggers\": %llu, \"lost_both\": %llu}, "
+           "\"reported\": {\"matched\": %llu, \"missing_frame\": %llu, \"missing_trigger\": %llu, "
+           "\"sequence_error\": %llu, \"overflow\": %llu}, \"mispaired\": %llu}\n",
+           (unsigned long long)frames, rate, stride, elapsed / (frame_count + trigger_count),
+           (unsigned long long)injected.lost_frames, (unsigned long long)injected.lost_triggers,
+           (unsigned long long)injected.lost_both,
+           (unsigned long long)m.counts[FRAMEMATCH_MATCHED], (unsigned long long)m.counts[FRAMEMATCH_MISSING_FRAME],
+           (unsigned long long)m.counts[FRAMEMATCH_MISSING_TRIGGER], (unsigned long long)m.counts[FRAMEMATCH_SEQUENCE_ERROR],
+           (unsigned long long)m.counts[FRAMEMATCH_OVERFLOW], (unsigned long long)mispaired);
+
+    free(frame_stream);
+    free(trigger_stream);
+    return 0;
+}
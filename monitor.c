@@ -0,0 +1,723 @@
+//***************************************************************************
+//
+//  File        : monitor.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Live summary of timing health from a timer's stream
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "protocol.h"
+#include "record.h"
+#include "serial.h"
+
+/*
+ * Statistics are taken over a sliding window of the stream clock:
+ *  - live sources use the host's monotonic clock
+ *  - devreplay recordings use the recorded arrival times
+ *  - raw captures have no arrival times, so use the latest embedded time
+ *
+ * Arrival latency is the host time that a TRIGGER or TIMESTAMP packet was
+ * read, less the time that it reports. Live sources compare against the
+ * host's UTC clock; recordings only hold relative arrival times, so their
+ * latencies are shown relative to the smallest seen. Raw captures have none.
+ */
+enum source_kind {SOURCE_SERIAL, SOURCE_SOCKET, SOURCE_RECORDING, SOURCE_CAPTURE};
+
+enum warning_kind {WARNING_DRIFT, WARNING_PULSE, WARNING_OTHER, WARNING_KINDS};
+
+// Samples kept per series; the oldest are dropped first if a window holds more
+#define SERIES_LENGTH 32768
+
+struct sample
+{
+    int64_t at;
+    int64_t value;
+    int64_t frame;
+};
+
+// Ring buffer of samples, oldest first
+struct series
+{
+    struct sample samples[SERIES_LENGTH];
+    size_t start;
+    size_t count;
+};
+
+struct monitor
+{
+    const char *name;
+    enum source_kind kind;
+    int fd;
+    FILE *file;
+    struct record_chunk *chunk;
+    bool chunk_ready;
+    bool finished;
+
+    struct protocol_decoder decoder;
+    int64_t window_ns;
+    unsigned link_capacity;
+
+    // Stream clock, and the arrival time used for latencies
+    int64_t now;
+    int64_t start;
+    bool started;
+    int64_t arrival;
+
+    // Smallest latency seen, subtracted if arrival times are relative
+    int64_t latency_base;
+    bool have_latency;
+
+    struct series triggers;
+    struct series trigger_latency;
+    struct series timestamp_latency;
+    struct series bytes;
+    struct series warnings;
+
+    uint64_t trigger_count;
+    uint64_t timestamp_count;
+    uint64_t warning_count[WARNING_KINDS];
+    uint64_t integrity_count;
+
+    struct protocol_timestamp last_time;
+    bool have_time;
+
+    struct protocol_link_stats link_stats;
+    bool have_link_stats;
+};
+
+// Window statistics; NAN where there is not enough data
+struct summary
+{
+    double span_s;
+    uint32_t triggers;
+    double trigger_rate;
+    double exposure_rate;
+    double interval_ms;
+    double jitter_rms_us;
+    double jitter_max_us;
+    double trigger_latency_ms;
+    double trigger_latency_max_ms;
+    double timestamp_latency_ms;
+    double timestamp_latency_max_ms;
+    double warnings_per_minute[WARNING_KINDS];
+    double link_bytes_per_second;
+    double link_utilisation;
+};
+
+static volatile bool running = true;
+
+static void handle_signal(int sig)
+{
+    (void)sig;
+    running = false;
+}
+
+static void series_push(struct series *s, int64_t at, int64_t value, int64_t frame)
+{
+    if (s->count == SERIES_LENGTH)
+    {
+        s->start = (s->start + 1) % SERIES_LENGTH;
+        s->count--;
+    }
+
+    s->samples[(s->start + s->count) % SERIES_LENGTH] = (struct sample){.at = at, .value = value, .frame = frame};
+    s->count++;
+}
+
+static const struct sample *series_get(const struct series *s, size_t i)
+{
+    return &s->samples[(s->start + i) % SERIES_LENGTH];
+}
+
+// Drop samples taken before the given time
+static void series_prune(struct series *s, int64_t before)
+{
+    while (s->count && s->samples[s->start].at < before)
+    {
+        s->start = (s->start + 1) % SERIES_LENGTH;
+        s->count--;
+    }
+}
+
+static void add_latency(struct monitor *m, struct series *s, const struct protocol_timestamp *t)
+{
+    if (m->kind == SOURCE_CAPTURE)
+        return;
+
+    int64_t latency = m->arrival - protocol_timestamp_utc_ns(t);
+    if (!m->have_latency || latency < m->latency_base)
+        m->latency_base = latency;
+    m->have_latency = true;
+
+    series_push(s, m->now, latency, 0);
+}
+
+// Raw captures are timed by the stream itself
+static void advance_capture_clock(struct monitor *m, const struct protocol_timestamp *t)
+{
+    int64_t time = protocol_timestamp_utc_ns(t);
+    if (m->kind != SOURCE_CAPTURE || (m->started && time <= m->now))
+        return;
+
+    m->now = time;
+    if (!m->started)
+    {
+        m->start = time;
+        m->started = true;
+    }
+}
+
+static enum warning_kind classify_warning(const char *text, uint8_t length)
+{
+    // See the WARNING messages in main.c
+    const char *drift = "time drift";
+    const char *pulse = "time pulse";
+    size_t n;
+
+    n = strlen(drift);
+    for (uint8_t i = 0; i + n <= length; i++)
+        if (!memcmp(&text[i], drift, n))
+            return WARNING_DRIFT;
+
+    n = strlen(pulse);
+    for (uint8_t i = 0; i + n <= length; i++)
+        if (!memcmp(&text[i], pulse, n))
+            return WARNING_PULSE;
+
+    return WARNING_OTHER;
+}
+
+static void add_packet(struct monitor *m, const struct protocol_packet *p)
+{
+    struct protocol_timestamp t;
+    int64_t frame;
+
+    switch (p->type)
+    {
+        case PACKET_TRIGGER:
+            if (!protocol_parse_trigger(p->data, p->length, &t, &frame))
+                break;
+
+            advance_capture_clock(m, &t);
+
+            // Older firmware doesn't number the frames
+            if (frame < 0)
+                frame = m->trigger_count;
+
+            series_push(&m->triggers, m->now, protocol_timestamp_utc_ns(&t), frame);
+            add_latency(m, &m->trigger_latency, &t);
+            m->trigger_count++;
+            break;
+        case PACKET_TIMESTAMP:
+            if (!protocol_parse_timestamp(p->data, p->length, &t))
+                break;
+
+            advance_capture_clock(m, &t);
+            add_latency(m, &m->timestamp_latency, &t);
+            m->last_time = t;
+            m->have_time = true;
+            m->timestamp_count++;
+            break;
+        case PACKET_MESSAGE:
+            // The first data byte is the string length
+            if (p->length > 8 && !memcmp(&p->data[1], "WARNING", 7))
+            {
+                uint8_t length = p->data[0] < p->length - 1 ? p->data[0] : p->length - 1;
+                enum warning_kind kind = classify_warning((const char *)&p->data[1], length);
+                series_push(&m->warnings, m->now, kind, 0);
+                m->warning_count[kind]++;
+            }
+            break;
+        case PACKET_LINK_STATS:
+            m->have_link_stats = protocol_parse_link_stats(p->data, p->length, &m->link_stats);
+            break;
+        case PACKET_INTEGRITY:
+            m->integrity_count++;
+            break;
+    }
+
+    // Framing adds $$, type, length, checksum and \r\n
+    series_push(&m->bytes, m->now, p->length + 7, 0);
+}
+
+static void decode(struct monitor *m, const uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+        if (protocol_decode_byte(&m->decoder, data[i]))
+            add_packet(m, &m->decoder.packet);
+}
+
+static void latency_stats(const struct monitor *m, const struct series *s, double *mean_ms, double *max_ms)
+{
+    *mean_ms = *max_ms = NAN;
+    if (!s->count)
+        return;
+
+    // Relative arrival times are measured from the fastest packet
+    int64_t base = m->kind == SOURCE_RECORDING ? m->latency_base : 0;
+    double sum = 0;
+    int64_t max = INT64_MIN;
+    for (size_t i = 0; i < s->count; i++)
+    {
+        int64_t latency = series_get(s, i)->value - base;
+        sum += latency;
+        if (latency > max)
+            max = latency;
+    }
+
+    *mean_ms = sum / s->count / 1e6;
+    *max_ms = max / 1e6;
+}
+
+static void summarise(struct monitor *m, struct summary *s)
+{
+    int64_t cutoff = m->now - m->window_ns;
+    series_prune(&m->triggers, cutoff);
+    series_prune(&m->trigger_latency, cutoff);
+    series_prune(&m->timestamp_latency, cutoff);
+    series_prune(&m->bytes, cutoff);
+    series_prune(&m->warnings, cutoff);
+
+    *s = (struct summary){
+        .trigger_rate = NAN, .exposure_rate = NAN,
+        .interval_ms = NAN, .jitter_rms_us = NAN, .jitter_max_us = NAN,
+        .link_bytes_per_second = NAN, .link_utilisation = NAN
+    };
+
+    // Rates are taken over the part of the window that has been seen
+    int64_t span = m->started ? m->now - m->start : 0;
+    if (span > m->window_ns)
+        span = m->window_ns;
+    s->span_s = span / 1e9;
+
+    // Triggers: the rate of reports, and of exposures (which differ if reports are thinned)
+    const struct series *t = &m->triggers;
+    s->triggers = t->count;
+    if (t->count >= 2)
+    {
+        const struct sample *first = series_get(t, 0);
+        const struct sample *last = series_get(t, t->count - 1);
+        double seconds = (last->value - first->value) / 1e9;
+        if (seconds > 0)
+        {
+            s->trigger_rate = (t->count - 1) / seconds;
+            s->exposure_rate = (last->frame - first->frame) / seconds;
+        }
+
+        // Interval per exposure, so that thinned or lost reports don't count as jitter
+        double sum = 0, sum_squares = 0, max = 0;
+        uint32_t n = 0;
+        for (size_t i = 1; i < t->count; i++)
+        {
+            const struct sample *a = series_get(t, i - 1);
+            const struct sample *b = series_get(t, i);
+            if (b->frame > a->frame)
+            {
+                sum += (double)(b->value - a->value) / (b->frame - a->frame);
+                n++;
+            }
+        }
+
+        if (n)
+        {
+            double mean = sum / n;
+            for (size_t i = 1; i < t->count; i++)
+            {
+                const struct sample *a = series_get(t, i - 1);
+                const struct sample *b = series_get(t, i);
+                if (b->frame > a->frame)
+                {
+                    double deviation = (double)(b->value - a->value) / (b->frame - a->frame) - mean;
+                    sum_squares += deviation * deviation;
+                    max = fmax(max, fabs(deviation));
+                }
+            }
+
+            s->interval_ms = mean / 1e6;
+            s->jitter_rms_us = sqrt(sum_squares / n) / 1e3;
+            s->jitter_max_us = max / 1e3;
+        }
+    }
+
+    latency_stats(m, &m->trigger_latency, &s->trigger_latency_ms, &s->trigger_latency_max_ms);
+    latency_stats(m, &m->timestamp_latency, &s->timestamp_latency_ms, &s->timestamp_latency_max_ms);
+
+    // Counts are scaled to a full minute (or second) from at least one second of data
+    double seconds = fmax(s->span_s, 1);
+    uint32_t warnings[WARNING_KINDS] = {0};
+    for (size_t i = 0; i < m->warnings.count; i++)
+        warnings[series_get(&m->warnings, i)->value]++;
+    for (uint8_t i = 0; i < WARNING_KINDS; i++)
+        s->warnings_per_minute[i] = warnings[i] * 60 / seconds;
+
+    if (m->started)
+    {
+        uint64_t bytes = 0;
+        for (size_t i = 0; i < m->bytes.count; i++)
+            bytes += series_get(&m->bytes, i)->value;
+
+        s->link_bytes_per_second = bytes / seconds;
+        s->link_utilisation = s->link_bytes_per_second / m->link_capacity;
+    }
+}
+
+// Print a value, or - if it is unavailable
+static const char *format(char *buf, size_t length, const char *fmt, double value)
+{
+    if (isnan(value))
+        snprintf(buf, length, "-");
+    else
+        snprintf(buf, length, fmt, value);
+    return buf;
+}
+
+static void json_field(const char *key, double value, const char *fmt)
+{
+    printf(", \"%s\": ", key);
+    if (isnan(value))
+        printf("null");
+    else
+        printf(fmt, value);
+}
+
+static void print_json(const struct monitor *m, const struct summary *s)
+{
+    printf("{\"source\": \"%s\", \"window_s\": %.1f, \"triggers\": %llu, \"timestamps\": %llu",
+           m->name, s->span_s, (unsigned long long)m->trigger_count, (unsigned long long)m->timestamp_count);
+    json_field("trigger_rate", s->trigger_rate, "%.3f");
+    json_field("exposure_rate", s->exposure_rate, "%.3f");
+    json_field("interval_ms", s->interval_ms, "%.6f");
+    json_field("jitter_rms_us", s->jitter_rms_us, "%.3f");
+    json_field("jitter_max_us", s->jitter_max_us, "%.3f");
+    json_field("trigger_latency_ms", s->trigger_latency_ms, "%.3f");
+    json_field("trigger_latency_max_ms", s->trigger_latency_max_ms, "%.3f");
+    json_field("timestamp_latency_ms", s->timestamp_latency_ms, "%.3f");
+    json_field("timestamp_latency_max_ms", s->timestamp_latency_max_ms, "%.3f");
+    printf(", \"latency_relative\": %s", m->kind == SOURCE_RECORDING ? "true" : "false");
+    json_field("drift_warnings_per_minute", s->warnings_per_minute[WARNING_DRIFT], "%.2f");
+    json_field("pulse_warnings_per_minute", s->warnings_per_minute[WARNING_PULSE], "%.2f");
+    json_field("other_warnings_per_minute", s->warnings_per_minute[WARNING_OTHER], "%.2f");
+    json_field("link_bytes_per_second", s->link_bytes_per_second, "%.1f");
+    json_field("link_utilisation", s->link_utilisation, "%.4f");
+    printf(", \"integrity_events\": %llu, \"decoder_errors\": %u}\n",
+           (unsigned long long)m->integrity_count, m->decoder.errors);
+}
+
+static void print_screen(const struct monitor *m, const struct summary *s)
+{
+    char a[32], b[32], c[32], d[32];
+
+    // Home the cursor and clear, so the summary redraws in place
+    printf("\033[H\033[2J");
+    printf("Karaka monitor: %s (%.0fs window)\n\n", m->name, s->span_s);
+
+    if (m->have_time)
+        printf("Time          %04u-%02u-%02u %02u:%02u:%02u UTC\n", m->last_time.year, m->last_time.month,
+               m->last_time.day, m->last_time.hours, m->last_time.minutes, m->last_time.seconds);
+    else
+        printf("Time          -\n");
+
+    printf("Triggers      %llu total   %s reports/s   %s exposures/s\n", (unsigned long long)m->trigger_count,
+           format(a, sizeof(a), "%.3f", s->trigger_rate), format(b, sizeof(b), "%.3f", s->exposure_rate));
+    printf("Interval      %s ms   jitter %s us rms, %s us max\n",
+           format(a, sizeof(a), "%.3f", s->interval_ms), format(b, sizeof(b), "%.2f", s->jitter_rms_us),
+           format(c, sizeof(c), "%.2f", s->jitter_max_us));
+    printf("Latency       trigger %s ms (max %s)   timestamp %s ms (max %s)%s\n",
+           format(a, sizeof(a), "%.1f", s->trigger_latency_ms), format(b, sizeof(b), "%.1f", s->trigger_latency_max_ms),
+           format(c, sizeof(c), "%.1f", s->timestamp_latency_ms), format(d, sizeof(d), "%.1f", s->timestamp_latency_max_ms),
+           m->kind == SOURCE_RECORDING ? "   relative" : "");
+    printf("Warnings/min  drift %.1f   pulse %.1f   other %.1f   (%llu total)\n",
+           s->warnings_per_minute[WARNING_DRIFT], s->warnings_per_minute[WARNING_PULSE],
+           s->warnings_per_minute[WARNING_OTHER], (unsigned long long)(m->warning_count[WARNING_DRIFT] +
+           m->warning_count[WARNING_PULSE] + m->warning_count[WARNING_OTHER]));
+    printf("Link          %s B/s   %s%% of %u B/s\n", format(a, sizeof(a), "%.0f", s->link_bytes_per_second),
+           format(b, sizeof(b), "%.1f", s->link_utilisation * 100), m->link_capacity);
+
+    if (m->have_link_stats)
+        printf("Device link   projected %u B/s   buffer high water %u   stalls %u\n",
+               m->link_stats.projected_bytes_per_second, m->link_stats.high_water, m->link_stats.stalls);
+
+    printf("Errors        %llu integrity   %u undecodable packets\n",
+           (unsigned long long)m->integrity_count, m->decoder.errors);
+    fflush(stdout);
+}
+
+static int connect_socket(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        fprintf(stderr, "Failed to connect to %s: %s\n", path, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * The path may be a serial port, a fanout server socket,
+ * a devreplay recording or a raw capture of the stream
+ */
+static bool open_source(struct monitor *m, const char *path, unsigned baud)
+{
+    m->name = path;
+    m->fd = -1;
+
+    struct stat st;
+    if (stat(path, &st))
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    if (S_ISCHR(st.st_mode))
+    {
+        m->kind = SOURCE_SERIAL;
+        m->fd = serial_open(path, baud);
+        return m->fd != -1;
+    }
+
+    if (S_ISSOCK(st.st_mode))
+    {
+        m->kind = SOURCE_SOCKET;
+        m->fd = connect_socket(path);
+        return m->fd != -1;
+    }
+
+    m->file = fopen(path, "rb");
+    if (!m->file)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    char magic[8];
+    if (fread(magic, 1, 8, m->file) == 8 && !memcmp(magic, RECORD_MAGIC, 8))
+    {
+        m->kind = SOURCE_RECORDING;
+        m->chunk = malloc(sizeof(struct record_chunk));
+    }
+    else
+    {
+        m->kind = SOURCE_CAPTURE;
+        rewind(m->file);
+    }
+
+    return true;
+}
+
+// Load the next device chunk from a recording, marking the source finished at the end
+static void next_chunk(struct monitor *m)
+{
+    while ((m->chunk_ready = record_read(m->file, m->chunk)))
+        if (m->chunk->direction == RECORD_FROM_DEVICE)
+            return;
+
+    m->finished = true;
+}
+
+static void print_usage()
+{
+    printf("Usage: monitor [options] <source>\n");
+    printf("  -w <s>        statistics window (default 60)\n");
+    printf("  -i <ms>       refresh interval (default 1000)\n");
+    printf("  -b <baud>     serial line rate (default 9600)\n");
+    printf("  -x <speed>    replay speed for recordings (default 1)\n");
+    printf("  -f            read a recording as fast as possible and print the final summary\n");
+    printf("The source may be a serial port, a fanout socket, a devreplay recording or a raw\n");
+    printf("capture (always read as fast as possible). The summary is redrawn in place on a\n");
+    printf("terminal, and otherwise written as one JSON line per refresh.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    double window = 60;
+    int interval_ms = 1000;
+    unsigned baud = SERIAL_DEFAULT_BAUD;
+    double speed = 1;
+    bool fast = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "w:i:b:x:f")) != -1)
+    {
+        switch (opt)
+        {
+            case 'w': window = atof(optarg); break;
+            case 'i': interval_ms = atoi(optarg); break;
+            case 'b': baud = atoi(optarg); break;
+            case 'x': speed = atof(optarg); break;
+            case 'f': fast = true; break;
+            default: print_usage(); return 1;
+        }
+    }
+
+    if (optind != argc - 1 || window <= 0 || interval_ms <= 0 || !baud || speed <= 0)
+    {
+        print_usage();
+        return 1;
+    }
+
+    struct monitor *m = calloc(1, sizeof(struct monitor));
+    protocol_decoder_init(&m->decoder);
+    m->window_ns = (int64_t)(window * 1e9);
+
+    // 8N1 framing: ten bits per byte
+    m->link_capacity = baud / 10;
+
+    if (!open_source(m, argv[optind], baud))
+        return 1;
+
+    if (m->kind == SOURCE_CAPTURE)
+        fast = true;
+    else if (fast && m->kind != SOURCE_RECORDING)
+    {
+        fprintf(stderr, "-f requires a recording\n");
+        return 1;
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    bool terminal = isatty(STDOUT_FILENO) && !fast;
+    struct summary s;
+
+    if (fast)
+    {
+        if (m->kind == SOURCE_CAPTURE)
+        {
+            uint8_t buf[4096];
+            size_t length;
+            while (running && (length = fread(buf, 1, sizeof(buf), m->file)) > 0)
+                decode(m, buf, length);
+        }
+        else
+        {
+            for (next_chunk(m); running && !m->finished; next_chunk(m))
+            {
+                m->now = m->arrival = m->chunk->time_ns;
+                if (!m->started)
+                {
+                    m->start = m->now;
+                    m->started = true;
+                }
+                decode(m, m->chunk->data, m->chunk->length);
+            }
+        }
+    }
+    else
+    {
+        int64_t start = serial_time_ns(CLOCK_MONOTONIC);
+        int64_t next_refresh = start;
+        if (m->kind == SOURCE_RECORDING)
+            next_chunk(m);
+        else
+        {
+            m->start = start;
+            m->started = true;
+        }
+
+        while (running && !m->finished)
+        {
+            int64_t now = serial_time_ns(CLOCK_MONOTONIC);
+            int64_t wake = next_refresh;
+            if (m->kind == SOURCE_RECORDING && m->chunk_ready)
+            {
+                int64_t due = start + (int64_t)(m->chunk->time_ns / speed);
+                if (due < wake)
+                    wake = due;
+            }
+
+            // Sleep until data, the next recorded chunk, or the next refresh
+            int timeout_ms = wake > now ? (int)((wake - now + 999999) / 1000000) : 0;
+            struct pollfd pfd = {.fd = m->fd, .events = POLLIN};
+            poll(&pfd, 1, timeout_ms);
+            now = serial_time_ns(CLOCK_MONOTONIC);
+
+            if (m->kind == SOURCE_RECORDING)
+            {
+                while (m->chunk_ready && start + (int64_t)(m->chunk->time_ns / speed) <= now)
+                {
+                    m->now = m->arrival = m->chunk->time_ns;
+                    if (!m->started)
+                    {
+                        m->start = m->now;
+                        m->started = true;
+                    }
+                    decode(m, m->chunk->data, m->chunk->length);
+                    next_chunk(m);
+                }
+            }
+            else if (pfd.revents & (POLLIN | POLLERR | POLLHUP))
+            {
+                uint8_t buf[256];
+                ssize_t length = read(m->fd, buf, sizeof(buf));
+                if (length > 0)
+                {
+                    m->now = now;
+                    m->arrival = serial_time_ns(CLOCK_REALTIME);
+                    decode(m, buf, length);
+                }
+                else if (!(length < 0 && (errno == EINTR || errno == EAGAIN)))
+                {
+                    fprintf(stderr, "%s closed: %s\n", m->name, length ? strerror(errno) : "end of file");
+                    m->finished = true;
+                }
+            }
+
+            if (now >= next_refresh)
+            {
+                // Windows on live sources keep moving while the link is silent
+                if (m->kind != SOURCE_RECORDING)
+                    m->now = now;
+
+                summarise(m, &s);
+                if (terminal)
+                    print_screen(m, &s);
+                else
+                {
+                    print_json(m, &s);
+                    fflush(stdout);
+                }
+
+                next_refresh += interval_ms * 1000000LL;
+                if (next_refresh < now)
+                    next_refresh = now + interval_ms * 1000000LL;
+            }
+        }
+    }
+
+    summarise(m, &s);
+    if (terminal)
+        print_screen(m, &s);
+    else
+        print_json(m, &s);
+
+    if (m->fd != -1)
+        close(m->fd);
+    if (m->file)
+        fclose(m->file);
+    free(m->chunk);
+    free(m);
+    return 0;
+}
@@ -0,0 +1,357 @@
+//***************************************************************************
+//
+//  File        : protocol.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Host-side encoder/decoder for the Karaka serial protocol
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <string.h>
+#include "protocol.h"
+
+void protocol_decoder_init(struct protocol_decoder *d)
+{
+    memset(d, 0, sizeof(struct protocol_decoder));
+    d->state = DECODE_HEADERA;
+}
+
+/*
+ * Feed a byte from the device into the decoder
+ * Returns true when a complete packet is available in d->packet
+ * Mirrors the state machine in usb_tick()
+ */
+bool protocol_decode_byte(struct protocol_decoder *d, uint8_t b)
+{
+    switch (d->state)
+    {
+        case DECODE_HEADERA:
+        case DECODE_HEADERB:
+            if (b == '$')
+                d->state++;
+            else
+                d->state = DECODE_HEADERA;
+            break;
+        case DECODE_TYPE:
+            d->packet.type = b;
+            d->state++;
+            break;
+        case DECODE_LENGTH:
+            d->packet.length = b;
+            d->progress = 0;
+            d->checksum = 0;
+            if (b > PROTOCOL_MAX_DATA_LENGTH)
+            {
+                // Longer than the timer can send or receive, and than
+                // the buffers that packets are re-encoded into
+                d->errors++;
+                d->state = DECODE_HEADERA;
+            }
+            else
+                d->state = b == 0 ? DECODE_CHECKSUM : DECODE_DATA;
+            break;
+        case DECODE_DATA:
+            d->checksum ^= b;
+            d->packet.data[d->progress++] = b;
+            if (d->progress == d->packet.length)
+                d->state++;
+            break;
+        case DECODE_CHECKSUM:
+            if (d->checksum == b)
+                d->state++;
+            else
+            {
+                d->errors++;
+                d->state = DECODE_HEADERA;
+            }
+            break;
+        case DECODE_FOOTERA:
+            if (b == '\r')
+                d->state++;
+            else
+            {
+                d->errors++;
+                d->state = DECODE_HEADERA;
+            }
+            break;
+        case DECODE_FOOTERB:
+            d->state = DECODE_HEADERA;
+            if (b == '\n')
+                return true;
+
+            d->errors++;
+            break;
+    }
+
+    return false;
+}
+
+/*
+ * Frame a packet for sending to the device
+ * buf must have space for length + 7 bytes
+ * Returns the number of bytes written, or 0 if length is
+ * longer than PROTOCOL_MAX_DATA_LENGTH
+ */
+size_t protocol_encode(uint8_t *buf, uint8_t type, const void *data, uint8_t length)
+{
+    if (length > PROTOCOL_MAX_DATA_LENGTH)
+        return 0;
+
+    size_t i = 0;
+    buf[i++] = '$';
+    buf[i++] = '$';
+    buf[i++] = type;
+    buf[i++] = length;
+
+    uint8_t checksum = 0;
+    for (uint8_t j = 0; j < length; j++)
+    {
+        uint8_t b = ((const uint8_t *)data)[j];
+        buf[i++] = b;
+        checksum ^= b;
+    }
+
+    buf[i++] = checksum;
+    buf[i++] = '\r';
+    buf[i++] = '\n';
+    return i;
+}
+
+// Matches struct packet_startexposure in usb.c
+size_t protocol_encode_start_exposure(uint8_t *buf, bool use_monitor, enum protocol_timing_mode mode,
+                                      uint16_t exposure, uint8_t stride, bool align_first,
+                                      enum protocol_external_start external_start)
+{
+    uint8_t data[7] = {
+        use_monitor ? 1 : 0,
+        mode,
+        exposure & 0xFF,
+        exposure >> 8,
+        stride,
+        align_first ? 1 : 0,
+        external_start
+    };
+
+    return protocol_encode(buf, PACKET_START_EXPOSURE, data, sizeof(data));
+}
+
+/*
+ * Unpack a little-endian struct timestamp from a TIMESTAMP or TRIGGER packet
+ */
+bool protocol_parse_timestamp(const uint8_t *data, uint8_t length, struct protocol_timestamp *t)
+{
+    if (length < PROTOCOL_TIMESTAMP_LENGTH)
+        return false;
+
+    t->year = data[0] | (data[1] << 8);
+    t->month = data[2];
+    t->day = data[3];
+    t->hours = data[4];
+    t->minutes = data[5];
+    t->seconds = data[6];
+    t->milliseconds = data[7] | (data[8] << 8);
+    t->flags = data[9];
+    t->utc_offset = (int16_t)(data[10] | (data[11] << 8));
+    t->exposure_progress = data[12] | (data[13] << 8);
+    return true;
+}
+
+/*
+ * Unpack a TRIGGER packet: the trigger time, and the number of the exposure
+ * counting from 1 at the start of the sequence (or -1 from older firmware)
+ * The firmware may report only some exposures when the link is busy, so
+ * frame numbers can jump by more than the configured stride
+ */
+bool protocol_parse_trigger(const uint8_t *data, uint8_t length, struct protocol_timestamp *t, int64_t *frame)
+{
+    if (!protocol_parse_timestamp(data, length, t))
+        return false;
+
+    *frame = -1;
+    if (length >= PROTOCOL_TRIGGER_LENGTH)
+        *frame = data[14] | (data[15] << 8) | ((uint32_t)data[16] << 16) | ((uint32_t)data[17] << 24);
+
+    return true;
+}
+
+/*
+ * Unpack a PPS_PHASE packet: the time a trigger at the pulse would have
+ * reported, and the millisecond timer count within that millisecond
+ * START_EDGE packets have the same layout, for the edge that started an
+ * externally triggered sequence
+ */
+bool protocol_parse_pps_phase(const uint8_t *data, uint8_t length, struct protocol_timestamp *t, uint16_t *ticks)
+{
+    if (length < PROTOCOL_PPS_PHASE_LENGTH || !protocol_parse_timestamp(data, length, t))
+        return false;
+
+    *ticks = data[14] | (data[15] << 8);
+    return true;
+}
+
+/*
+ * Unpack a FORECAST packet announcing the next triggers
+ */
+bool protocol_parse_forecast(const uint8_t *data, uint8_t length, struct protocol_forecast *f)
+{
+    if (length < PROTOCOL_FORECAST_LENGTH || !protocol_parse_timestamp(data, length, &f->base))
+        return false;
+
+    f->offset_ms = data[14] | (data[15] << 8) | ((uint32_t)data[16] << 16) | ((uint32_t)data[17] << 24);
+    f->period_ms = data[18] | (data[19] << 8) | ((uint32_t)data[20] << 16) | ((uint32_t)data[21] << 24);
+    f->count = data[22];
+    f->revision = data[23];
+    return true;
+}
+
+/*
+ * Unpack a RECOVERY packet, sent when a sequence resumes after a reset
+ */
+bool protocol_parse_recovery(const uint8_t *data, uint8_t length, struct protocol_recovery *r)
+{
+    if (length < PROTOCOL_RECOVERY_LENGTH || !protocol_parse_timestamp(data, length, &r->time))
+        return false;
+
+    r->exposure = data[14] | (data[15] << 8) | ((uint32_t)data[16] << 16) | ((uint32_t)data[17] << 24);
+    r->lost = data[18] | (data[19] << 8) | ((uint32_t)data[20] << 16) | ((uint32_t)data[21] << 24);
+    r->reset_flags = data[22];
+    return true;
+}
+
+/*
+ * Unpack an INTEGRITY packet, sent when the shadow timing check fails
+ */
+bool protocol_parse_integrity(const uint8_t *data, uint8_t length, struct protocol_integrity *e)
+{
+    if (length < PROTOCOL_INTEGRITY_LENGTH || !protocol_parse_timestamp(data, length, &e->time))
+        return false;
+
+    e->active_ms = data[14] | (data[15] << 8) | ((uint32_t)data[16] << 16) | ((uint32_t)data[17] << 24);
+    e->shadow_ms = data[18] | (data[19] << 8) | ((uint32_t)data[20] << 16) | ((uint32_t)data[21] << 24);
+    e->jump_ms = (int32_t)(data[22] | (data[23] << 8) | ((uint32_t)data[24] << 16) | ((uint32_t)data[25] << 24));
+    return true;
+}
+
+/*
+ * Unpack a LINK_STATS packet, sent when a sequence ends or on request
+ */
+bool protocol_parse_link_stats(const uint8_t *data, uint8_t length, struct protocol_link_stats *s)
+{
+    if (length < PROTOCOL_LINK_STATS_LENGTH)
+        return false;
+
+    s->seconds = data[0] | (data[1] << 8);
+    s->projected_bytes_per_second = data[2] | (data[3] << 8);
+    s->high_water = data[4];
+    s->stalls = data[5] | (data[6] << 8);
+    for (uint8_t i = 0; i < PROTOCOL_LINK_STATS_TYPES; i++)
+    {
+        const uint8_t *b = &data[7 + 4 * i];
+        s->bytes[i] = b[0] | (b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+    }
+
+    return true;
+}
+
+/*
+ * Unpack a BENCHMARK packet, sent in reply to a BENCHMARK command
+ */
+bool protocol_parse_benchmark(const uint8_t *data, uint8_t length, struct protocol_benchmark *b)
+{
+    if (length < PROTOCOL_BENCHMARK_LENGTH)
+        return false;
+
+    b->f_cpu = data[0] | (data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+    b->display_type = data[4];
+    b->display_redraw = data[5] | (data[6] << 8) | ((uint32_t)data[7] << 16) | ((uint32_t)data[8] << 24);
+    b->spi_byte = data[9] | (data[10] << 8);
+    b->queue_length = data[11];
+    b->queue_cycles = data[12] | (data[13] << 8);
+    b->tx_bytes_per_second = data[14] | (data[15] << 8);
+    b->usb_parse = data[16] | (data[17] << 8);
+    b->gps_trimble = data[18] | (data[19] << 8);
+    b->gps_magellan = data[20] | (data[21] << 8);
+    b->isr_latency = data[22] | (data[23] << 8);
+    return true;
+}
+
+/*
+ * Unpack a FRAMES packet of frame times captured in MODE_CAMERAMASTER
+ */
+bool protocol_parse_frames(const uint8_t *data, uint8_t length, struct protocol_frames *f)
+{
+    if (length < PROTOCOL_FRAMES_HEADER_LENGTH || !protocol_parse_timestamp(data, length, &f->base))
+        return false;
+
+    f->first_frame = data[14] | (data[15] << 8) | ((uint32_t)data[16] << 16) | ((uint32_t)data[17] << 24);
+    f->dropped = data[18] | (data[19] << 8);
+    f->count = data[20];
+    if (f->count > PROTOCOL_FRAMES_MAX || length < PROTOCOL_FRAMES_HEADER_LENGTH + 4 * f->count)
+        return false;
+
+    const uint8_t *o = data + PROTOCOL_FRAMES_HEADER_LENGTH;
+    for (uint8_t i = 0; i < f->count; i++, o += 4)
+        f->offsets[i] = o[0] | (o[1] << 8) | ((uint32_t)o[2] << 16) | ((uint32_t)o[3] << 24);
+
+    return true;
+}
+
+// UTC time of the i'th frame in a FRAMES packet
+int64_t protocol_frame_utc_ns(const struct protocol_frames *f, uint8_t i)
+{
+    return protocol_timestamp_utc_ns(&f->base) + (int64_t)f->offsets[i] * PROTOCOL_TICK_NS;
+}
+
+// UTC time of the i'th announced trigger, as its TRIGGER packet will report it
+int64_t protocol_forecast_trigger_ns(const struct protocol_forecast *f, uint8_t i)
+{
+    return protocol_timestamp_utc_ns(&f->base) + ((int64_t)f->offset_ms + (int64_t)i * f->period_ms) * 1000000LL;
+}
+
+// Inverse of protocol_parse_timestamp; data must have space for PROTOCOL_TIMESTAMP_LENGTH bytes
+void protocol_pack_timestamp(const struct protocol_timestamp *t, uint8_t *data)
+{
+    data[0] = t->year & 0xFF;
+    data[1] = t->year >> 8;
+    data[2] = t->month;
+    data[3] = t->day;
+    data[4] = t->hours;
+    data[5] = t->minutes;
+    data[6] = t->seconds;
+    data[7] = t->milliseconds & 0xFF;
+    data[8] = t->milliseconds >> 8;
+    data[9] = t->flags;
+    data[10] = (uint16_t)t->utc_offset & 0xFF;
+    data[11] = (uint16_t)t->utc_offset >> 8;
+    data[12] = t->exposure_progress & 0xFF;
+    data[13] = t->exposure_progress >> 8;
+}
+
+// Days since 1970-01-01 in the proleptic Gregorian calendar
+int64_t protocol_days_from_civil(int64_t year, unsigned month, unsigned day)
+{
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    unsigned yoe = (unsigned)(year - era * 400);
+    unsigned doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int64_t)doe - 719468;
+}
+
+/*
+ * Convert a timestamp to nanoseconds since the unix epoch
+ * GPS timestamps are corrected to UTC using the embedded offset
+ */
+int64_t protocol_timestamp_utc_ns(const struct protocol_timestamp *t)
+{
+    int64_t seconds = protocol_days_from_civil(t->year, t->month, t->day) * 86400 +
+        t->hours * 3600 + t->minutes * 60 + t->seconds;
+
+    if (t->flags & PROTOCOL_TIMESTAMP_IS_GPS)
+        seconds -= t->utc_offset;
+
+    return seconds * 1000000000LL + t->milliseconds * 1000000LL;
+}
@@ -0,0 +1,254 @@
+//***************************************************************************
+//
+//  File        : protocol.h
+//  Copyright   : 2013 Paul Chote
+//  Description : Host-side encoder/decoder for the Karaka serial protocol
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#ifndef KARAKA_PROTOCOL_H
+#define KARAKA_PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Must match the definitions in usb.c
+#define PROTOCOL_MAX_DATA_LENGTH 200
+#define PROTOCOL_MAX_PACKET_LENGTH (PROTOCOL_MAX_DATA_LENGTH + 7)
+
+enum protocol_packet_type
+{
+    PACKET_TIMESTAMP = 'A',
+    PACKET_TRIGGER = 'B',
+    PACKET_MESSAGE = 'C',
+    PACKET_MESSAGE_RAW = 'D',
+    PACKET_START_EXPOSURE = 'E',
+    PACKET_STOP_EXPOSURE = 'F',
+    PACKET_ABORT_EXPOSURE = 'G',
+    PACKET_STATUS = 'H',
+    PACKET_PPS_PHASE = 'I',
+    PACKET_FORECAST = 'J',
+    PACKET_RECOVERY = 'K',
+    PACKET_FRAMES = 'L',
+    PACKET_LINK_STATS = 'M',
+    PACKET_INTEGRITY = 'N',
+    PACKET_START_EDGE = 'O',
+    PACKET_BENCHMARK = 'Q',
+    PACKET_ENABLE_RELAY = 'R',
+};
+
+// Must match enum timing_mode in main.h
+enum protocol_timing_mode
+{
+    PROTOCOL_MODE_PULSECOUNTER = 0,
+    PROTOCOL_MODE_HIGHRES = 1,
+    PROTOCOL_MODE_CAMERAMASTER = 2,
+};
+
+// Must match enum timer_status and enum gps_status in main.h
+enum protocol_timer_status
+{
+    PROTOCOL_TIMER_IDLE,
+    PROTOCOL_TIMER_WAITING,
+    PROTOCOL_TIMER_ALIGN,
+    PROTOCOL_TIMER_EXPOSING,
+    PROTOCOL_TIMER_READOUT,
+    PROTOCOL_TIMER_RELAY,
+    PROTOCOL_TIMER_ARMED
+};
+
+// Must match enum external_start in main.h
+enum protocol_external_start
+{
+    PROTOCOL_EXTERNAL_START_NONE = 0,
+    PROTOCOL_EXTERNAL_START_RISING = 1,
+    PROTOCOL_EXTERNAL_START_FALLING = 2
+};
+
+// Must match enum display_type in display.h
+enum protocol_display_type
+{
+    PROTOCOL_DISPLAY_LED = 0x01,
+    PROTOCOL_DISPLAY_LCD = 0x02
+};
+
+enum protocol_gps_status
+{
+    PROTOCOL_GPS_UNAVAILABLE = 0,
+    PROTOCOL_GPS_SYNCING = 1,
+    PROTOCOL_GPS_ACTIVE = 2
+};
+
+// Must match enum timestamp_flags in main.h
+#define PROTOCOL_TIMESTAMP_LOCKED 0x01
+#define PROTOCOL_TIMESTAMP_IS_GPS 0x02
+
+// Size of struct timestamp on the AVR
+#define PROTOCOL_TIMESTAMP_LENGTH 14
+
+// Size of struct packet_trigger on the AVR: a timestamp and the frame number
+// TRIGGER packets from older firmware hold only the timestamp
+#define PROTOCOL_TRIGGER_LENGTH 18
+
+// Size of struct pps_phase on the AVR: a timestamp and 0.1us timer ticks
+// Also used for START_EDGE packets
+#define PROTOCOL_PPS_PHASE_LENGTH 16
+#define PROTOCOL_TICK_NS 100
+
+// Size of struct packet_forecast on the AVR
+#define PROTOCOL_FORECAST_LENGTH 24
+
+// Size of struct recovery_event on the AVR
+#define PROTOCOL_RECOVERY_LENGTH 23
+
+// struct frame_batch on the AVR: a header, then count 32-bit offsets
+#define PROTOCOL_FRAMES_HEADER_LENGTH 21
+#define PROTOCOL_FRAMES_MAX 16
+
+// Size of struct integrity_event on the AVR
+#define PROTOCOL_INTEGRITY_LENGTH 26
+
+// Size of struct benchmark_result on the AVR
+#define PROTOCOL_BENCHMARK_LENGTH 24
+
+// struct packet_link_stats on the AVR: a header, then a byte count
+// for each packet type from 'A' to 'R'
+#define PROTOCOL_LINK_STATS_LENGTH 79
+#define PROTOCOL_LINK_STATS_TYPES 18
+
+struct protocol_packet
+{
+    uint8_t type;
+    uint8_t length;
+    uint8_t data[256];
+};
+
+enum protocol_decoder_state {DECODE_HEADERA = 0, DECODE_HEADERB, DECODE_TYPE, DECODE_LENGTH,
+                             DECODE_DATA, DECODE_CHECKSUM, DECODE_FOOTERA, DECODE_FOOTERB};
+
+struct protocol_decoder
+{
+    enum protocol_decoder_state state;
+    uint8_t progress;
+    uint8_t checksum;
+    struct protocol_packet packet;
+
+    // Number of packets rejected for bad checksums or footers
+    uint32_t errors;
+};
+
+struct protocol_timestamp
+{
+    uint16_t year;
+    uint8_t month;
+    uint8_t day;
+    uint8_t hours;
+    uint8_t minutes;
+    uint8_t seconds;
+    uint16_t milliseconds;
+    uint8_t flags;
+    int16_t utc_offset;
+    uint16_t exposure_progress;
+};
+
+// Announced trigger times: offset_ms after base, then every period_ms
+// count == 0 cancels earlier forecasts (the sequence has stopped)
+struct protocol_forecast
+{
+    struct protocol_timestamp base;
+    uint32_t offset_ms;
+    uint32_t period_ms;
+    uint8_t count;
+    uint8_t revision;
+};
+
+// A sequence resumed after a watchdog reset: exposure is the number of the
+// next exposure to end, and lost the number that ended during the outage
+// reset_flags holds MCUSR (bit 3 set for a watchdog reset)
+struct protocol_recovery
+{
+    struct protocol_timestamp time;
+    uint32_t exposure;
+    uint32_t lost;
+    uint8_t reset_flags;
+};
+
+// Sent when the active timing path and its shadow suddenly disagree
+// Times are ms since the sequence started (or resumed) according to each
+struct protocol_integrity
+{
+    struct protocol_timestamp time;
+    uint32_t active_ms;
+    uint32_t shadow_ms;
+    int32_t jump_ms;
+};
+
+// Serial link usage since the last START_EXPOSURE
+// bytes[i] counts packets of type 'A' + i, including framing
+struct protocol_link_stats
+{
+    uint16_t seconds;
+    uint16_t projected_bytes_per_second;
+    uint8_t high_water;
+    uint16_t stalls;
+    uint32_t bytes[PROTOCOL_LINK_STATS_TYPES];
+};
+
+// Results of the on-board benchmarks, in CPU cycles unless noted
+// Each is the fewest over several runs; 0 means the test couldn't run
+struct protocol_benchmark
+{
+    uint32_t f_cpu;
+    uint8_t display_type;
+    uint32_t display_redraw;
+    uint16_t spi_byte;
+    uint8_t queue_length;
+    uint16_t queue_cycles;
+    uint16_t tx_bytes_per_second;
+    uint16_t usb_parse;
+    uint16_t gps_trimble;
+    uint16_t gps_magellan;
+    uint16_t isr_latency;
+};
+
+// Frame times captured in MODE_CAMERAMASTER
+// Frame first_frame + i * stride is at base plus offsets[i] * PROTOCOL_TICK_NS
+// Frames are numbered from 1, like the frame field of TRIGGER packets
+struct protocol_frames
+{
+    struct protocol_timestamp base;
+    uint32_t first_frame;
+    uint16_t dropped;
+    uint8_t count;
+    uint32_t offsets[PROTOCOL_FRAMES_MAX];
+};
+
+void protocol_decoder_init(struct protocol_decoder *d);
+bool protocol_decode_byte(struct protocol_decoder *d, uint8_t b);
+
+size_t protocol_encode(uint8_t *buf, uint8_t type, const void *data, uint8_t length);
+size_t protocol_encode_start_exposure(uint8_t *buf, bool use_monitor, enum protocol_timing_mode mode,
+                                      uint16_t exposure, uint8_t stride, bool align_first,
+                                      enum protocol_external_start external_start);
+
+bool protocol_parse_timestamp(const uint8_t *data, uint8_t length, struct protocol_timestamp *t);
+void protocol_pack_timestamp(const struct protocol_timestamp *t, uint8_t *data);
+bool protocol_parse_trigger(const uint8_t *data, uint8_t length, struct protocol_timestamp *t, int64_t *frame);
+bool protocol_parse_pps_phase(const uint8_t *data, uint8_t length, struct protocol_timestamp *t, uint16_t *ticks);
+bool protocol_parse_forecast(const uint8_t *data, uint8_t length, struct protocol_forecast *f);
+bool protocol_parse_recovery(const uint8_t *data, uint8_t length, struct protocol_recovery *r);
+bool protocol_parse_integrity(const uint8_t *data, uint8_t length, struct protocol_integrity *e);
+bool protocol_parse_link_stats(const uint8_t *data, uint8_t length, struct protocol_link_stats *s);
+bool protocol_parse_benchmark(const uint8_t *data, uint8_t length, struct protocol_benchmark *b);
+bool protocol_parse_frames(const uint8_t *data, uint8_t length, struct protocol_frames *f);
+int64_t protocol_frame_utc_ns(const struct protocol_frames *f, uint8_t i);
+int64_t protocol_forecast_trigger_ns(const struct protocol_forecast *f, uint8_t i);
+int64_t protocol_timestamp_utc_ns(const struct protocol_timestamp *t);
+int64_t protocol_days_from_civil(int64_t year, unsigned month, unsigned day);
+
+#endif
@@ -0,0 +1,233 @@
+//***************************************************************************
+//
+//  File        : receiver.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Host-side encoders for Trimble, Magellan and u-blox GPS packets
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <string.h>
+#include "receiver.h"
+
+// Append a TSIP data byte, doubling any 0x10 (DLE) bytes
+static size_t tsip_byte(uint8_t *buf, size_t i, uint8_t b)
+{
+    buf[i++] = b;
+    if (b == 0x10)
+        buf[i++] = b;
+    return i;
+}
+
+/*
+ * Encode a Trimble 8F-AB primary timing packet for the second starting at utc
+ * The time fields are reported in UTC if TRIMBLE_UTC_TIME is set, otherwise GPS time
+ */
+size_t receiver_encode_trimble(uint8_t *buf, time_t utc, int16_t leap_seconds, uint8_t flags)
+{
+    time_t gps = utc + leap_seconds;
+    uint32_t gps_seconds = (uint32_t)(gps - RECEIVER_GPS_EPOCH);
+    uint32_t time_of_week = gps_seconds % 604800;
+    uint16_t week = gps_seconds / 604800;
+
+    time_t display = (flags & TRIMBLE_UTC_TIME) ? utc : gps;
+    struct tm t;
+    gmtime_r(&display, &t);
+    uint16_t year = t.tm_year + 1900;
+
+    uint8_t data[16] = {
+        time_of_week >> 24, time_of_week >> 16, time_of_week >> 8, time_of_week,
+        week >> 8, week,
+        (uint16_t)leap_seconds >> 8, leap_seconds & 0xFF,
+        flags,
+        t.tm_sec, t.tm_min, t.tm_hour, t.tm_mday, t.tm_mon + 1,
+        year >> 8, year & 0xFF
+    };
+
+    size_t i = 0;
+    buf[i++] = 0x10;
+    buf[i++] = 0x8F;
+    buf[i++] = 0xAB;
+    for (uint8_t j = 0; j < sizeof(data); j++)
+        i = tsip_byte(buf, i, data[j]);
+    buf[i++] = 0x10;
+    buf[i++] = 0x03;
+    return i;
+}
+
+static size_t put_u32(uint8_t *data, size_t i, uint32_t value)
+{
+    data[i++] = value >> 24;
+    data[i++] = value >> 16;
+    data[i++] = value >> 8;
+    data[i++] = value;
+    return i;
+}
+
+static size_t put_float(uint8_t *data, size_t i, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return put_u32(data, i, bits);
+}
+
+/*
+ * Encode a Trimble 8F-AC supplemental timing packet for a receiver
+ * that has completed its self-survey and is disciplining normally
+ * gps.c ignores this packet, but must skip over it correctly
+ */
+size_t receiver_encode_trimble_supplemental(uint8_t *buf, float pps_offset_ns, float temperature)
+{
+    uint8_t data[67] = {0};
+    size_t i = 0;
+    data[i++] = 7;    // Receiver mode: overdetermined clock
+    data[i++] = 0;    // Disciplining mode: normal
+    data[i++] = 100;  // Self-survey progress
+    i = put_u32(data, i, 0);   // Holdover duration
+    i += 2;                    // Critical alarms
+    i += 2;                    // Minor alarms
+    data[i++] = 0;    // GPS decoding status: doing fixes
+    data[i++] = 0;    // Disciplining activity: phase locking
+    i += 2;                    // Spare
+    i = put_float(data, i, pps_offset_ns);
+    i = put_float(data, i, pps_offset_ns * 1e-3f);
+    i = put_u32(data, i, 0x8000);
+    i = put_float(data, i, 1.5f);
+    i = put_float(data, i, temperature);
+
+    // Position (latitude, longitude, altitude) as doubles are left zero
+
+    size_t j = 0;
+    buf[j++] = 0x10;
+    buf[j++] = 0x8F;
+    buf[j++] = 0xAC;
+    for (uint8_t k = 0; k < sizeof(data); k++)
+        j = tsip_byte(buf, j, data[k]);
+    buf[j++] = 0x10;
+    buf[j++] = 0x03;
+    return j;
+}
+
+static size_t magellan_packet(uint8_t *buf, uint8_t type, const uint8_t *data, uint8_t length)
+{
+    size_t i = 0;
+    buf[i++] = '$';
+    buf[i++] = '$';
+    buf[i++] = type;
+
+    uint8_t checksum = type;
+    for (uint8_t j = 0; j < length; j++)
+    {
+        buf[i++] = data[j];
+        checksum ^= data[j];
+    }
+
+    buf[i++] = checksum;
+    buf[i++] = '\n';
+    return i;
+}
+
+/*
+ * Encode a Magellan $$A time packet, reproducing the receiver's
+ * stale GPS epoch that gps.c corrects for
+ */
+size_t receiver_encode_magellan_time(uint8_t *buf, time_t utc)
+{
+    time_t reported = utc - RECEIVER_MAGELLAN_EPOCH_OFFSET;
+    struct tm t;
+    gmtime_r(&reported, &t);
+    uint16_t year = t.tm_year + 1900;
+
+    uint8_t data[8] = {
+        0, t.tm_hour, t.tm_min, t.tm_sec, t.tm_mday, t.tm_mon + 1, year >> 8, year & 0xFF
+    };
+
+    return magellan_packet(buf, 'A', data, sizeof(data));
+}
+
+// Encode a Magellan $$H status packet
+size_t receiver_encode_magellan_status(uint8_t *buf, bool locked)
+{
+    uint8_t data[11] = {0};
+    data[10] = locked ? 0x06 : 0x00;
+    return magellan_packet(buf, 'H', data, sizeof(data));
+}
+
+// Frame a UBX packet with its Fletcher checksum
+static size_t ubx_packet(uint8_t *buf, uint8_t class, uint8_t id, const uint8_t *data, uint16_t length)
+{
+    size_t i = 0;
+    buf[i++] = 0xB5;
+    buf[i++] = 0x62;
+    buf[i++] = class;
+    buf[i++] = id;
+    buf[i++] = length & 0xFF;
+    buf[i++] = length >> 8;
+    memcpy(buf + i, data, length);
+    i += length;
+
+    uint8_t a = 0, b = 0;
+    for (size_t j = 2; j < i; j++)
+    {
+        a += buf[j];
+        b += a;
+    }
+
+    buf[i++] = a;
+    buf[i++] = b;
+    return i;
+}
+
+static size_t put_le(uint8_t *data, size_t i, uint32_t value, uint8_t bytes)
+{
+    for (uint8_t j = 0; j < bytes; j++)
+        data[i++] = value >> (8 * j);
+    return i;
+}
+
+/*
+ * Encode a UBX-NAV-TIMEUTC packet for the second starting at utc
+ */
+size_t receiver_encode_ubx_timeutc(uint8_t *buf, time_t utc, int16_t leap_seconds, bool valid)
+{
+    uint32_t gps_seconds = (uint32_t)(utc + leap_seconds - RECEIVER_GPS_EPOCH);
+    struct tm t;
+    gmtime_r(&utc, &t);
+
+    uint8_t data[20];
+    size_t i = 0;
+    i = put_le(data, i, (gps_seconds % 604800) * 1000, 4);  // iTOW
+    i = put_le(data, i, 50, 4);                             // tAcc (ns)
+    i = put_le(data, i, 0, 4);                              // nano
+    i = put_le(data, i, t.tm_year + 1900, 2);
+    data[i++] = t.tm_mon + 1;
+    data[i++] = t.tm_mday;
+    data[i++] = t.tm_hour;
+    data[i++] = t.tm_min;
+    data[i++] = t.tm_sec;
+
+    // validTOW | validWKN | validUTC
+    data[i++] = valid ? 0x07 : 0x00;
+    return ubx_packet(buf, 0x01, 0x21, data, sizeof(data));
+}
+
+/*
+ * Encode a UBX-TIM-TP packet describing the next time pulse
+ */
+size_t receiver_encode_ubx_timtp(uint8_t *buf, time_t next_pulse, int16_t leap_seconds, int32_t quantization_ps)
+{
+    uint32_t gps_seconds = (uint32_t)(next_pulse + leap_seconds - RECEIVER_GPS_EPOCH);
+
+    uint8_t data[16];
+    size_t i = 0;
+    i = put_le(data, i, (gps_seconds % 604800) * 1000, 4);  // towMS
+    i = put_le(data, i, 0, 4);                              // towSubMS
+    i = put_le(data, i, (uint32_t)quantization_ps, 4);      // qErr
+    i = put_le(data, i, gps_seconds / 604800, 2);           // week
+    data[i++] = 0x01;                                       // flags: UTC timebase
+    data[i++] = 0x00;                                       // refInfo
+    return ubx_packet(buf, 0x0D, 0x01, data, sizeof(data));
+}
@@ -0,0 +1,45 @@
+//***************************************************************************
+//
+//  File        : receiver.h
+//  Copyright   : 2013 Paul Chote
+//  Description : Host-side encoders for Trimble, Magellan and u-blox GPS packets
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#ifndef KARAKA_RECEIVER_H
+#define KARAKA_RECEIVER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Largest packet produced by any of the encoders
+#define RECEIVER_MAX_PACKET_LENGTH 160
+
+// Seconds between the unix and GPS epochs (1980-01-06)
+#define RECEIVER_GPS_EPOCH 315964800
+
+// Magellan receivers report dates 1024 weeks in the past
+#define RECEIVER_MAGELLAN_EPOCH_OFFSET (1024 * 7 * 86400)
+
+enum receiver_trimble_flags
+{
+    TRIMBLE_UTC_TIME     = 0x01,
+    TRIMBLE_UTC_PPS      = 0x02,
+    TRIMBLE_TIME_NOT_SET = 0x04,
+    TRIMBLE_NO_UTC_INFO  = 0x08,
+};
+
+size_t receiver_encode_trimble(uint8_t *buf, time_t utc, int16_t leap_seconds, uint8_t flags);
+size_t receiver_encode_trimble_supplemental(uint8_t *buf, float pps_offset_ns, float temperature);
+size_t receiver_encode_magellan_time(uint8_t *buf, time_t utc);
+size_t receiver_encode_magellan_status(uint8_t *buf, bool locked);
+size_t receiver_encode_ubx_timeutc(uint8_t *buf, time_t utc, int16_t leap_seconds, bool valid);
+size_t receiver_encode_ubx_timtp(uint8_t *buf, time_t next_pulse, int16_t leap_seconds, int32_t quantization_ps);
+
+#endif
@@ -0,0 +1,90 @@
+//***************************************************************************
+//
+//  File        : record.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Timestamped recordings of the serial stream to and from a timer
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <errno.h>
+#include <string.h>
+#include "record.h"
+
+FILE *record_open_write(const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f)
+    {
+        fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    if (fwrite(RECORD_MAGIC, 1, 8, f) != 8)
+    {
+        fprintf(stderr, "Failed to write %s\n", path);
+        fclose(f);
+        return NULL;
+    }
+
+    return f;
+}
+
+FILE *record_open_read(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    char magic[8];
+    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, RECORD_MAGIC, 8))
+    {
+        fprintf(stderr, "%s is not a Karaka recording\n", path);
+        fclose(f);
+        return NULL;
+    }
+
+    return f;
+}
+
+bool record_write(FILE *f, int64_t time_ns, enum record_direction direction, const uint8_t *data, uint16_t length)
+{
+    uint8_t header[11];
+    for (uint8_t i = 0; i < 8; i++)
+        header[i] = (uint64_t)time_ns >> (8 * i);
+    header[8] = direction;
+    header[9] = length & 0xFF;
+    header[10] = length >> 8;
+
+    return fwrite(header, 1, sizeof(header), f) == sizeof(header) &&
+        fwrite(data, 1, length, f) == length;
+}
+
+/*
+ * Read the next chunk from a recording
+ * Returns false at the end of the file or if the chunk is truncated
+ */
+bool record_read(FILE *f, struct record_chunk *chunk)
+{
+    uint8_t header[11];
+    if (fread(header, 1, sizeof(header), f) != sizeof(header))
+        return false;
+
+    uint64_t time = 0;
+    for (uint8_t i = 0; i < 8; i++)
+        time |= (uint64_t)header[i] << (8 * i);
+
+    chunk->time_ns = (int64_t)time;
+    chunk->direction = header[8];
+    chunk->length = header[9] | (header[10] << 8);
+    if (chunk->length > RECORD_MAX_CHUNK_LENGTH)
+        return false;
+
+    return fread(chunk->data, 1, chunk->length, f) == chunk->length;
+}
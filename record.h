@@ -0,0 +1,50 @@
+//***************************************************************************
+//
+//  File        : record.h
+//  Copyright   : 2013 Paul Chote
+//  Description : Timestamped recordings of the serial stream to and from a timer
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#ifndef KARAKA_RECORD_H
+#define KARAKA_RECORD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * A recording is an 8 byte magic followed by a sequence of chunks:
+ *   int64 time (ns since the start of the recording, little endian)
+ *   uint8 direction
+ *   uint16 length (little endian)
+ *   data
+ * Each chunk holds the bytes returned by a single read() or write()
+ */
+#define RECORD_MAGIC "KRKREC1\n"
+#define RECORD_MAX_CHUNK_LENGTH 4096
+
+enum record_direction
+{
+    RECORD_FROM_DEVICE = 0,
+    RECORD_TO_DEVICE = 1
+};
+
+struct record_chunk
+{
+    int64_t time_ns;
+    enum record_direction direction;
+    uint16_t length;
+    uint8_t data[RECORD_MAX_CHUNK_LENGTH];
+};
+
+FILE *record_open_write(const char *path);
+FILE *record_open_read(const char *path);
+bool record_write(FILE *f, int64_t time_ns, enum record_direction direction, const uint8_t *data, uint16_t length);
+bool record_read(FILE *f, struct record_chunk *chunk);
+
+#endif
@@ -0,0 +1,247 @@
+//***************************************************************************
+//
+//  File        : refclock.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Publishes the timer's GPS timestamps to the chrony/ntpd
+//                shared memory reference clock
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include "protocol.h"
+#include "serial.h"
+
+// Segment keys used by the ntpd SHM driver (type 28) and chrony's SHM refclock
+#define SHM_KEY_BASE 0x4e545030
+
+// Layout of struct shmTime in ntpd's refclock_shm.c
+struct shm_time
+{
+    int mode;
+    volatile int count;
+    time_t clock_sec;
+    int clock_usec;
+    time_t receive_sec;
+    int receive_usec;
+    int leap;
+    int precision;
+    int nsamples;
+    volatile int valid;
+    unsigned clock_nsec;
+    unsigned receive_nsec;
+    int dummy[8];
+};
+
+struct config
+{
+    unsigned unit;
+    unsigned baud;
+    double delay_ms;
+    int precision;
+    bool dry_run;
+    bool verbose;
+};
+
+static volatile bool running = true;
+
+static void handle_signal(int sig)
+{
+    (void)sig;
+    running = false;
+}
+
+static volatile struct shm_time *attach_segment(unsigned unit)
+{
+    // Units 0 and 1 are restricted to root, matching ntpd and chrony
+    int perms = unit < 2 ? 0600 : 0666;
+    int id = shmget(SHM_KEY_BASE + unit, sizeof(struct shm_time), IPC_CREAT | perms);
+    if (id == -1)
+    {
+        fprintf(stderr, "Failed to create SHM segment %u: %s\n", unit, strerror(errno));
+        return NULL;
+    }
+
+    void *addr = shmat(id, NULL, 0);
+    if (addr == (void *)-1)
+    {
+        fprintf(stderr, "Failed to attach SHM segment %u: %s\n", unit, strerror(errno));
+        return NULL;
+    }
+
+    return addr;
+}
+
+/*
+ * Publish a sample using the mode 1 protocol: count is incremented before and
+ * after the update so that readers can detect and discard a torn sample
+ */
+static void publish_sample(volatile struct shm_time *shm, int64_t clock_ns, int64_t receive_ns, int precision)
+{
+    shm->mode = 1;
+    shm->valid = 0;
+    shm->count++;
+    __sync_synchronize();
+
+    shm->clock_sec = clock_ns / 1000000000LL;
+    shm->clock_nsec = clock_ns % 1000000000LL;
+    shm->clock_usec = shm->clock_nsec / 1000;
+    shm->receive_sec = receive_ns / 1000000000LL;
+    shm->receive_nsec = receive_ns % 1000000000LL;
+    shm->receive_usec = shm->receive_nsec / 1000;
+    shm->leap = 0;
+    shm->precision = precision;
+    shm->nsamples = 0;
+
+    __sync_synchronize();
+    shm->count++;
+    shm->valid = 1;
+}
+
+/*
+ * Convert a TIMESTAMP packet into a sample
+ * The timestamp describes the time pulse that preceded the receiver's serial
+ * packet. The firmware has no round trip exchange, so the delay between the
+ * pulse and the final byte reaching the host is modelled as the configured
+ * fixed delay (receiver packet, firmware and USB latencies) plus the time to
+ * transmit the TIMESTAMP packet itself
+ */
+static bool make_sample(const struct config *c, const struct protocol_packet *p, int64_t arrival_ns,
+                        int64_t *clock_ns, int64_t *receive_ns)
+{
+    struct protocol_timestamp t;
+    if (!protocol_parse_timestamp(p->data, p->length, &t))
+        return false;
+
+    if (!(t.flags & PROTOCOL_TIMESTAMP_LOCKED))
+    {
+        if (c->verbose)
+            printf("unlocked %04u-%02u-%02u %02u:%02u:%02u\n",
+                   t.year, t.month, t.day, t.hours, t.minutes, t.seconds);
+        return false;
+    }
+
+    int64_t transmit_ns = (int64_t)(p->length + 7) * 10 * 1000000000LL / c->baud;
+    *clock_ns = protocol_timestamp_utc_ns(&t);
+    *receive_ns = arrival_ns - transmit_ns - (int64_t)(c->delay_ms * 1e6);
+    return true;
+}
+
+static void print_usage()
+{
+    printf("Usage: refclock [options] <port>\n");
+    printf("  -u <unit>       SHM unit number (default 2)\n");
+    printf("  -d <ms>         fixed delay between the pulse and the timestamp leaving the timer (default 0)\n");
+    printf("  -b <baud>       line rate, used for the packet transmission time (default 9600)\n");
+    printf("  -p <precision>  advertised precision as a power of 2 seconds (default -7)\n");
+    printf("  -n              print samples without publishing them\n");
+    printf("  -v              print each sample\n");
+    printf("For chronyd, add \"refclock SHM 2 refid GPS precision 1e-2\" to chrony.conf\n");
+    printf("Units 0 and 1 are only accessible by root.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct config c = {
+        .unit = 2,
+        .baud = SERIAL_DEFAULT_BAUD,
+        .precision = -7,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "u:d:b:p:nv")) != -1)
+    {
+        switch (opt)
+        {
+            case 'u': c.unit = atoi(optarg); break;
+            case 'd': c.delay_ms = atof(optarg); break;
+            case 'b': c.baud = atoi(optarg); break;
+            case 'p': c.precision = atoi(optarg); break;
+            case 'n': c.dry_run = c.verbose = true; break;
+            case 'v': c.verbose = true; break;
+            default: print_usage(); return 1;
+        }
+    }
+
+    if (optind != argc - 1 || !c.baud)
+    {
+        print_usage();
+        return 1;
+    }
+
+    volatile struct shm_time *shm = NULL;
+    if (!c.dry_run && !(shm = attach_segment(c.unit)))
+        return 1;
+
+    int fd = serial_open(argv[optind], c.baud);
+    if (fd == -1)
+        return 1;
+
+    // Anything already buffered has an unknown arrival time
+    tcflush(fd, TCIFLUSH);
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    struct protocol_decoder d;
+    protocol_decoder_init(&d);
+
+    while (running)
+    {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, 1000) <= 0)
+            continue;
+
+        uint8_t buf[256];
+        ssize_t length = read(fd, buf, sizeof(buf));
+        int64_t arrival_ns = serial_time_ns(CLOCK_REALTIME);
+        if (length <= 0)
+        {
+            if (length < 0 && errno == EINTR)
+                continue;
+            fprintf(stderr, "Read failed: %s\n", length ? strerror(errno) : "end of file");
+            break;
+        }
+
+        for (ssize_t i = 0; i < length; i++)
+        {
+            if (!protocol_decode_byte(&d, buf[i]) || d.packet.type != PACKET_TIMESTAMP)
+                continue;
+
+            // Bytes that followed in the same read arrived after the end of this packet
+            int64_t packet_end_ns = arrival_ns - (length - 1 - i) * 10 * 1000000000LL / c.baud;
+
+            int64_t clock_ns, receive_ns;
+            if (!make_sample(&c, &d.packet, packet_end_ns, &clock_ns, &receive_ns))
+                continue;
+
+            if (shm)
+                publish_sample(shm, clock_ns, receive_ns, c.precision);
+
+            if (c.verbose)
+                printf("sample %lld.%09lld %lld.%09lld offset %+.3f ms\n",
+                       (long long)(clock_ns / 1000000000LL), (long long)(clock_ns % 1000000000LL),
+                       (long long)(receive_ns / 1000000000LL), (long long)(receive_ns % 1000000000LL),
+                       (clock_ns - receive_ns) / 1e6);
+        }
+    }
+
+    if (shm)
+        shmdt((void *)shm);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,252 @@
+//***************************************************************************
+//
+//  File        : refine.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Recomputes trigger times from a recorded stream using the
+//                timer phase measured at each time pulse
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "protocol.h"
+#include "record.h"
+
+/*
+ * In MODE_HIGHRES the firmware times triggers by counting crystal-derived
+ * milliseconds, so any crystal error accumulates between the start of the
+ * sequence and each trigger. The PPS_PHASE packet reports the time that a
+ * trigger at each pulse would have been given. Because the pulse marks an
+ * exact second, this measures the timer's error at that instant. The error
+ * is interpolated linearly between the pulses on either side of a trigger.
+ */
+struct pulse
+{
+    int64_t second;
+    double error_ns;
+};
+
+struct trigger
+{
+    uint64_t frame;
+    int64_t reported_ns;
+};
+
+struct stream
+{
+    struct pulse *pulses;
+    size_t pulse_count;
+    size_t pulse_capacity;
+
+    struct trigger *triggers;
+    size_t trigger_count;
+    size_t trigger_capacity;
+
+    uint32_t rejected_pulses;
+};
+
+static void add_packet(struct stream *s, const struct protocol_packet *p)
+{
+    struct protocol_timestamp t;
+    uint16_t ticks;
+    int64_t frame;
+
+    if (p->type == PACKET_PPS_PHASE && protocol_parse_pps_phase(p->data, p->length, &t, &ticks))
+    {
+        int64_t reported = protocol_timestamp_utc_ns(&t) + ticks * PROTOCOL_TICK_NS;
+        int64_t second = (reported + 500000000LL) / 1000000000LL;
+        double error = (double)(reported - second * 1000000000LL);
+
+        // Pulses must be in order to be used as interpolation nodes
+        if (s->pulse_count && second <= s->pulses[s->pulse_count - 1].second)
+        {
+            s->rejected_pulses++;
+            return;
+        }
+
+        if (s->pulse_count == s->pulse_capacity)
+        {
+            s->pulse_capacity = s->pulse_capacity ? 2 * s->pulse_capacity : 1024;
+            s->pulses = realloc(s->pulses, s->pulse_capacity * sizeof(struct pulse));
+        }
+        s->pulses[s->pulse_count++] = (struct pulse){.second = second, .error_ns = error};
+    }
+    else if (p->type == PACKET_TRIGGER && protocol_parse_trigger(p->data, p->length, &t, &frame))
+    {
+        if (s->trigger_count == s->trigger_capacity)
+        {
+            s->trigger_capacity = s->trigger_capacity ? 2 * s->trigger_capacity : 1024;
+            s->triggers = realloc(s->triggers, s->trigger_capacity * sizeof(struct trigger));
+        }
+        s->triggers[s->trigger_count] = (struct trigger){
+            .frame = frame >= 0 ? (uint64_t)frame : s->trigger_count,
+            .reported_ns = protocol_timestamp_utc_ns(&t)
+        };
+        s->trigger_count++;
+    }
+}
+
+static bool load_stream(const char *path, struct stream *s)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    struct protocol_decoder d;
+    protocol_decoder_init(&d);
+
+    // Accept devreplay recordings or raw captures of the stream
+    char magic[8];
+    if (fread(magic, 1, 8, f) == 8 && !memcmp(magic, RECORD_MAGIC, 8))
+    {
+        struct record_chunk *chunk = malloc(sizeof(struct record_chunk));
+        while (record_read(f, chunk))
+            if (chunk->direction == RECORD_FROM_DEVICE)
+                for (uint16_t i = 0; i < chunk->length; i++)
+                    if (protocol_decode_byte(&d, chunk->data[i]))
+                        add_packet(s, &d.packet);
+        free(chunk);
+    }
+    else
+    {
+        rewind(f);
+        int b;
+        while ((b = fgetc(f)) != EOF)
+            if (protocol_decode_byte(&d, b))
+                add_packet(s, &d.packet);
+    }
+
+    fclose(f);
+    return true;
+}
+
+// Timer error drift rate (ns per second) over the interval between pulses i and i + 1
+static double slope(const struct stream *s, size_t i)
+{
+    return (s->pulses[i + 1].error_ns - s->pulses[i].error_ns) /
+        (double)(s->pulses[i + 1].second - s->pulses[i].second);
+}
+
+/*
+ * Estimate the timer error at reported time t, and its uncertainty
+ * capture_ns is the scatter of a single phase measurement (interrupt latency)
+ * Returns false if there are not enough pulses to refine the time
+ */
+static bool estimate_error(const struct stream *s, int64_t t, double capture_ns, double *error, double *uncertainty)
+{
+    if (s->pulse_count < 2)
+        return false;
+
+    double seconds = t / 1e9;
+
+    // Find the last pulse at or before t (or the first interval if t precedes every pulse)
+    size_t lo = 0, hi = s->pulse_count;
+    while (hi - lo > 1)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (s->pulses[mid].second <= seconds)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    // Extrapolate from the nearest interval beyond the ends of the data
+    size_t i = lo < s->pulse_count - 1 ? lo : s->pulse_count - 2;
+    const struct pulse *a = &s->pulses[i];
+    const struct pulse *b = &s->pulses[i + 1];
+    double span = (double)(b->second - a->second);
+    double x = (seconds - a->second) / span;
+
+    double rate = slope(s, i);
+    *error = a->error_ns + rate * (seconds - a->second);
+
+    // The linear model is wrong by up to span^2/8 times the change in drift
+    // rate per second, estimated from the neighbouring intervals
+    double curvature = 0;
+    if (i > 0)
+        curvature = fmax(curvature, fabs(rate - slope(s, i - 1)));
+    if (i + 2 < s->pulse_count)
+        curvature = fmax(curvature, fabs(slope(s, i + 1) - rate));
+    double model = curvature * span / 8;
+
+    // Measurement scatter, amplified when extrapolating
+    double weight = x < 0 ? 1 - x : (x > 1 ? x : 1);
+    double outside = x < 0 ? -x * span : (x > 1 ? (x - 1) * span : 0);
+    *uncertainty = sqrt(pow(capture_ns * weight, 2) + pow(model + curvature * outside, 2));
+    return true;
+}
+
+static void print_usage()
+{
+    printf("Usage: refine [options] <recording|capture>\n");
+    printf("  -j <us>   scatter of a single phase capture (default 2)\n");
+    printf("Writes one line per trigger, numbered by the timer (or in order for older firmware):\n");
+    printf("  <frame> <reported utc> <refined utc> <correction us> <uncertainty us>\n");
+    printf("Streams without PPS_PHASE packets (e.g. MODE_PULSECOUNTER) are passed\n");
+    printf("through unrefined, with the uncertainty reported as -1.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    double capture_ns = 2000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'j': capture_ns = atof(optarg) * 1000; break;
+            default: print_usage(); return 1;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        print_usage();
+        return 1;
+    }
+
+    struct stream s = {0};
+    if (!load_stream(argv[optind], &s))
+        return 1;
+
+    uint64_t refined = 0;
+    double max_correction = 0, max_uncertainty = 0;
+    for (size_t i = 0; i < s.trigger_count; i++)
+    {
+        const struct trigger *t = &s.triggers[i];
+        double error = 0, uncertainty = -1;
+        if (estimate_error(&s, t->reported_ns, capture_ns, &error, &uncertainty))
+        {
+            refined++;
+            max_correction = fmax(max_correction, fabs(error));
+            max_uncertainty = fmax(max_uncertainty, uncertainty);
+        }
+
+        int64_t corrected = t->reported_ns - (int64_t)llround(error);
+        printf("%llu %lld.%09lld %lld.%09lld %.3f %.3f\n", (unsigned long long)t->frame,
+               (long long)(t->reported_ns / 1000000000LL), (long long)(t->reported_ns % 1000000000LL),
+               (long long)(corrected / 1000000000LL), (long long)(corrected % 1000000000LL),
+               -error / 1000, uncertainty < 0 ? -1 : uncertainty / 1000);
+    }
+
+    fprintf(stderr, "{\"triggers\": %zu, \"refined\": %llu, \"pulses\": %zu, \"rejected_pulses\": %u, "
+            "\"max_correction_us\": %.3f, \"max_uncertainty_us\": %.3f}\n",
+            s.trigger_count, (unsigned long long)refined, s.pulse_count, s.rejected_pulses,
+            max_correction / 1000, max_uncertainty / 1000);
+
+    free(s.pulses);
+    free(s.triggers);
+    return 0;
+}
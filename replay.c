@@ -0,0 +1,232 @@
+//***************************************************************************
+//
+//  File        : replay.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Replays captured GPS streams through gps.c on the host,
+//                comparing the decoded times against golden output
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "gps.h"
+#include "usb.h"
+
+void USART1_RX_vect(void);
+
+// Firmware state referenced by gps.c
+volatile enum timer_status timer_status = TIMER_IDLE;
+volatile enum gps_status gps_status = GPS_UNAVAILABLE;
+
+// Decoder output, one line per event
+static char *output = NULL;
+static size_t output_length = 0;
+static size_t output_capacity = 0;
+static bool record_output = true;
+static uint64_t time_count = 0;
+
+static void emit(const char *fmt, ...)
+{
+    if (!record_output)
+        return;
+
+    char line[512];
+    va_list args;
+    va_start(args, fmt);
+    int length = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    if (length < 0)
+        return;
+    if ((size_t)length >= sizeof(line))
+        length = sizeof(line) - 1;
+
+    if (output_length + length + 1 > output_capacity)
+    {
+        output_capacity = 2 * (output_capacity + length + 1);
+        output = realloc(output, output_capacity);
+    }
+
+    memcpy(output + output_length, line, length + 1);
+    output_length += length;
+}
+
+void set_gps_status(enum gps_status status)
+{
+    gps_status = status;
+}
+
+void set_time(struct timestamp *t)
+{
+    time_count++;
+    emit("time %04u-%02u-%02u %02u:%02u:%02u flags 0x%02x utc_offset %d\n",
+         t->year, t->month, t->day, t->hours, t->minutes, t->seconds, t->flags, t->utc_offset);
+}
+
+void usb_send_message_fmt_P(const char *fmt, ...)
+{
+    char msg[200];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+
+    emit("message %s\n", msg);
+}
+
+void usb_send_raw(uint8_t *data, uint8_t length)
+{
+    char hex[3 * 256 + 1];
+    for (uint8_t i = 0; i < length; i++)
+        sprintf(hex + 3 * i, " %02x", data[i]);
+    hex[3 * length] = '\0';
+    emit("raw%s\n", hex);
+}
+
+void usb_send_byte(uint8_t b)
+{
+    (void)b;
+}
+
+// Deliver each byte through the receive interrupt, then let the main loop parse it
+static void replay(const uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        UDR1 = data[i];
+        USART1_RX_vect();
+        gps_tick();
+    }
+}
+
+static uint8_t *read_file(const char *path, size_t *length)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    uint8_t *data = malloc(size + 1);
+    *length = fread(data, 1, size, f);
+    data[*length] = '\0';
+    fclose(f);
+    return data;
+}
+
+// Print the first line that differs from the golden output
+static bool compare(const char *actual, const char *expected)
+{
+    unsigned line = 1;
+    while (*actual || *expected)
+    {
+        const char *a_end = strchr(actual, '\n');
+        const char *e_end = strchr(expected, '\n');
+        size_t a_len = a_end ? (size_t)(a_end - actual) : strlen(actual);
+        size_t e_len = e_end ? (size_t)(e_end - expected) : strlen(expected);
+
+        if (a_len != e_len || memcmp(actual, expected, a_len))
+        {
+            fprintf(stderr, "line %u differs:\n  expected: %.*s\n  actual:   %.*s\n",
+                    line, (int)e_len, expected, (int)a_len, actual);
+            return false;
+        }
+
+        actual += a_len + (a_end ? 1 : 0);
+        expected += e_len + (e_end ? 1 : 0);
+        line++;
+    }
+
+    return true;
+}
+
+static void print_usage()
+{
+    printf("Usage: replay [-n iterations] <capture> [golden output]\n");
+    printf("  Without a golden file the decoder output is printed to stdout.\n");
+    printf("  -n runs the capture repeatedly and reports parser throughput.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned iterations = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:")) != -1)
+    {
+        switch (c)
+        {
+            case 'n': iterations = atoi(optarg); break;
+            default: print_usage(); return 1;
+        }
+    }
+
+    if (argc - optind < 1 || argc - optind > 2)
+    {
+        print_usage();
+        return 1;
+    }
+
+    size_t length;
+    uint8_t *capture = read_file(argv[optind], &length);
+    if (!capture)
+    {
+        fprintf(stderr, "Failed to read capture: %s\n", argv[optind]);
+        return 1;
+    }
+
+    if (iterations)
+    {
+        record_output = false;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (unsigned i = 0; i < iterations; i++)
+            replay(capture, length);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+        printf("{\"capture\":\"%s\",\"bytes\":%llu,\"times\":%llu,\"seconds\":%.6f,"
+               "\"bytes_per_second\":%.0f,\"times_per_second\":%.0f}\n", argv[optind],
+               (unsigned long long)length * iterations, (unsigned long long)time_count, elapsed,
+               length * iterations / elapsed, time_count / elapsed);
+        free(capture);
+        return 0;
+    }
+
+    replay(capture, length);
+    free(capture);
+
+    if (argc - optind == 1)
+    {
+        if (output)
+            fputs(output, stdout);
+        free(output);
+        return 0;
+    }
+
+    size_t golden_length;
+    char *golden = (char *)read_file(argv[optind + 1], &golden_length);
+    if (!golden)
+    {
+        fprintf(stderr, "Failed to read golden output: %s\n", argv[optind + 1]);
+        free(output);
+        return 1;
+    }
+
+    bool match = compare(output ? output : "", golden);
+    printf("%s: %s\n", argv[optind], match ? "ok" : "FAILED");
+    free(golden);
+    free(output);
+    return match ? 0 : 1;
+}
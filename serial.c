@@ -0,0 +1,153 @@
+//***************************************************************************
+//
+//  File        : serial.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Serial port and pseudo-terminal helpers for the host tools
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "serial.h"
+
+static speed_t baud_constant(unsigned baud)
+{
+    switch (baud)
+    {
+        case 1200: return B1200;
+        case 2400: return B2400;
+        case 4800: return B4800;
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+        default: return 0;
+    }
+}
+
+static bool configure_raw(int fd, unsigned baud)
+{
+    struct termios t;
+    if (tcgetattr(fd, &t))
+        return false;
+
+    cfmakeraw(&t);
+    t.c_cflag |= CLOCAL | CREAD;
+    t.c_cc[VMIN] = 1;
+    t.c_cc[VTIME] = 0;
+
+    if (baud)
+    {
+        speed_t speed = baud_constant(baud);
+        if (!speed)
+        {
+            fprintf(stderr, "Unsupported baud rate: %u\n", baud);
+            return false;
+        }
+
+        cfsetispeed(&t, speed);
+        cfsetospeed(&t, speed);
+    }
+
+    return tcsetattr(fd, TCSANOW, &t) == 0;
+}
+
+/*
+ * Open a serial port in raw 8N1 mode
+ * Returns the file descriptor, or -1 on failure
+ */
+int serial_open(const char *path, unsigned baud)
+{
+    int fd = open(path, O_RDWR | O_NOCTTY);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Failed to open port %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (!configure_raw(fd, baud))
+    {
+        fprintf(stderr, "Failed to configure port %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Create a pseudo-terminal in raw mode, for tools that stand in for hardware
+ * The slave path (to be opened by the software under test) is copied to name
+ * Returns the master file descriptor, or -1 on failure
+ */
+int serial_open_pty(char *name, size_t name_length)
+{
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd == -1 || grantpt(fd) || unlockpt(fd) || ptsname_r(fd, name, name_length))
+    {
+        fprintf(stderr, "Failed to create pty: %s\n", strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    // Configure the slave side so that clients see an unmodified byte stream
+    int slave = open(name, O_RDWR | O_NOCTTY);
+    if (slave == -1 || !configure_raw(slave, 0))
+    {
+        fprintf(stderr, "Failed to configure pty %s\n", name);
+        if (slave != -1)
+            close(slave);
+        close(fd);
+        return -1;
+    }
+
+    // Keep the slave open so that the master doesn't see EIO when clients reconnect
+    return fd;
+}
+
+// Set or clear a modem control line (TIOCM_DTR, TIOCM_RTS)
+bool serial_set_line(int fd, int line, bool enabled)
+{
+    return ioctl(fd, enabled ? TIOCMBIS : TIOCMBIC, &line) == 0;
+}
+
+bool serial_write_all(int fd, const uint8_t *data, size_t length)
+{
+    while (length)
+    {
+        ssize_t written = write(fd, data, length);
+        if (written < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return false;
+        }
+
+        data += written;
+        length -= written;
+    }
+
+    return true;
+}
+
+int64_t serial_time_ns(int clock)
+{
+    struct timespec t;
+    clock_gettime(clock, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
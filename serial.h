@@ -0,0 +1,29 @@
+//***************************************************************************
+//
+//  File        : serial.h
+//  Copyright   : 2013 Paul Chote
+//  Description : Serial port and pseudo-terminal helpers for the host tools
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#ifndef KARAKA_SERIAL_H
+#define KARAKA_SERIAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Line rate used by the firmware for both the USB and GPS links
+#define SERIAL_DEFAULT_BAUD 9600
+
+int serial_open(const char *path, unsigned baud);
+int serial_open_pty(char *name, size_t name_length);
+bool serial_set_line(int fd, int line, bool enabled);
+bool serial_write_all(int fd, const uint8_t *data, size_t length);
+int64_t serial_time_ns(int clock);
+
+#endif
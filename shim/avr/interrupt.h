@@ -0,0 +1,22 @@
+//***************************************************************************
+//
+//  File        : shim/avr/interrupt.h
+//  Copyright   : 2013 Paul Chote
+//  Description : Interrupt handlers become plain functions on the host
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#ifndef KARAKA_SHIM_INTERRUPT_H
+#define KARAKA_SHIM_INTERRUPT_H
+
+#include <avr/io.h>
+
+#define ISR(vector, ...) void vector(void); void vector(void)
+#define sei()
+#define cli()
+
+#endif
@@ -0,0 +1,69 @@
+//***************************************************************************
+//
+//  File        : shim/avr/io.h
+//  Copyright   : 2013 Paul Chote
+//  Description : Minimal stand-in for avr-libc's register definitions,
+//                allowing firmware sources to be compiled for the host
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#ifndef KARAKA_SHIM_IO_H
+#define KARAKA_SHIM_IO_H
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+#define bit_is_set(sfr, bit) ((sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit) (!((sfr) & _BV(bit)))
+#define loop_until_bit_is_set(sfr, bit) do { } while (bit_is_clear(sfr, bit))
+
+// Registers are plain variables, defined in shim.c
+extern volatile uint8_t TCCR1A, TCCR1B, TCCR2A, TCCR2B, TIMSK2, OCR2A;
+extern volatile uint8_t UBRR1H, UBRR1L, UCSR1A, UCSR1B, UDR1;
+extern volatile uint8_t DDRA, PORTA, PINA, DDRB, PORTB, DDRC, PORTC, DDRD, PIND;
+extern volatile uint8_t SPCR, SPSR, SPDR, ADCSRA, ADMUX, ADCH;
+
+// Bit positions
+#define WGM12  3
+#define CS10   0
+#define WGM21  1
+#define CS20   0
+#define CS21   1
+#define CS22   2
+#define OCIE2A 1
+#define U2X0   1
+#define RXCIE1 7
+#define UDRIE1 5
+#define RXEN1  4
+#define TXEN1  3
+
+// Display (display.c)
+#define PA7    7
+#define PB1    1
+#define PB2    2
+#define PB3    3
+#define PB4    4
+#define PC0    0
+#define PC1    1
+#define PC6    6
+#define PD7    7
+#define SPIF   7
+#define SPE    6
+#define DORD   5
+#define MSTR   4
+#define SPR0   0
+#define SPI2X  0
+#define ADEN   7
+#define ADSC   6
+#define ADATE  5
+#define ADIE   3
+#define ADPS2  2
+#define ADPS1  1
+#define ADPS0  0
+#define ADLAR  5
+
+#endif
@@ -0,0 +1,30 @@
+//***************************************************************************
+//
+//  File        : shim/avr/pgmspace.h
+//  Copyright   : 2013 Paul Chote
+//  Description : Program memory is ordinary memory on the host
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#ifndef KARAKA_SHIM_PGMSPACE_H
+#define KARAKA_SHIM_PGMSPACE_H
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define strlen_P strlen
+#define memcpy_P memcpy
+#define strncpy_P strncpy
+#define vsprintf_P vsprintf
+#define vsnprintf_P vsnprintf
+
+#endif
@@ -0,0 +1,21 @@
+//***************************************************************************
+//
+//  File        : shim/shim.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Storage for the register stand-ins declared in shim/avr/io.h
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <avr/io.h>
+
+volatile uint8_t TCCR1A, TCCR1B, TCCR2A, TCCR2B, TIMSK2, OCR2A;
+volatile uint8_t UBRR1H, UBRR1L, UCSR1A, UCSR1B, UDR1;
+volatile uint8_t DDRA, PORTA, PINA, DDRB, PORTB, DDRC, PORTC, DDRD, PIND;
+volatile uint8_t SPCR, SPDR, ADCSRA, ADMUX, ADCH;
+
+// Transfers complete immediately
+volatile uint8_t SPSR = _BV(SPIF);
@@ -0,0 +1,22 @@
+//***************************************************************************
+//
+//  File        : shim/util/atomic.h
+//  Copyright   : 2013 Paul Chote
+//  Description : Host code is single threaded, so atomic blocks run once
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#ifndef KARAKA_SHIM_ATOMIC_H
+#define KARAKA_SHIM_ATOMIC_H
+
+#include <avr/interrupt.h>
+
+#define ATOMIC_FORCEON
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(type) for (uint8_t __done = 0; !__done; __done = 1)
+
+#endif
@@ -0,0 +1,19 @@
+//***************************************************************************
+//
+//  File        : shim/util/delay.h
+//  Copyright   : 2013 Paul Chote
+//  Description : Busy-wait delays, which have nothing to wait for on the host
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#ifndef KARAKA_SHIM_DELAY_H
+#define KARAKA_SHIM_DELAY_H
+
+#define _delay_us(us) ((void)(us))
+#define _delay_ms(ms) ((void)(ms))
+
+#endif
@@ -0,0 +1,15 @@
+//***************************************************************************
+//
+//  File        : shim/util/setbaud.h
+//  Copyright   : 2013 Paul Chote
+//  Description : Baud rate register values for 9600 baud at 10MHz
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#define UBRRH_VALUE 0
+#define UBRRL_VALUE 64
+#define USE_2X 0
@@ -0,0 +1,265 @@
+//***************************************************************************
+//
+//  File        : sim.c
+//  Copyright   : 2013 Paul Chote
+//  Description : simavr peripheral models for running main.elf on the host
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/avr_ioport.h>
+#include <simavr/avr_uart.h>
+#include <simavr/avr_spi.h>
+#include "sim.h"
+
+static void push_event(struct sim *sim, struct sim_event *e)
+{
+    if (sim->event_count == sim->event_capacity)
+    {
+        sim->event_capacity = sim->event_capacity ? 2 * sim->event_capacity : 64;
+        sim->events = realloc(sim->events, sim->event_capacity * sizeof(struct sim_event));
+    }
+
+    // Sift up
+    uint32_t i = sim->event_count++;
+    while (i > 0 && sim->events[(i - 1) / 2].cycle > e->cycle)
+    {
+        sim->events[i] = sim->events[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    sim->events[i] = *e;
+}
+
+static void pop_event(struct sim *sim, struct sim_event *e)
+{
+    *e = sim->events[0];
+    struct sim_event last = sim->events[--sim->event_count];
+
+    // Sift down
+    uint32_t i = 0;
+    for (;;)
+    {
+        uint32_t child = 2 * i + 1;
+        if (child >= sim->event_count)
+            break;
+        if (child + 1 < sim->event_count && sim->events[child + 1].cycle < sim->events[child].cycle)
+            child++;
+        if (last.cycle <= sim->events[child].cycle)
+            break;
+        sim->events[i] = sim->events[child];
+        i = child;
+    }
+    sim->events[i] = last;
+}
+
+static void fire_event(struct sim *sim, struct sim_event *e)
+{
+    switch (e->type)
+    {
+        case SIM_EVENT_PPS:
+            avr_raise_irq(sim->pps_pin, e->data[0]);
+            break;
+        case SIM_EVENT_MONITOR:
+            avr_raise_irq(sim->monitor_pin, e->data[0]);
+            break;
+        case SIM_EVENT_GPS:
+            // The UART model paces delivery at the configured baud rate
+            for (uint8_t i = 0; i < e->length; i++)
+                avr_raise_irq(sim->gps_rx, e->data[i]);
+            sim->gps_bytes += e->length;
+            break;
+        case SIM_EVENT_USB:
+            for (uint8_t i = 0; i < e->length; i++)
+                avr_raise_irq(sim->usb_rx, e->data[i]);
+            break;
+    }
+}
+
+static void usb_output(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    (void)irq;
+    struct sim *sim = param;
+    sim->usb_bytes++;
+    if (protocol_decode_byte(&sim->usb_decoder, value) && sim->packet_cb)
+        sim->packet_cb(sim, &sim->usb_decoder.packet, sim->cb_param);
+}
+
+static void spi_output(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    (void)irq;
+    (void)value;
+    ((struct sim *)param)->spi_bytes++;
+}
+
+/*
+ * Camera model: the trigger output (PD5) is driven high for the
+ * duration of each trigger pulse
+ */
+static void trigger_output(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    (void)irq;
+    struct sim *sim = param;
+    if (!value)
+        return;
+
+    sim->triggers++;
+    if (sim->trigger_cb)
+        sim->trigger_cb(sim, sim->avr->cycle, sim->cb_param);
+
+    if (sim->readout_cycles)
+    {
+        sim_monitor(sim, sim->avr->cycle + 1, true);
+        sim_monitor(sim, sim->avr->cycle + sim->readout_cycles, false);
+    }
+}
+
+static void disable_uart_stdio(avr_t *avr, char uart)
+{
+    uint32_t flags = 0;
+    avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS(uart), &flags);
+    flags &= ~AVR_UART_FLAG_STDIO;
+    avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS(uart), &flags);
+}
+
+bool sim_initialize(struct sim *sim, const char *firmware)
+{
+    memset(sim, 0, sizeof(struct sim));
+
+    elf_firmware_t f;
+    memset(&f, 0, sizeof(f));
+    if (elf_read_firmware(firmware, &f))
+    {
+        fprintf(stderr, "Failed to read firmware: %s\n", firmware);
+        return false;
+    }
+
+    sim->avr = avr_make_mcu_by_name("atmega1284p");
+    if (!sim->avr)
+    {
+        fprintf(stderr, "simavr does not support atmega1284p\n");
+        return false;
+    }
+
+    avr_init(sim->avr);
+    sim->avr->log = LOG_ERROR;
+    f.frequency = SIM_FREQUENCY;
+    avr_load_firmware(sim->avr, &f);
+
+    sim->pps_pin = avr_io_getirq(sim->avr, AVR_IOCTL_IOPORT_GETIRQ('D'), IOPORT_IRQ_PIN4);
+    sim->trigger_pin = avr_io_getirq(sim->avr, AVR_IOCTL_IOPORT_GETIRQ('D'), IOPORT_IRQ_PIN5);
+    sim->monitor_pin = avr_io_getirq(sim->avr, AVR_IOCTL_IOPORT_GETIRQ('D'), IOPORT_IRQ_PIN6);
+    sim->usb_rx = avr_io_getirq(sim->avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+    sim->gps_rx = avr_io_getirq(sim->avr, AVR_IOCTL_UART_GETIRQ('1'), UART_IRQ_INPUT);
+
+    avr_irq_register_notify(avr_io_getirq(sim->avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT),
+                            usb_output, sim);
+    avr_irq_register_notify(avr_io_getirq(sim->avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_OUTPUT),
+                            spi_output, sim);
+    avr_irq_register_notify(sim->trigger_pin, trigger_output, sim);
+
+    disable_uart_stdio(sim->avr, '0');
+    disable_uart_stdio(sim->avr, '1');
+    protocol_decoder_init(&sim->usb_decoder);
+
+    // The input buffer inverts the GPS pulse, so the idle level is high.
+    // The camera monitor line idles high (busy) until the camera is started
+    avr_raise_irq(sim->pps_pin, 1);
+    avr_raise_irq(sim->monitor_pin, 1);
+    return true;
+}
+
+void sim_free(struct sim *sim)
+{
+    if (sim->avr)
+        avr_terminate(sim->avr);
+    free(sim->events);
+    sim->events = NULL;
+}
+
+/*
+ * Schedule a GPS time pulse starting at cycle
+ * The firmware acts on the trailing edge, width cycles later
+ */
+void sim_pps(struct sim *sim, avr_cycle_count_t cycle, avr_cycle_count_t width)
+{
+    struct sim_event e = {.cycle = cycle, .type = SIM_EVENT_PPS, .data = {0}};
+    push_event(sim, &e);
+    e.cycle = cycle + width;
+    e.data[0] = 1;
+    push_event(sim, &e);
+}
+
+// Schedule a change of the camera monitor line (high = busy)
+void sim_monitor(struct sim *sim, avr_cycle_count_t cycle, bool busy)
+{
+    struct sim_event e = {.cycle = cycle, .type = SIM_EVENT_MONITOR, .data = {busy ? 1 : 0}};
+    push_event(sim, &e);
+}
+
+static void queue_serial(struct sim *sim, avr_cycle_count_t cycle, enum sim_event_type type,
+                         const uint8_t *data, uint8_t length)
+{
+    // Split long transfers so that each fits the simulated UART fifo
+    while (length)
+    {
+        struct sim_event e = {.cycle = cycle, .type = type};
+        e.length = length > SIM_EVENT_DATA_LENGTH ? SIM_EVENT_DATA_LENGTH : length;
+        memcpy(e.data, data, e.length);
+        push_event(sim, &e);
+
+        // 10 bits per byte at 9600 baud
+        cycle += e.length * (SIM_FREQUENCY * 10 / 9600);
+        data += e.length;
+        length -= e.length;
+    }
+}
+
+void sim_gps_send(struct sim *sim, avr_cycle_count_t cycle, const uint8_t *data, uint8_t length)
+{
+    queue_serial(sim, cycle, SIM_EVENT_GPS, data, length);
+}
+
+void sim_usb_send(struct sim *sim, avr_cycle_count_t cycle, const uint8_t *data, uint8_t length)
+{
+    queue_serial(sim, cycle, SIM_EVENT_USB, data, length);
+}
+
+/*
+ * Execute instructions until the cycle counter reaches until,
+ * firing scheduled stimulus and calling step after each instruction
+ * Returns false if the simulated cpu stopped or crashed
+ */
+bool sim_run(struct sim *sim, avr_cycle_count_t until, sim_step_cb step, void *param)
+{
+    while (sim->avr->cycle < until)
+    {
+        while (sim->event_count && sim->events[0].cycle <= sim->avr->cycle)
+        {
+            struct sim_event e;
+            pop_event(sim, &e);
+            fire_event(sim, &e);
+        }
+
+        int state = avr_run(sim->avr);
+        if (state == cpu_Done || state == cpu_Crashed)
+            return false;
+
+        if (step)
+            step(sim, param);
+    }
+
+    return true;
+}
+
+uint16_t sim_sp(struct sim *sim)
+{
+    return sim->avr->data[R_SPL] | (sim->avr->data[R_SPH] << 8);
+}
@@ -0,0 +1,87 @@
+//***************************************************************************
+//
+//  File        : sim.h
+//  Copyright   : 2013 Paul Chote
+//  Description : simavr peripheral models for running main.elf on the host
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#ifndef KARAKA_SIM_H
+#define KARAKA_SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <simavr/sim_avr.h>
+#include "protocol.h"
+
+#define SIM_FREQUENCY 10000000UL
+#define SIM_EVENT_DATA_LENGTH 64
+
+enum sim_event_type
+{
+    SIM_EVENT_PPS,
+    SIM_EVENT_MONITOR,
+    SIM_EVENT_GPS,
+    SIM_EVENT_USB,
+};
+
+struct sim_event
+{
+    avr_cycle_count_t cycle;
+    enum sim_event_type type;
+    uint8_t length;
+    uint8_t data[SIM_EVENT_DATA_LENGTH];
+};
+
+struct sim;
+typedef void (*sim_packet_cb)(struct sim *sim, const struct protocol_packet *p, void *param);
+typedef void (*sim_trigger_cb)(struct sim *sim, avr_cycle_count_t cycle, void *param);
+typedef void (*sim_step_cb)(struct sim *sim, void *param);
+
+struct sim
+{
+    avr_t *avr;
+
+    avr_irq_t *pps_pin;
+    avr_irq_t *monitor_pin;
+    avr_irq_t *trigger_pin;
+    avr_irq_t *gps_rx;
+    avr_irq_t *usb_rx;
+
+    // Pending stimulus, stored as a binary heap ordered by cycle
+    struct sim_event *events;
+    uint32_t event_count;
+    uint32_t event_capacity;
+
+    // Camera model: when enabled, every trigger pulse holds the
+    // monitor line busy for readout_cycles (0 disables the model)
+    avr_cycle_count_t readout_cycles;
+
+    // Device output
+    struct protocol_decoder usb_decoder;
+    sim_packet_cb packet_cb;
+    sim_trigger_cb trigger_cb;
+    void *cb_param;
+
+    uint64_t usb_bytes;
+    uint64_t gps_bytes;
+    uint64_t spi_bytes;
+    uint64_t triggers;
+};
+
+bool sim_initialize(struct sim *sim, const char *firmware);
+void sim_free(struct sim *sim);
+
+void sim_pps(struct sim *sim, avr_cycle_count_t cycle, avr_cycle_count_t width);
+void sim_monitor(struct sim *sim, avr_cycle_count_t cycle, bool busy);
+void sim_gps_send(struct sim *sim, avr_cycle_count_t cycle, const uint8_t *data, uint8_t length);
+void sim_usb_send(struct sim *sim, avr_cycle_count_t cycle, const uint8_t *data, uint8_t length);
+
+bool sim_run(struct sim *sim, avr_cycle_count_t until, sim_step_cb step, void *param);
+uint16_t sim_sp(struct sim *sim);
+
+#endif
@@ -0,0 +1,423 @@
+//***************************************************************************
+//
+//  File        : stress.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Sweeps interrupt timing against the main loop under simavr
+//                and checks the reported triggers for shared-state races
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "protocol.h"
+#include "receiver.h"
+
+// UTC time of simulated second 0
+#define START_TIME 1356998400
+
+/*
+ * The main loop and the interrupt handlers share message_flags, the
+ * exposure counters and download_timestamp/download_frame. A race only
+ * shows when an interrupt lands on a particular instruction, so each
+ * second the stimulus is moved by one cycle relative to the last:
+ *
+ *  - the time pulse, by up to pulse_window cycles (the firmware
+ *    resynchronises to it, so this moves every timer interrupt)
+ *  - the GPS packet, by up to window cycles, which moves set_time() and
+ *    the rest of the main loop against the millisecond interrupt
+ *  - optionally a LINK_STATS request, which moves the receive interrupt
+ *    and parse_packet() against the same
+ *
+ * Over window seconds, every instruction boundary in a window-cycle
+ * stretch of main loop code sees each interrupt. With a seed, the offsets
+ * are drawn at random from the same ranges instead.
+ *
+ * The crystal is exact, so any disagreement in the reports is a fault:
+ *  - frame numbers must increase by a constant stride, changing only
+ *    when a FORECAST announces a new schedule (else a report was lost)
+ *  - every report must lie on the exposure grid, with a time and frame
+ *    number taken from the same exposure (else the read was torn)
+ *  - every report must be within tolerance of its trigger pulse
+ *  - TIMESTAMP packets must advance by exactly one second
+ *  - no INTEGRITY packets or pulse warnings
+ */
+struct config
+{
+    unsigned seconds;
+    uint16_t pulsecounter_exposure;
+    uint16_t highres_exposure;
+    uint8_t stride;
+
+    avr_cycle_count_t window;
+    avr_cycle_count_t pulse_window;
+    double serial_latency_ms;
+    bool usb_traffic;
+    double tolerance_us;
+    bool verbose;
+
+    // 0 sweeps the offsets in single cycles
+    uint64_t seed;
+};
+
+struct run
+{
+    const struct config *config;
+    enum protocol_timing_mode mode;
+    int64_t period_ns;
+
+    avr_cycle_count_t *pulses;
+    uint32_t pulse_count;
+    uint32_t pulse_capacity;
+
+    // The first report fixes the grid and the pulse numbering
+    bool have_first;
+    uint32_t first_frame;
+    uint32_t first_pulse;
+    int64_t first_ns;
+
+    uint32_t last_frame;
+    uint32_t last_gap;
+    uint8_t revision;
+    bool revision_changed;
+    bool gap_suspect;
+
+    bool have_timestamp;
+    int64_t last_timestamp_ns;
+
+    uint32_t reports;
+    uint32_t timestamps;
+    uint32_t duplicate_reports;
+    uint32_t irregular_reports;
+    uint32_t grid_errors;
+    uint32_t time_errors;
+    uint32_t orphan_reports;
+    uint32_t timestamp_jumps;
+    uint32_t integrity_events;
+    uint32_t warnings;
+};
+
+static uint64_t rng_state;
+
+static uint64_t random_next()
+{
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+// Offset of the stimulus in second i, within [0, range)
+static avr_cycle_count_t sweep(const struct config *c, unsigned i, avr_cycle_count_t range)
+{
+    if (!range)
+        return 0;
+
+    return c->seed ? random_next() % range : i % range;
+}
+
+static void fault(struct run *r, const char *what, uint32_t frame, int64_t detail)
+{
+    if (r->config->verbose)
+        printf("%s frame=%u detail=%lld\n", what, frame, (long long)detail);
+}
+
+static void trigger_pulse(struct sim *sim, avr_cycle_count_t cycle, void *param)
+{
+    (void)sim;
+    struct run *r = param;
+    if (r->pulse_count == r->pulse_capacity)
+    {
+        r->pulse_capacity = r->pulse_capacity ? 2 * r->pulse_capacity : 1024;
+        r->pulses = realloc(r->pulses, r->pulse_capacity * sizeof(avr_cycle_count_t));
+    }
+    r->pulses[r->pulse_count++] = cycle;
+}
+
+static void check_trigger(struct run *r, const struct protocol_packet *p)
+{
+    struct protocol_timestamp t;
+    int64_t frame;
+    if (!protocol_parse_trigger(p->data, p->length, &t, &frame) || frame < 0)
+        return;
+
+    int64_t reported = protocol_timestamp_utc_ns(&t);
+    r->reports++;
+
+    if (!r->have_first)
+    {
+        // Pair the first report with the pulse that preceded it
+        if (!r->pulse_count)
+        {
+            r->orphan_reports++;
+            fault(r, "orphan", frame, 0);
+            return;
+        }
+
+        r->have_first = true;
+        r->first_frame = r->last_frame = frame;
+        r->first_pulse = r->pulse_count - 1;
+        r->first_ns = reported;
+    }
+    else
+    {
+        if (frame <= r->last_frame)
+        {
+            r->duplicate_reports++;
+            fault(r, "duplicate", frame, r->last_frame);
+            return;
+        }
+
+        // A stride change must be explained by a new forecast revision,
+        // which may arrive just after the first report at the new stride
+        if (r->gap_suspect)
+        {
+            r->irregular_reports++;
+            fault(r, "irregular", r->last_frame, r->last_gap);
+            r->gap_suspect = false;
+        }
+
+        uint32_t gap = frame - r->last_frame;
+        if (r->last_gap && gap != r->last_gap && !r->revision_changed)
+            r->gap_suspect = true;
+
+        r->revision_changed = false;
+        r->last_gap = gap;
+        r->last_frame = frame;
+    }
+
+    int64_t expected = r->first_ns + (int64_t)(frame - r->first_frame) * r->period_ns;
+    if (reported != expected)
+    {
+        r->grid_errors++;
+        fault(r, "grid", frame, reported - expected);
+    }
+
+    uint64_t pulse = r->first_pulse + (uint64_t)(frame - r->first_frame);
+    if (pulse >= r->pulse_count)
+    {
+        r->orphan_reports++;
+        fault(r, "orphan", frame, pulse);
+        return;
+    }
+
+    int64_t actual = START_TIME * 1000000000LL + (int64_t)(r->pulses[pulse] * (1000000000.0 / SIM_FREQUENCY));
+    int64_t error = reported - actual;
+    if (llabs(error) > (int64_t)(r->config->tolerance_us * 1000))
+    {
+        r->time_errors++;
+        fault(r, "time", frame, error);
+    }
+}
+
+static void packet_received(struct sim *sim, const struct protocol_packet *p, void *param)
+{
+    (void)sim;
+    struct run *r = param;
+
+    struct protocol_timestamp t;
+    struct protocol_forecast f;
+    switch (p->type)
+    {
+        case PACKET_TRIGGER:
+            check_trigger(r, p);
+            break;
+        case PACKET_TIMESTAMP:
+            if (!protocol_parse_timestamp(p->data, p->length, &t))
+                break;
+
+            // Only the whole seconds are compared
+            t.milliseconds = 0;
+            int64_t ns = protocol_timestamp_utc_ns(&t);
+            if (r->have_timestamp && ns != r->last_timestamp_ns + 1000000000LL)
+            {
+                r->timestamp_jumps++;
+                fault(r, "timestamp", 0, ns - r->last_timestamp_ns);
+            }
+
+            r->timestamps++;
+            r->have_timestamp = true;
+            r->last_timestamp_ns = ns;
+            break;
+        case PACKET_FORECAST:
+            if (protocol_parse_forecast(p->data, p->length, &f) && f.revision != r->revision)
+            {
+                r->revision = f.revision;
+                r->revision_changed = !r->gap_suspect;
+                r->gap_suspect = false;
+            }
+            break;
+        case PACKET_INTEGRITY:
+            r->integrity_events++;
+            fault(r, "integrity", 0, 0);
+            break;
+        case PACKET_MESSAGE:
+            // The first data byte is the string length
+            if (p->length > 8 && !memcmp(&p->data[1], "WARNING", 7))
+            {
+                r->warnings++;
+                if (r->config->verbose)
+                    printf("%.*s\n", p->data[0], &p->data[1]);
+            }
+            break;
+    }
+}
+
+static uint32_t faults(const struct run *r)
+{
+    return r->duplicate_reports + r->irregular_reports + r->grid_errors + r->time_errors +
+        r->orphan_reports + r->timestamp_jumps + r->integrity_events + r->warnings;
+}
+
+static void report(const char *mode, uint16_t exposure, const struct run *r)
+{
+    // Reports still expected at the end of the run are not counted as lost
+    printf("{\"mode\":\"%s\",\"exposure\":%u,\"triggers\":%u,\"reports\":%u,\"timestamps\":%u,"
+           "\"duplicate_reports\":%u,\"irregular_reports\":%u,\"grid_errors\":%u,\"time_errors\":%u,"
+           "\"orphan_reports\":%u,\"timestamp_jumps\":%u,\"integrity_events\":%u,\"warnings\":%u,"
+           "\"faults\":%u}\n", mode, exposure, r->pulse_count, r->reports, r->timestamps,
+           r->duplicate_reports, r->irregular_reports, r->grid_errors, r->time_errors,
+           r->orphan_reports, r->timestamp_jumps, r->integrity_events, r->warnings, faults(r));
+}
+
+/*
+ * Returns 0 if the run completed without faults, 1 if the simulation
+ * failed, or 2 if any invariant was broken
+ */
+static int run_mode(const char *firmware, const struct config *c, enum protocol_timing_mode mode)
+{
+    uint16_t exposure = mode == PROTOCOL_MODE_HIGHRES ? c->highres_exposure : c->pulsecounter_exposure;
+    double exposure_seconds = mode == PROTOCOL_MODE_HIGHRES ? exposure / 1000.0 : exposure;
+
+    struct run r = {
+        .config = c,
+        .mode = mode,
+        .period_ns = (int64_t)(exposure_seconds * 1e9)
+    };
+    rng_state = c->seed ? c->seed : 1;
+
+    struct sim sim;
+    if (!sim_initialize(&sim, firmware))
+        return 1;
+
+    sim.packet_cb = packet_received;
+    sim.trigger_cb = trigger_pulse;
+    sim.cb_param = &r;
+
+    uint8_t buf[PROTOCOL_MAX_PACKET_LENGTH];
+    size_t length = protocol_encode_start_exposure(buf, true, mode, exposure, c->stride, false,
+                                                   PROTOCOL_EXTERNAL_START_NONE);
+    sim_usb_send(&sim, SIM_FREQUENCY / 2, buf, length);
+    sim_monitor(&sim, SIM_FREQUENCY * 3 / 4, false);
+    sim.readout_cycles = (avr_cycle_count_t)(exposure_seconds * SIM_FREQUENCY * 0.3);
+
+    uint8_t stats[PROTOCOL_MAX_PACKET_LENGTH];
+    size_t stats_length = protocol_encode(stats, PACKET_LINK_STATS, NULL, 0);
+
+    avr_cycle_count_t latency = (avr_cycle_count_t)(c->serial_latency_ms * 1e-3 * SIM_FREQUENCY);
+    for (unsigned i = 1; i <= c->seconds; i++)
+    {
+        avr_cycle_count_t second = (avr_cycle_count_t)i * SIM_FREQUENCY;
+        avr_cycle_count_t pulse = second + sweep(c, i, c->pulse_window);
+        sim_pps(&sim, pulse, SIM_FREQUENCY / 100000);
+
+        uint8_t packet[RECEIVER_MAX_PACKET_LENGTH];
+        length = receiver_encode_trimble(packet, START_TIME + i, 16, TRIMBLE_UTC_TIME | TRIMBLE_UTC_PPS);
+        sim_gps_send(&sim, pulse + latency + sweep(c, i, c->window), packet, length);
+
+        // Half a second later, clear of the GPS packet
+        if (c->usb_traffic)
+            sim_usb_send(&sim, second + SIM_FREQUENCY / 2 + sweep(c, i, c->window), stats, stats_length);
+    }
+
+    int status = 1;
+    if (sim_run(&sim, (avr_cycle_count_t)(c->seconds + 1) * SIM_FREQUENCY, NULL, NULL))
+    {
+        report(mode == PROTOCOL_MODE_HIGHRES ? "highres" : "pulsecounter", exposure, &r);
+        status = faults(&r) || !r.reports ? 2 : 0;
+    }
+    else
+        fprintf(stderr, "Simulation stopped unexpectedly at cycle %llu\n",
+                (unsigned long long)sim.avr->cycle);
+
+    sim_free(&sim);
+    free(r.pulses);
+    return status;
+}
+
+static void print_usage()
+{
+    printf("Usage: stress [options] <main.elf>\n");
+    printf("  -m <mode>     pulsecounter, highres or both (default both)\n");
+    printf("  -s <seconds>  simulated duration (default 600)\n");
+    printf("  -p <s>        pulse counter exposure in seconds (default 1)\n");
+    printf("  -h <ms>       high resolution exposure in milliseconds (default 50)\n");
+    printf("  -t <stride>   trigger stride (default 1)\n");
+    printf("  -w <cycles>   sweep range for the serial stimulus (default 600)\n");
+    printf("  -W <cycles>   sweep range for the time pulse (default 200)\n");
+    printf("  -l <ms>       GPS packet latency after the pulse (default 50)\n");
+    printf("  -u            also send a LINK_STATS request every second\n");
+    printf("  -e <us>       largest accepted trigger time error (default 100)\n");
+    printf("  -r <seed>     random offsets instead of a sweep\n");
+    printf("  -v            print each fault\n");
+    printf("Exits with status 2 if any invariant was broken.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct config c = {
+        .seconds = 600,
+        .pulsecounter_exposure = 1,
+        .highres_exposure = 50,
+        .stride = 1,
+        .window = 600,
+        .pulse_window = 200,
+        .serial_latency_ms = 50,
+        .tolerance_us = 100,
+    };
+    const char *mode = "both";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:s:p:h:t:w:W:l:ue:r:v")) != -1)
+    {
+        switch (opt)
+        {
+            case 'm': mode = optarg; break;
+            case 's': c.seconds = atoi(optarg); break;
+            case 'p': c.pulsecounter_exposure = atoi(optarg); break;
+            case 'h': c.highres_exposure = atoi(optarg); break;
+            case 't': c.stride = atoi(optarg); break;
+            case 'w': c.window = strtoull(optarg, NULL, 0); break;
+            case 'W': c.pulse_window = strtoull(optarg, NULL, 0); break;
+            case 'l': c.serial_latency_ms = atof(optarg); break;
+            case 'u': c.usb_traffic = true; break;
+            case 'e': c.tolerance_us = atof(optarg); break;
+            case 'r': c.seed = strtoull(optarg, NULL, 0); break;
+            case 'v': c.verbose = true; break;
+            default: print_usage(); return 1;
+        }
+    }
+
+    if (argc - optind != 1 || !c.seconds || !c.pulsecounter_exposure || !c.highres_exposure || !c.stride)
+    {
+        print_usage();
+        return 1;
+    }
+
+    int status = 0, s;
+    if (!strcmp(mode, "pulsecounter") || !strcmp(mode, "both"))
+        if ((s = run_mode(argv[optind], &c, PROTOCOL_MODE_PULSECOUNTER)) > status)
+            status = s;
+    if (!strcmp(mode, "highres") || !strcmp(mode, "both"))
+        if ((s = run_mode(argv[optind], &c, PROTOCOL_MODE_HIGHRES)) > status)
+            status = s;
+
+    return status;
+}
@@ -0,0 +1,363 @@
+//***************************************************************************
+//
+//  File        : trigarchive.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Converts timer streams to binary archives, and queries them
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "archive.h"
+#include "protocol.h"
+#include "record.h"
+#include "serial.h"
+
+static volatile bool running = true;
+
+static void handle_signal(int sig)
+{
+    (void)sig;
+    running = false;
+}
+
+static void write_bytes(struct archive_writer *w, struct protocol_decoder *d, const uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+        if (protocol_decode_byte(d, data[i]))
+            archive_write_packet(w, &d->packet);
+}
+
+/*
+ * Append the packets from a devreplay recording, a raw capture of the
+ * stream, or a live serial port (until interrupted) to an archive
+ */
+static int convert(const char *input, const char *path)
+{
+    struct archive_writer w;
+    if (!archive_writer_open(&w, path))
+        return 1;
+
+    struct protocol_decoder d;
+    protocol_decoder_init(&d);
+    uint64_t start = w.count;
+
+    struct stat st;
+    if (!stat(input, &st) && S_ISCHR(st.st_mode))
+    {
+        int fd = serial_open(input, SERIAL_DEFAULT_BAUD);
+        if (fd == -1)
+            return 1;
+
+        signal(SIGINT, handle_signal);
+        signal(SIGTERM, handle_signal);
+        while (running)
+        {
+            struct pollfd pfd = {.fd = fd, .events = POLLIN};
+            if (poll(&pfd, 1, 1000) <= 0)
+                continue;
+
+            uint8_t buf[256];
+            ssize_t length = read(fd, buf, sizeof(buf));
+            if (length <= 0)
+                break;
+            write_bytes(&w, &d, buf, length);
+        }
+        close(fd);
+    }
+    else
+    {
+        FILE *f = fopen(input, "rb");
+        if (!f)
+        {
+            fprintf(stderr, "Failed to open %s: %s\n", input, strerror(errno));
+            return 1;
+        }
+
+        char magic[8];
+        bool recording = fread(magic, 1, 8, f) == 8 && !memcmp(magic, RECORD_MAGIC, 8);
+        if (recording)
+        {
+            struct record_chunk *chunk = malloc(sizeof(struct record_chunk));
+            while (record_read(f, chunk))
+                if (chunk->direction == RECORD_FROM_DEVICE)
+                    write_bytes(&w, &d, chunk->data, chunk->length);
+            free(chunk);
+        }
+        else
+        {
+            rewind(f);
+            uint8_t buf[65536];
+            size_t length;
+            while ((length = fread(buf, 1, sizeof(buf), f)) > 0)
+                write_bytes(&w, &d, buf, length);
+        }
+        fclose(f);
+    }
+
+    if (!archive_writer_close(&w))
+    {
+        fprintf(stderr, "Failed to write %s\n", path);
+        return 1;
+    }
+
+    fprintf(stderr, "Appended %llu records (%u corrupted packets skipped)\n",
+            (unsigned long long)(w.count - start), d.errors);
+    return 0;
+}
+
+static void print_record(uint64_t i, const struct archive_record *r)
+{
+    printf("%llu %lld.%09lld frame=%u ", (unsigned long long)i, (long long)(r->time_ns / 1000000000LL),
+           (long long)(r->time_ns % 1000000000LL), r->frame);
+
+    switch (r->type)
+    {
+        case PACKET_TRIGGER:
+            printf("trigger progress=%u", r->exposure_progress);
+            break;
+        case PACKET_TIMESTAMP:
+            printf("timestamp %s", (r->flags & PROTOCOL_TIMESTAMP_LOCKED) ? "locked" : "unlocked");
+            break;
+        case PACKET_STATUS:
+            printf("status timer=%u gps=%u", r->timer, r->gps);
+            break;
+        case PACKET_STOP_EXPOSURE:
+            printf("stop");
+            break;
+        default:
+            printf("type=%c", r->type);
+            break;
+    }
+
+    printf("%s\n", (r->flags & ARCHIVE_FLAG_LATE) ? " late" : "");
+}
+
+static int dump(const char *path, uint64_t first, uint64_t count)
+{
+    struct archive_reader r;
+    if (!archive_reader_open(&r, path))
+        return 1;
+
+    for (uint64_t i = first; i < r.count && i - first < count; i++)
+        print_record(i, &r.records[i]);
+
+    archive_reader_close(&r);
+    return 0;
+}
+
+static int find(const char *path, const char *kind, const char *value)
+{
+    struct archive_reader r;
+    if (!archive_reader_open(&r, path))
+        return 1;
+
+    int64_t i = -1;
+    if (!strcmp(kind, "time"))
+    {
+        int64_t t = (int64_t)llround(atof(value) * 1e9);
+        uint64_t found = archive_find_time(&r, t);
+        if (found < r.count)
+            i = found;
+    }
+    else if (!strcmp(kind, "frame"))
+        i = archive_find_frame(&r, strtoul(value, NULL, 0));
+
+    if (i >= 0)
+        print_record(i, &r.records[i]);
+    else
+        printf("not found\n");
+
+    archive_reader_close(&r);
+    return i >= 0 ? 0 : 1;
+}
+
+/*
+ * Generate an archive holding a sequence of frames at a fixed rate, with a
+ * timestamp and status packet every second, written through the same path
+ * as converted streams
+ */
+static int synth(const char *path, uint32_t frames, unsigned rate)
+{
+    struct archive_writer w;
+    if (!archive_writer_open(&w, path))
+        return 1;
+
+    // 2013-01-01 00:00:00
+    int64_t second = 1356998400;
+    uint32_t written = 0;
+    struct protocol_packet p;
+
+    while (written < frames)
+    {
+        time_t now = second;
+        struct tm tm;
+        gmtime_r(&now, &tm);
+
+        struct protocol_timestamp t = {
+            .year = tm.tm_year + 1900, .month = tm.tm_mon + 1, .day = tm.tm_mday,
+            .hours = tm.tm_hour, .minutes = tm.tm_min, .seconds = tm.tm_sec,
+            .flags = PROTOCOL_TIMESTAMP_LOCKED
+        };
+
+        // As sent by the firmware: triggers in the first part of the
+        // second arrive before the timestamp for that second
+        for (unsigned i = 0; i < rate && written < frames; i++)
+        {
+            t.milliseconds = i * 1000 / rate;
+            t.exposure_progress = 0;
+            p.type = PACKET_TRIGGER;
+            p.length = PROTOCOL_TIMESTAMP_LENGTH;
+            protocol_pack_timestamp(&t, p.data);
+            archive_write_packet(&w, &p);
+            written++;
+
+            if (i == 0)
+            {
+                t.milliseconds = 0;
+                p.type = PACKET_TIMESTAMP;
+                protocol_pack_timestamp(&t, p.data);
+                archive_write_packet(&w, &p);
+
+                p.type = PACKET_STATUS;
+                p.length = 2;
+                p.data[0] = PROTOCOL_TIMER_EXPOSING;
+                p.data[1] = PROTOCOL_GPS_ACTIVE;
+                archive_write_packet(&w, &p);
+            }
+        }
+
+        second++;
+    }
+
+    if (!archive_writer_close(&w))
+        return 1;
+
+    fprintf(stderr, "Wrote %u frames (%llu records)\n", frames, (unsigned long long)w.count);
+    return 0;
+}
+
+static uint64_t rng_state = 1;
+static uint64_t random_next()
+{
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+/*
+ * Time random lookups by time and by frame number, with a linear scan
+ * (equivalent to grepping a text log) for comparison
+ */
+static int bench(const char *path, unsigned lookups)
+{
+    struct archive_reader r;
+    if (!archive_reader_open(&r, path))
+        return 1;
+
+    if (!r.count)
+    {
+        fprintf(stderr, "%s is empty\n", path);
+        return 1;
+    }
+
+    int64_t first = r.records[0].time_ns;
+    int64_t span = r.records[r.count - 1].time_ns - first + 1;
+    uint32_t frames = r.records[r.count - 1].frame + 1;
+    uint64_t checksum = 0;
+
+    int64_t start = serial_time_ns(CLOCK_MONOTONIC);
+    for (unsigned i = 0; i < lookups; i++)
+        checksum += archive_find_time(&r, first + (int64_t)(random_next() % span));
+    double time_ns = (double)(serial_time_ns(CLOCK_MONOTONIC) - start) / lookups;
+
+    start = serial_time_ns(CLOCK_MONOTONIC);
+    for (unsigned i = 0; i < lookups; i++)
+        checksum += archive_find_frame(&r, random_next() % frames);
+    double frame_ns = (double)(serial_time_ns(CLOCK_MONOTONIC) - start) / lookups;
+
+    // A handful of linear scans is enough to show the difference
+    unsigned scans = lookups < 10 ? lookups : 10;
+    start = serial_time_ns(CLOCK_MONOTONIC);
+    for (unsigned i = 0; i < scans; i++)
+    {
+        int64_t target = first + (int64_t)(random_next() % span);
+        uint64_t j = 0;
+        while (j < r.count && r.records[j].time_ns < target)
+            j++;
+        checksum += j;
+    }
+    double scan_ns = scans ? (double)(serial_time_ns(CLOCK_MONOTONIC) - start) / scans : 0;
+
+    printf("{\"records\": %llu, \"frames\": %u, \"bytes\": %zu, \"lookups\": %u, "
+           "\"time_lookup_ns\": %.0f, \"frame_lookup_ns\": %.0f, \"linear_scan_ns\": %.0f, \"checksum\": %llu}\n",
+           (unsigned long long)r.count, frames, r.data_size + r.index_size, lookups,
+           time_ns, frame_ns, scan_ns, (unsigned long long)checksum);
+
+    archive_reader_close(&r);
+    return 0;
+}
+
+static void print_usage()
+{
+    printf("Usage: trigarchive convert <recording|capture|port> <archive>\n");
+    printf("       trigarchive dump <archive> [first [count]]\n");
+    printf("       trigarchive find <archive> time <utc seconds> | frame <number>\n");
+    printf("       trigarchive synth <archive> <frames> [rate]\n");
+    printf("       trigarchive bench <archive> [lookups]\n");
+    printf("convert appends to the archive; a serial port is read until interrupted.\n");
+    printf("synth generates frames at rate Hz (default 20) for benchmarking.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        print_usage();
+        return 1;
+    }
+
+    const char *command = argv[1];
+    const char *path = argv[2];
+
+    if (!strcmp(command, "convert") && argc == 4)
+        return convert(argv[2], argv[3]);
+
+    if (!strcmp(command, "dump") && argc <= 5)
+        return dump(path, argc > 3 ? strtoull(argv[3], NULL, 0) : 0,
+                    argc > 4 ? strtoull(argv[4], NULL, 0) : UINT64_MAX);
+
+    if (!strcmp(command, "find") && argc == 5)
+        return find(path, argv[3], argv[4]);
+
+    if (!strcmp(command, "synth") && (argc == 4 || argc == 5))
+    {
+        unsigned rate = argc == 5 ? (unsigned)atoi(argv[4]) : 20;
+        if (rate < 1 || rate > 1000)
+        {
+            print_usage();
+            return 1;
+        }
+        return synth(path, strtoul(argv[3], NULL, 0), rate);
+    }
+
+    if (!strcmp(command, "bench") && argc <= 4)
+        return bench(path, argc == 4 ? (unsigned)atoi(argv[3]) : 1000000);
+
+    print_usage();
+    return 1;
+}
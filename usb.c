@@ -11,17 +11,20 @@
 //***************************************************************************
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <avr/eeprom.h>
 #include <avr/pgmspace.h>
+#include <avr/wdt.h>
 #include <util/atomic.h>
 
 #include "display.h"
 #include "gps.h"
 #include "main.h"
 #include "camera.h"
+#include "diagnostics.h"
 #include "usb.h"
 
 #define MAX_DATA_LENGTH 200
@@ -34,7 +37,16 @@ enum packet_type
     MESSAGE_RAW = 'D',
     START_EXPOSURE = 'E',
     STOP_EXPOSURE = 'F',
+    ABORT_EXPOSURE = 'G',
     STATUS = 'H',
+    PPS_PHASE = 'I',
+    FORECAST = 'J',
+    RECOVERY = 'K',
+    FRAMES = 'L',
+    LINK_STATS = 'M',
+    INTEGRITY = 'N',
+    START_EDGE = 'O',
+    BENCHMARK = 'Q',
     ENABLE_RELAY = 'R',
 };
 
@@ -45,6 +57,17 @@ struct packet_startexposure
     uint16_t exposure;
     uint8_t stride;
     uint8_t align_first;
+
+    // Optional: older hosts send the packet without this field
+    enum external_start external_start;
+};
+
+// The time of a triggered exposure, and its number in the sequence so
+// that unreported exposures can be placed on the exposure grid
+struct packet_trigger
+{
+    struct timestamp time;
+    uint32_t frame;
 };
 
 struct packet_status
@@ -53,6 +76,29 @@ struct packet_status
     enum gps_status gps;
 };
 
+// Times of the next count triggers: offset ms after base, then every period ms
+// Times are reported exactly as the TRIGGER packets will report them
+struct packet_forecast
+{
+    struct timestamp base;
+    uint32_t offset;
+    uint32_t period;
+    uint8_t count;
+    uint8_t revision;
+};
+
+// Bytes sent for each packet type ('A' to 'R'), including framing,
+// and the send buffer occupancy since the last START_EXPOSURE
+#define LINK_STATS_TYPES ('R' - 'A' + 1)
+struct packet_link_stats
+{
+    uint16_t seconds;
+    uint16_t projected;
+    uint8_t high_water;
+    uint16_t stalls;
+    uint32_t bytes[LINK_STATS_TYPES];
+};
+
 struct packet_message
 {
     uint8_t length;
@@ -80,24 +126,72 @@ const char long_packet_fmt[]     PROGMEM = "Ignoring long packet: %c (length %u)
 const char checksum_failed_fmt[] PROGMEM = "Packet checksum failed. Got 0x%02x, expected 0x%02x";
 const char invalid_packet_fmt[]  PROGMEM = "Invalid packet end byte. Got 0x%02x, expected 0x%02x";
 const char got_packet_fmt[]      PROGMEM = "Got packet type '%c'";
+const char link_warning_fmt[]    PROGMEM = "WARNING: Projected link load is %u of %u bytes/s";
+const char link_thinned_fmt[]    PROGMEM = "WARNING: Projected link load is %u of %u bytes/s: not every trigger will be reported";
+const char link_rejected_fmt[]   PROGMEM = "Rejecting sequence: projected link load is %u of %u bytes/s at the maximum stride of %u";
+const char benchmark_busy_msg[]  PROGMEM = "Ignoring benchmark request: the timer is not idle";
+
+// 9600 baud with a start and stop bit per byte
+#define LINK_CAPACITY 960
+
+// Start a sequence with a warning above this load, and reject it above LINK_CAPACITY
+#define LINK_WARNING (LINK_CAPACITY * 3 / 4)
+
+// $$, type, length, checksum, \r\n
+#define PACKET_OVERHEAD 7
+
+// Number of triggers announced in each FORECAST packet
+#define FORECAST_COUNT 16
+
+// Double the reporting stride when the send buffer is more than half full
+// at a trigger, and halve it again after this many triggers below a quarter
+#define REPORT_HIGH_WATER 128
+#define REPORT_LOW_WATER 64
+#define REPORT_CALM_TRIGGERS 16
+
+// Incremented whenever the trigger schedule changes, so that the host can
+// discard forecasts made under the old schedule
+static uint8_t forecast_revision = 0;
 
 static uint8_t input_buffer[256];
 static uint8_t input_read = 0;
 static volatile uint8_t input_write = 0;
 
+// Complete START_EXPOSURE packets framed by the receive interrupt but not
+// yet parsed, and stops applied by the receive interrupt but not yet parsed
+static volatile uint8_t queued_starts = 0;
+static volatile uint8_t early_stops = 0;
+
 static uint8_t output_buffer[256];
 static volatile uint8_t output_read = 0;
 static volatile uint8_t output_write = 0;
 
+static struct packet_link_stats link_stats;
+
 // Add a byte to the send buffer.
 // Will block if the buffer is full
 static void queue_byte(uint8_t b)
 {
     // Don't overwrite data that hasn't been sent yet
-    while (output_write == (uint8_t)(output_read - 1));
+    if (output_write == (uint8_t)(output_read - 1) && link_stats.stalls != 0xFFFF)
+        link_stats.stalls++;
+
+    // A full buffer drains at ~1 byte/ms, so a pass of the main loop that
+    // queues a long backlog can outlast the watchdog without being hung.
+    // Feed it only once the transmitter has freed a byte, so that a
+    // transmitter that has stopped still ends in a reset
+    if (output_write == (uint8_t)(output_read - 1))
+    {
+        while (output_write == (uint8_t)(output_read - 1));
+        wdt_reset();
+    }
 
     output_buffer[output_write++] = b;
 
+    uint8_t used = output_write - output_read;
+    if (used > link_stats.high_water)
+        link_stats.high_water = used;
+
     // Enable transmit if necessary
     UCSR0B |= _BV(UDRIE0);
 }
@@ -105,6 +199,9 @@ static void queue_byte(uint8_t b)
 // Send data from RAM
 static void queue_data(uint8_t type, const void *data, uint8_t length)
 {
+    if (type >= 'A' && type < 'A' + LINK_STATS_TYPES)
+        link_stats.bytes[type - 'A'] += length + PACKET_OVERHEAD;
+
     // Header
     queue_byte('$');
     queue_byte('$');
@@ -148,9 +245,95 @@ ISR(USART0_UDRE_vect)
         UCSR0B &= ~_BV(UDRIE0);
 }
 
+/*
+ * Stop sending triggers. Called from the receive interrupt as soon as a
+ * STOP_EXPOSURE or ABORT_EXPOSURE packet has been received, so that the
+ * number of frames doesn't depend on how busy the main loop is.
+ * STOP_EXPOSURE then waits for the camera to finish reading out, while
+ * ABORT_EXPOSURE ends the sequence immediately
+ */
+static void stop_sequence(bool immediate)
+{
+    // Disable the exposure countdown immediately
+    STOP_MILLISECOND_TIMER;
+    millisecond_count = 0;
+    external_start_configure(EXTERNAL_START_NONE);
+    camera_stop_capture();
+
+    // Hand Timer1 back to the millisecond count, discarding any compare
+    // matches left by the shadow clock or the frame capture
+    TIFR1 = _BV(OCF1A) | _BV(OCF1B) | _BV(ICF1);
+    TIMSK1 = _BV(OCIE1A);
+
+    // These are only accessed from interrupt context
+    // when timer_status == ALIGN,EXPOSING,READOUT, and
+    // we are in an interrupt so this is atomic
+    exposure_total = 0;
+    exposure_countdown = 0;
+
+    if (immediate)
+        camera_abort_exposing();
+    else
+        camera_stop_exposing();
+}
+
 ISR(USART0_RX_vect)
 {
-    input_buffer[(uint8_t)(input_write++)] = UDR0;
+    // Track the packet framing in the same way as usb_tick(), so that
+    // a stop command can be recognised when its final byte arrives
+    static enum packet_state state = HEADERA;
+    static uint8_t type, length, remaining, checksum;
+
+    uint8_t b = UDR0;
+    input_buffer[(uint8_t)(input_write++)] = b;
+
+    switch (state)
+    {
+        case HEADERA:
+        case HEADERB:
+            state = b == '$' ? state + 1 : HEADERA;
+            break;
+        case TYPE:
+            type = b;
+            state++;
+            break;
+        case LENGTH:
+            length = remaining = b;
+            checksum = 0;
+            if (length == 0)
+                state = CHECKSUM;
+            else if (length <= MAX_DATA_LENGTH + 1)
+                state = DATA;
+            else
+                state = HEADERA;
+            break;
+        case DATA:
+            checksum ^= b;
+            if (--remaining == 0)
+                state = CHECKSUM;
+            break;
+        case CHECKSUM:
+            state = b == checksum ? FOOTERA : HEADERA;
+            break;
+        case FOOTERA:
+            state = b == '\r' ? FOOTERB : HEADERA;
+            break;
+        case FOOTERB:
+            if (b == '\n' && type == START_EXPOSURE)
+                queued_starts++;
+            else if (b == '\n' && length == 0 && (type == STOP_EXPOSURE || type == ABORT_EXPOSURE))
+            {
+                // A start still in the input buffer must be applied first,
+                // so leave the stop for parse_packet() to handle in order
+                if (!queued_starts)
+                {
+                    stop_sequence(type == ABORT_EXPOSURE);
+                    early_stops++;
+                }
+            }
+            state = HEADERA;
+            break;
+    }
 }
 
 void usb_initialize()
@@ -170,6 +353,42 @@ void usb_initialize()
     output_read = output_write = 0;
 }
 
+/*
+ * Average bytes per second that a sequence will send
+ *
+ * Every second brings a TIMESTAMP, plus a FORECAST (or a partial FRAMES
+ * batch) and a PPS_PHASE when the millisecond timer is running. Each
+ * triggered exposure sends a TRIGGER, and each exposure a pair of STATUS
+ * changes unless they are suppressed for short exposures. In
+ * MODE_CAMERAMASTER the frame rate is set by the camera, so only the
+ * fixed load can be projected
+ */
+static uint16_t projected_link_load(enum timing_mode mode, uint16_t exposure, uint8_t stride)
+{
+    uint32_t load = PACKET_OVERHEAD + sizeof(struct timestamp);
+    if (mode != MODE_PULSECOUNTER)
+        load += PACKET_OVERHEAD + sizeof(struct pps_phase);
+
+    if (mode == MODE_CAMERAMASTER)
+        return load + PACKET_OVERHEAD + offsetof(struct frame_batch, offsets);
+
+    load += PACKET_OVERHEAD + sizeof(struct packet_forecast);
+    if (exposure == 0 || stride == 0)
+        return load;
+
+    // Work in bytes per 1000s to keep precision for ms exposures
+    uint32_t exposures_per_ks = mode == MODE_HIGHRES ? 1000000UL / exposure : 1000UL / exposure;
+    uint32_t exposure_bytes = 0;
+    if (mode != MODE_HIGHRES || exposure >= 500)
+        exposure_bytes = 2 * (PACKET_OVERHEAD + sizeof(struct packet_status));
+
+    uint32_t trigger_bytes = PACKET_OVERHEAD + sizeof(struct packet_trigger);
+    load = load * 1000 + exposure_bytes * exposures_per_ks + trigger_bytes * exposures_per_ks / stride;
+    load /= 1000;
+
+    return load > 0xFFFF ? 0xFFFF : load;
+}
+
 static void parse_packet(struct timer_packet *p)
 {
     usb_send_message_fmt_P(got_packet_fmt, p->type);
@@ -179,13 +398,47 @@ static void parse_packet(struct timer_packet *p)
         {
             struct packet_startexposure *data = &p->data.startexp;
 
+            // Refuse sequences that would fill the send buffer faster than it
+            // drains, even once adapt_report_stride() has thinned the triggers
+            uint16_t load = projected_link_load(data->mode, data->exposure, data->stride);
+            uint8_t max_stride = data->stride;
+            while (max_stride && max_stride <= 0xFF / 2)
+                max_stride *= 2;
+
+            uint16_t min_load = projected_link_load(data->mode, data->exposure, max_stride);
+            if (min_load > LINK_CAPACITY)
+            {
+                // Nothing has started or stopped: any running sequence continues
+                usb_send_message_fmt_P(link_rejected_fmt, min_load, LINK_CAPACITY, max_stride);
+                break;
+            }
+
+            if (load > LINK_CAPACITY)
+                usb_send_message_fmt_P(link_thinned_fmt, load, LINK_CAPACITY);
+            else if (load > LINK_WARNING)
+                usb_send_message_fmt_P(link_warning_fmt, load, LINK_CAPACITY);
+
+            memset(&link_stats, 0, sizeof(struct packet_link_stats));
+            link_stats.projected = load;
+
             timing_mode = data->mode;
+            forecast_revision++;
 
             // These are only accessed from interrupt context
             // when timer_status == ALIGN,EXPOSING,READOUT so
             // these is safe to modify with interrupts enabled
             exposure_countdown = exposure_total = data->exposure;
-            trigger_countdown = trigger_stride = data->stride;
+            trigger_countdown = trigger_stride = report_stride = data->stride;
+
+            if (timing_mode == MODE_CAMERAMASTER)
+            {
+                // The camera sets the exposure: the field instead gives
+                // the number of frames to send in each FRAMES packet
+                camera_start_capture(data->exposure);
+                exposure_countdown = exposure_total = 0;
+            }
+            else
+                camera_stop_capture();
 
             // align_boundary is 8-bit, so use a temporary variable
             uint16_t temp_boundary = exposure_total;
@@ -199,6 +452,17 @@ static void parse_packet(struct timer_packet *p)
 
             align_boundary = temp_boundary;
 
+            // An externally started sequence has no fixed grid to resume on
+            enum external_start edge = EXTERNAL_START_NONE;
+            if (p->length >= sizeof(struct packet_startexposure))
+                edge = data->external_start;
+
+            external_start_configure(edge);
+            if (edge == EXTERNAL_START_NONE)
+                recovery_start_sequence(data->use_monitor);
+            else
+                recovery_stop_sequence();
+
             camera_start_exposing(data->use_monitor);
 
             // Update display configuration for new sequence
@@ -206,17 +470,31 @@ static void parse_packet(struct timer_packet *p)
             break;
         }
         case STOP_EXPOSURE:
-            // Disable the exposure countdown immediately
-            STOP_MILLISECOND_TIMER;
-            millisecond_count = 0;
-
-            // These are only accessed from interrupt context
-            // when timer_status == ALIGN,EXPOSING,READOUT so
-            // these is safe to modify with interrupts enabled
-            exposure_total = 0;
-            exposure_countdown = 0;
+        case ABORT_EXPOSURE:
+            // Triggers were normally halted by the receive interrupt, unless
+            // the stop arrived while an earlier start was still queued
+            ATOMIC_BLOCK(ATOMIC_FORCEON)
+            {
+                if (early_stops)
+                    early_stops--;
+                else
+                    stop_sequence(p->type == ABORT_EXPOSURE);
+            }
+            recovery_stop_sequence();
 
-            camera_stop_exposing();
+            // Cancel any announced triggers
+            forecast_revision++;
+            usb_send_forecast();
+            break;
+        case LINK_STATS:
+            usb_send_link_stats();
+            break;
+        case BENCHMARK:
+            // The benchmarks take over Timer1 and stall the main loop
+            if (timer_status == TIMER_IDLE)
+                diagnostics_run();
+            else
+                usb_send_message_P(benchmark_busy_msg);
             break;
         case ENABLE_RELAY:
             eeprom_update_byte(RELAY_EEPROM_OFFSET, RELAY_ENABLED);
@@ -228,6 +506,77 @@ static void parse_packet(struct timer_packet *p)
     }
 }
 
+/*
+ * Add a received byte to packet p
+ * Returns true once p holds a complete and valid packet
+ */
+static bool process_byte(struct timer_packet *p, uint8_t b)
+{
+    bool complete = false;
+    switch (p->state)
+    {
+        case HEADERA:
+        case HEADERB:
+            if (b == '$')
+                p->state++;
+            else
+                p->state = HEADERA;
+            break;
+        case TYPE:
+            p->type = b;
+            p->state++;
+            break;
+        case LENGTH:
+            p->length = b;
+            p->progress = 0;
+            p->checksum = 0;
+            if (p->length == 0)
+                p->state = CHECKSUM;
+            else if (p->length <= sizeof(p->data))
+                p->state++;
+            else
+            {
+                usb_send_message_fmt_P(long_packet_fmt, p->type, p->length);
+                p->state = HEADERA;
+            }
+            break;
+        case DATA:
+            p->checksum ^= b;
+            p->data.bytes[p->progress++] = b;
+            if (p->progress == p->length)
+                p->state++;
+            break;
+        case CHECKSUM:
+            if (p->checksum == b)
+                p->state++;
+            else
+            {
+                usb_send_message_fmt_P(checksum_failed_fmt, b, p->checksum);
+                p->state = HEADERA;
+            }
+            break;
+        case FOOTERA:
+            if (b == '\r')
+                p->state++;
+            else
+            {
+                usb_send_message_fmt_P(invalid_packet_fmt, b, '\r');
+                p->state = HEADERA;
+            }
+            break;
+        case FOOTERB:
+            if (b == '\n')
+                complete = true;
+            else
+                usb_send_message_fmt_P(invalid_packet_fmt, b, '\n');
+
+            p->state = HEADERA;
+            break;
+    }
+
+    return complete;
+}
+
 void usb_tick()
 {
     static struct timer_packet p = {.state = HEADERA};
@@ -237,69 +586,35 @@ void usb_tick()
         if (timer_status == TIMER_RELAY)
             gps_send_byte(b);
 
-        switch (p.state)
+        if (process_byte(&p, b))
         {
-            case HEADERA:
-            case HEADERB:
-                if (b == '$')
-                    p.state++;
-                else
-                    p.state = HEADERA;
-                break;
-            case TYPE:
-                p.type = b;
-                p.state++;
-                break;
-            case LENGTH:
-                p.length = b;
-                p.progress = 0;
-                p.checksum = 0;
-                if (p.length == 0)
-                    p.state = CHECKSUM;
-                else if (p.length <= sizeof(p.data))
-                    p.state++;
-                else
-                {
-                    usb_send_message_fmt_P(long_packet_fmt, p.type, p.length);
-                    p.state = HEADERA;
-                }
-                break;
-            case DATA:
-                p.checksum ^= b;
-                p.data.bytes[p.progress++] = b;
-                if (p.progress == p.length)
-                    p.state++;
-                break;
-            case CHECKSUM:
-                if (p.checksum == b)
-                    p.state++;
-                else
+            if (p.type == START_EXPOSURE)
+                ATOMIC_BLOCK(ATOMIC_FORCEON)
                 {
-                    usb_send_message_fmt_P(checksum_failed_fmt, b, p.checksum);
-                    p.state = HEADERA;
+                    if (queued_starts)
+                        queued_starts--;
                 }
-                break;
-            case FOOTERA:
-                if (b == '\r')
-                    p.state++;
-                else
-                {
-                    usb_send_message_fmt_P(invalid_packet_fmt, b, '\r');
-                    p.state = HEADERA;
-                }
-                break;
-            case FOOTERB:
-                if (b == '\n')
-                    parse_packet(&p);
-                else
-                    usb_send_message_fmt_P(invalid_packet_fmt, b, '\n');
-    
-                p.state = HEADERA;
-                break;
+
+            parse_packet(&p);
         }
     }
 }
 
+/*
+ * Run a separate parser over data, without acting on the packets
+ * Used to measure the parsing cost on synthetic input
+ * Returns true if the data contained a valid packet
+ */
+bool usb_parse_bytes(const uint8_t *data, uint8_t length)
+{
+    struct timer_packet p = {.state = HEADERA};
+    bool complete = false;
+    for (uint8_t i = 0; i < length; i++)
+        complete |= process_byte(&p, data[i]);
+
+    return complete;
+}
+
 void usb_send_message_P(const char *string)
 {
     struct packet_message msg;
@@ -336,15 +651,126 @@ void usb_send_timestamp()
         count = exposure_countdown;
     }
     current_timestamp.exposure_progress = exposure_total - count;
+    link_stats.seconds++;
 
     queue_data(TIMESTAMP, &current_timestamp, sizeof(struct timestamp));
 }
 
+/*
+ * Report fewer exposures while the serial link can't keep up, and return
+ * to the configured stride once it has caught up. The stride stays a
+ * multiple of trigger_stride, and each report carries its frame number,
+ * so the unreported exposures can still be placed on the exposure grid
+ */
+static void adapt_report_stride()
+{
+    static uint8_t calm = 0;
+    uint8_t used = output_write - output_read;
+    uint8_t stride = report_stride;
+
+    if (used > REPORT_HIGH_WATER)
+    {
+        calm = 0;
+        if (stride <= 0xFF / 2)
+            stride *= 2;
+    }
+    else if (used < REPORT_LOW_WATER && stride > trigger_stride)
+    {
+        if (++calm == REPORT_CALM_TRIGGERS)
+        {
+            calm = 0;
+            stride /= 2;
+        }
+    }
+    else
+        calm = 0;
+
+    if (stride != report_stride)
+    {
+        // Announced triggers no longer follow the schedule
+        report_stride = stride;
+        forecast_revision++;
+    }
+}
+
 void usb_send_trigger()
 {
     // This is non-atomic, but something is very wrong if this
     // doesn't get sent before the next exposure is triggered
-    queue_data(TRIGGER, (void *)&download_timestamp, sizeof(struct timestamp));
+    struct packet_trigger data = {
+        .time = download_timestamp,
+        .frame = download_frame
+    };
+
+    queue_data(TRIGGER, &data, sizeof(struct packet_trigger));
+    adapt_report_stride();
+}
+
+void usb_send_pps_phase()
+{
+    // Only modified by the main loop
+    queue_data(PPS_PHASE, (void *)&pps_phase, sizeof(struct pps_phase));
+}
+
+void usb_send_start_edge()
+{
+    // Only modified in the start input interrupt, which is disabled once it has fired
+    queue_data(START_EDGE, (void *)&start_edge, sizeof(struct pps_phase));
+}
+
+void usb_send_forecast()
+{
+    struct packet_forecast data;
+    uint16_t exposures;
+    uint8_t triggers;
+
+    // The schedule counts milliseconds in MODE_HIGHRES and seconds otherwise
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+    {
+        data.base = current_timestamp;
+        data.base.milliseconds = millisecond_count;
+        exposures = exposure_countdown;
+        triggers = trigger_countdown;
+    }
+
+    uint16_t scale = timing_mode == MODE_HIGHRES ? 1 : 1000;
+    data.offset = (exposures + (uint32_t)(triggers - 1) * exposure_total) * scale;
+    data.period = (uint32_t)exposure_total * report_stride * scale;
+    data.count = exposure_total && triggers ? FORECAST_COUNT : 0;
+    data.revision = forecast_revision;
+    queue_data(FORECAST, &data, sizeof(struct packet_forecast));
+}
+
+void usb_send_recovery()
+{
+    // Only modified before the resume pulse, which happens once
+    queue_data(RECOVERY, (void *)&recovery_event, sizeof(struct recovery_event));
+}
+
+void usb_send_frames(const struct frame_batch *b)
+{
+    queue_data(FRAMES, b, offsetof(struct frame_batch, offsets) + b->count * sizeof(uint32_t));
+}
+
+void usb_send_integrity()
+{
+    queue_data(INTEGRITY, &integrity_event, sizeof(struct integrity_event));
+}
+
+void usb_send_link_stats()
+{
+    queue_data(LINK_STATS, &link_stats, sizeof(struct packet_link_stats));
+}
+
+void usb_send_benchmark(const struct benchmark_result *r)
+{
+    queue_data(BENCHMARK, r, sizeof(struct benchmark_result));
+}
+
+// Number of bytes waiting in the send buffer
+uint8_t usb_send_pending()
+{
+    return output_write - output_read;
 }
 
 void usb_stop_exposure()
@@ -11,19 +11,33 @@
 //***************************************************************************
 
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #ifndef KARAKA_USB_H
 #define KARAKA_USB_H
 
+struct frame_batch;
+struct benchmark_result;
+
 void usb_initialize();
 void usb_tick();
+bool usb_parse_bytes(const uint8_t *data, uint8_t length);
+uint8_t usb_send_pending();
 
 void usb_send_message_P(const char *string);
 void usb_send_message_fmt_P(const char *fmt, ...);
 void usb_send_raw(uint8_t *data, uint8_t length);
 void usb_send_timestamp();
 void usb_send_trigger();
+void usb_send_pps_phase();
+void usb_send_start_edge();
+void usb_send_forecast();
+void usb_send_recovery();
+void usb_send_frames(const struct frame_batch *b);
+void usb_send_link_stats();
+void usb_send_integrity();
+void usb_send_benchmark(const struct benchmark_result *r);
 void usb_send_status(enum timer_status timer, enum gps_status gps);
 void usb_stop_exposure();
 